@@ -1,14 +1,63 @@
-#define USE_SCORE_BUCKETS 0
+#define USE_INCREMENTAL_BOARD 1
+#define USE_BITBOARD_MOVEGEN 1
+
+// Headless build: compile with -DENGINE_HEADLESS=1 for an engine that only runs the driver protocol, without the menu UI.
+#ifndef ENGINE_HEADLESS
+#define ENGINE_HEADLESS 0
+#endif
+
+// Profiling build: compile with -DENGINE_PROFILE=1 to count the cycles of each phase of examining nodes (see profilePhases).
+#ifndef ENGINE_PROFILE
+#define ENGINE_PROFILE 0
+#endif
+
+// Checked build: compile with -DENGINE_DEBUG_VERIFY=1 to verify boards and evals while calculating and print any problems found.
+#ifndef ENGINE_DEBUG_VERIFY
+#define ENGINE_DEBUG_VERIFY 0
+#endif
+
+// Syzygy tablebases: compile with -DUSE_SYZYGY=1 and the Fathom probing code (tbprobe.h and tbprobe.c) to probe them.
+#ifndef USE_SYZYGY
+#define USE_SYZYGY 0
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <math.h>
+#include <limits.h>
 #include <time.h>
-#include <conio.h>
-#include <windows.h>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(_WIN32)
+#include <conio.h>
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if USE_SYZYGY
+#include "tbprobe.h"
+#endif
 
 using namespace std;
 
@@ -30,19 +79,63 @@ The evaluation process is a repetition of only one operation which contains mult
 if we are past the evaluation time limit or the user types something, stop evaluating.)
 This operation is conducted as follows:
 - Pop the first future index from the queue of futures to check next, call it P for parent.
-- Find all moves, create new futures to be P's children corresponding to the resulting positions and evaluate them using the evalBoards, king locations, checks and attacks, and any other metrics.
+- Find all moves, create new futures to be P's children corresponding to the resulting positions and evaluate them using the piece-square table, king locations, checks and attacks, and any other metrics.
 - Add those futures to the futures list.
 - Get the best eval going up the tree to keep every node's eval up-to-date.
 - Get P's score by summing eval differences from P up to the root.
 - Get the scores of P's children as eval differences from P.
 - Add those futures to the queue based on their scores.
 
-The queue may be either a min heap or a bucket list.
+The queue may be either a min heap with 2, 4, or 8 children per entry or a bucket list, chosen with queueType.
+A child's score is its parent's score plus how much worse its eval is than its best sibling's, for the player choosing between them,
+plus scoreDepthPenalty, so the most promising lines are examined first however deep they are.
+Nodes deeper than evaluationDepthLimit are stashed instead of queued, and are queued if the limit is raised during the evaluation.
+
+With lazyExpansion, the children of a popped node (other than the root) are made from its moves with the evals of their
+positions only, and queued without finding their own moves. A child's moves are found when it is popped, and the
+positions after them become its children in turn, so each examined node generates moves once instead of once per child,
+and no moves are stored at all below the root's children. Since a child only gets the eval of looking one move further
+when it is popped, its first score is less exact, including for moves that turn out to be checkmate or stalemate.
+
+Each thread keeps its calculating board at the last node it examined (USE_INCREMENTAL_BOARD).
+To reach the next node, it undoes moves back to the common ancestor of the two nodes and replays only the moves below it,
+so examining a node costs the distance between consecutive nodes rather than the depth of the node.
+Otherwise every node is reached by replaying all moves from the root.
+
+Every node stores the 64-bit Zobrist key of its position, updated incrementally when its move is played.
+A transposition table shared by all threads maps keys to the nodes holding them.
+When a new node's position is already in the tree (a move-order permutation), the node is linked to the existing node
+and takes its eval from there instead of generating moves and being queued again. Every node keeps a list of the nodes linked
+to it (nodeLinks), and a change of its eval is backtracked from each of them too, so their parents stay up to date.
+A node whose position already occurred on its path from the root, or in the game before the root (gameKeys, see the gh command),
+or whose 50-move rule counter reached 100, is a draw: it is marked DRAW with DRAW_EVAL and gets no moves or children.
+Only every second position since the last capture or pawn move is compared, since no earlier position can recur.
+A node whose endgame result is known is terminal the same way (probeEndgame()): positions where no side can checkmate
+are draws, and with USE_SYZYGY, positions in the loaded Syzygy tablebases take their WDL result (TABLEBASE_WIN_EVAL for a win).
+
+Before the root is searched, it is looked up in the tablebases and then in the opening book (see the ob command), a sorted
+file of 16-byte entries (the position key, the move, and its weight) mapped into memory and searched by key.
+A hit is played without a search: the root's children are added for the output, but nothing is queued, so the threads
+stop at once, and the found move is the first choice whatever its eval. The file is a Polyglot book: the keys are Polyglot
+keys (bookKey()), so books made by other programs can be used as well as books written by the engine (the ab and wb commands).
+
+When a thread runs out of node or move memory, it pauses the other threads between examinations and reclaims memory.
+Expanded nodes whose eval is more than reclaimEvalMargin worse than their best sibling's lose their subtrees and keep their last eval.
+The margin is halved until at least reclaimMinFreeFraction of both arrays would be free.
+The kept nodes and the moves of the queued nodes are then moved to the front of their arrays and everything pointing at them is renumbered,
+so a fixed memory budget supports an unbounded evaluation time.
+
+Moves are generated from bitboards (USE_BITBOARD_MOVEGEN) that each thread keeps in sync with its calculating board,
+using magic bitboard lookups for sliding pieces. The generated moves use the same move encoding as the square-by-square
+(mailbox) generator, which is still available and is cross-checked against the bitboard generator in the checked build.
+Only legal moves become children: the bitboard generator masks each piece's moves with the squares that answer a check
+and the line of any pin, and the mailbox generator's moves are filtered by playing them on a copy of the board.
+A position without legal moves is marked as checkmate or stalemate when it is examined, so every node is a real position.
 
 
 ********** EVAL AND SCORE VISUALIZATION **********
 The diagrams on the right show possible eval and score trees for a position.
-Here, score is not affected by depth, only eval loss.
+Here, score is not affected by depth, only eval loss (scoreDepthPenalty = 0).
 white's turn -> max of result evals                                             18
 black's turn -> min of result evals                         14                                    18
 etc.                                           14           22        21                 28                 18
@@ -107,6 +200,37 @@ indicates both the destination square and the piece that pawn promotes to.
 - 120-127 = black queen
 The moveto value mod 8 is the column (file) number of the pawn's destination.
 
+********** DRIVER PROTOCOL **********
+Run without arguments, the engine reads one command per line: two letters, a space, and space-separated ints,
+and prints one line of space-separated results. A position is the 64 board squares followed by the 12 data values
+in the MISC ENCODING order (with the game state last), or a FEN code with all six fields.
+
+The bm command prints 1 and switches to the binary protocol until ex or the end of input.
+Each input frame is an int length followed by that many bytes of commands, one after another with no separators:
+the two command letters followed by its arguments. Each int argument is a 4-byte int.
+A position is one byte 0 followed by the 64 board chars and the 12 chars of D, or one byte 1 followed by a
+null-terminated FEN code.
+Each output frame is an int length followed by, for each command, an int length and its results.
+Each bool result is one byte, each int result is an 8-byte long long, and each string is null-terminated.
+All ints are in the machine's byte order. A frame stops at an unknown command.
+The headless build (ENGINE_HEADLESS) always runs the driver protocol and has no menu UI to go to.
+The end of the input ends the program like the ex command.
+
+
+********** BUILDING **********
+CMakeLists.txt builds the engine (menu UI and driver protocol), engine-headless, and engine-checked (headless with
+ENGINE_DEBUG_VERIFY). The release targets use link-time optimization and the instruction set of ENGINE_MARCH (native
+by default), and ENGINE_MARCH_VARIANTS adds a headless engine for each further instruction set. ENGINE_SYZYGY_DIR
+builds them with the Fathom tablebase probing code (USE_SYZYGY).
+engine-profile (ENGINE_PROFILE) counts the cycles of each phase of examining nodes on every thread (see profilePhases)
+and the lengths of the eval backtracks. The pr command reads the counts since the last setup, and pt writes each thread's
+first PROFILE_TRACE_CAP phases to a Chrome tracing file. Other builds leave out all of this.
+The bench target runs "engine-headless bench", which prints the results of the benchmark (see runBenchmark() and the
+bn command). Compare builds and settings by its nodes per second, and check by the one-thread signature that a change
+meant only to be faster did not alter what the search does.
+The console, timing, memory mapping, and thread placement code has Windows and Linux versions (other systems get
+portable fallbacks without large pages, memory mapping, or pinning).
+
 
 ********** GAME PROCESSES **********
 
@@ -210,13 +334,13 @@ setupEvaluation():
 
 evaluate(double t):
 - If setupComplete is 0, do nothing.
-- Compute the thread stop time using t.
-- Change the numThreadsRunning to the number of threads.
-- Change run to 1 in the threads.
-- The threads will then notice and examine positions.
-- The threads will stop when the time has reached the stop time.
-- When stopping, each thread will decrement numThreadsRunning.
-- The main thread waits for numThreadsRunning == 0.
+- Compute the thread stop time (the deadline) using t.
+- Change run and running to 1 in the threads and add them to numThreadsRunning.
+- Wake the threads, which sleep on threadWakeCondition while not running, and they examine positions.
+- The threads will stop when the time has reached the stop time (or when they run out of positions).
+  Each thread checks the clock every deadlineCheckInterval positions, so the main thread does not need to wake up on time.
+- When stopping, each thread will decrement numThreadsRunning and notify threadStopCondition.
+- The main thread sleeps on threadStopCondition until numThreadsRunning == 0 or the time is reached.
 
 
 rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1
@@ -233,7 +357,7 @@ Debug allocation of the nodes in each thread and heaps and bucket lists.
 Make sure the threads can stop quickly (I think 10us to 20us is fast enough!)
 Eval faster than checking every board square (maybe reuse eval from previous and just change pieces involved in move)
 Factor in king position (depending on other pieces) into eval.
-Implement upcoming repetition check.
+Add other king safety criteria that can be kept incrementally like the phase (see kingPlacementEval()).
 
 
 
@@ -257,6 +381,7 @@ void crash() {
 
 // Maximum size of an input line on console before causing an error.
 #define MAX_LINE_SIZE 1000
+#define MAX_LEGALITY_BATCH (MAX_LINE_SIZE / 4) // most from/to pairs that fit on one input line ("0 0 " per pair)
 
 // Movefrom and moveto of the root node (should not matter)
 #define DEFAULT_MOVEFROMTO -1
@@ -274,7 +399,20 @@ double evaluationTimeLimitMin = 1.0; // seconds
 double evaluationTimeLimitMax = 1.0; // seconds
 double evaluationTimeLimitAnalysis = 1.0; // seconds
 int evaluationDepthLimit = 30; // 0 means do not add root's children to queue, etc.
+double scoreDepthPenalty = 0.1; // Added to the score of a node for each move from the root, on top of its eval losses.
+bool lazyExpansion = 0; // Whether children are queued before their moves are found (see CALCULATION PROCESS), from the next setup.
+// Keys of the positions played in the game before the evaluated position, oldest first, for finding repetitions (see setGameKeys()).
+unsigned long long* gameKeys = NULL;
+int gameKeysLength = 0;
 int numSeedReps = 500; // # nodes to analyze before distributing equally among threads.
+// # nodes a thread examines between checks of the clock against the evaluation deadline.
+// Reading the clock costs well under 1% of examining a node, so the default checks after every node, which keeps the
+// time for a thread to stop at about the time to examine one node. Raise it if examining nodes gets much cheaper.
+int deadlineCheckInterval = 1;
+int evaluationThreadNodeLimit = INT_MAX; // # nodes each thread examines after the setup before stopping itself, checked with the clock
+#define BATCH_NO_TIME_LIMIT 1000000.0 // seconds to evaluate a position that only has a node limit (see _evaluateBatch())
+double redistributionInterval = 0.1; // seconds between redistributions of the threads' queues (see redistributeFutures()), 0 for never
+int redistributionSize = 4096; // # best queued nodes of each thread that are redistributed
 
 bool initComplete = 0;
 bool setupComplete = 0;
@@ -294,9 +432,17 @@ bool keyCurr[256];
 
 char* inLine;
 int inLinePos = 0; // only used for reading commands from other applications, not typed user input
+int inLineLength = 0; // bytes of the frame from inLine on, in the binary protocol (see inputLeft())
 
 char* outLine;
 int outLinePos = 0; // only used for writing commands to other applications, not printing for user to read
+int outLineSize = MAX_LINE_SIZE;
+
+// Binary driver protocol, entered with the bm command (see DRIVER PROTOCOL).
+#define BINARY_FRAME_SIZE (1 << 20) // largest command frame accepted
+#define BINARY_POSITION_PACKED 0
+#define BINARY_POSITION_FEN 1
+bool binaryProtocol = 0;
 
 #define MAX_MOVE_STRING_LENGTH 10
 char* moveString;
@@ -309,64 +455,265 @@ int moveStringLength = 0;
 double nodeCapMultiplier = 1.5;
 int nodeCapAdder = 10;
 
+// Each thread's queue (see addFutureQueue()) is a heap with queueType children per entry (2, 4, or 8), or the bucket
+// list if queueType is QUEUE_BUCKETS. It can be changed between evaluations (see setQueueType()).
+#define QUEUE_BUCKETS 0
+int queueType = 4;
+
 double futuresHeapCapMultiplier = 1.5;
 int futuresHeapCapAdder = 10;
 
+// The bucket list puts scores from the first one queued in numBuckets - 1 buckets of equal width, starting at bucketRange,
+// and higher scores in the last bucket. When only the last bucket is left, its scores are spread over all the buckets.
+// Lower scores go in the first bucket, and the buckets are moved down to them before it is taken from.
 int numBuckets = 5000;
-double bucketRange = 0.2;
-double bucketStart = 0.0; // so total range is from score = 0 to score = 1000 (extremes have no bounds)
+double bucketRange = 0.01;
 double bucketCapMultiplier = 1.2;
 int bucketCapAdder = 10;
 
+// Memory reclaiming settings (see reclaimNodes()).
+double reclaimEvalMargin = 4.0; // Expanded nodes this much worse than their best sibling lose their subtrees when reclaiming.
+double reclaimMinFreeFraction = 0.25; // The margin is halved until reclaiming frees at least this fraction of the nodes and moves.
+
+// Node and move slots each thread reserves at a time (see allocateSlots()), at most an eighth of each thread's share of them.
+int nodeBlockSize = 65536;
+int moveBlockSize = 65536;
+
 // Node sizing info.
 #define MISC_SIZE 12
+#define NUM_PIECES 12
 #define LEGAL_MOVES_UPPER_BOUND 350 // Must be >= the max # legal moves possible in any position.
 
+// Whether node evals are stored as floats instead of doubles, which makes a node 32 bytes instead of 40.
+// Evals are still computed as doubles; only the stored copy loses precision.
+#define USE_FLOAT_EVALS 1
+
+#if USE_FLOAT_EVALS
+typedef float EV;
+#else
+typedef double EV;
+#endif
+
+// A move packed into 16 bits: the square moved from (bits 0-5), the true square moved to (bits 6-11), and the piece a
+// promoting pawn becomes (bits 12-15, 0 for no promotion since no pawn is promoted to a white pawn).
+// The driver keeps the older encoding of a move as two chars, where a promotion's to square is 64 + 8 * k + file for
+// White and 96 + 8 * k + file for Black with k = 0, 1, 2, 3 for knight, bishop, rook, queen (see packMove() and moveCode()).
+typedef unsigned short MV;
+
+#define NO_MOVE 0xFFFF // The move stored in a root node, which no move packs to.
+
+#define makeMove(from, to) ((MV)((from) | ((to) << 6)))
+#define makePromotion(from, to, piece) ((MV)((from) | ((to) << 6) | ((piece) << 12)))
+#define moveFromSquare(m) ((char)((m) & 63))
+#define moveToSquare(m) ((char)(((m) >> 6) & 63))
+#define movePromotion(m) ((char)((m) >> 12))
+
+// Pack a move given in the driver's encoding (undefined squares give NO_MOVE).
+inline MV packMove(char moveFrom, char moveTo) {
+    if (moveFrom < 0 || moveTo < 0) return NO_MOVE;
+    if (moveTo < 64) return makeMove(moveFrom, moveTo);
+    if (moveTo < 96) return makePromotion(moveFrom, 56 + (moveTo % 8), (moveTo / 8) - 7);
+    return makePromotion(moveFrom, moveTo % 8, (moveTo / 8) - 5);
+}
+
+// Get the from square of a packed move in the driver's encoding (-1 for NO_MOVE).
+inline char moveCodeFrom(MV m) {
+    return m == NO_MOVE ? -1 : moveFromSquare(m);
+}
+
+// Get the to square of a packed move in the driver's encoding (-1 for NO_MOVE).
+inline char moveCode(MV m) {
+    if (m == NO_MOVE) return -1;
+    char to = moveToSquare(m);
+    char promotion = movePromotion(m);
+    if (promotion == 0) return to;
+    if (promotion < 6) return 64 + 8 * (promotion - 1) + (to % 8);
+    return 96 + 8 * (promotion - 7) + (to % 8);
+}
+
 // All information about a position node.
+// The node is packed into as few bytes as possible so more of the tree fits in memory and in cache.
+// The fields only the thread examining the node writes share bytes as bit fields, while the fields other threads
+// read while the node is being examined (such as PLAYER_TURN) have bytes of their own.
+// The Zobrist key is only needed when examining the node, so it is kept apart in nodeKeys.
+// The score is kept in the queue entries only (see QE).
 typedef struct {
-    char wKINGSIDE_CASTLE;
-    char wQUEENSIDE_CASTLE;
-    char bKINGSIDE_CASTLE;
-    char bQUEENSIDE_CASTLE;
-    char EN_PASSANT_FILE;
+    unsigned char wKINGSIDE_CASTLE : 1;
+    unsigned char wQUEENSIDE_CASTLE : 1;
+    unsigned char bKINGSIDE_CASTLE : 1;
+    unsigned char bQUEENSIDE_CASTLE : 1;
+    signed char EN_PASSANT_FILE : 4;
+    unsigned short wKING_SQUARE : 6;
+    unsigned short bKING_SQUARE : 6;
+    unsigned short GAME_STATE : 2;
+    unsigned short examined : 1; // whether the node's move has been played on its data and key and its own moves found
     char FIFTY_MOVE_COUNTER;
-    char wKING_SQUARE;
-    char bKING_SQUARE;
-    char SQUARE_FROM;
-    char SQUARE_TO;
+    MV move; // move from the parent to this node, NO_MOVE for the root
     char PLAYER_TURN;
-    char GAME_STATE;
-    
+    unsigned char depth; // number of moves from the root, less than MAX_DEPTH
+
+    short numChildren;
+    short numMoves;
     int parentIndex;
-    int numChildren;
     int childStartIndex; // position in global array nodes, made an int so resizing does not change this location
-    int numMoves;
-    int moveStartIndex; // position in global move arrays, made an int so resizing does not change this location
+    int moveStartIndex; // position in globalMoves, made an int so resizing does not change this location
+    atomic<int> transpositionIndex; // node holding the same position that this node's eval is read from, or UNDEFINED (read by other threads with lazyExpansion)
 
-    atomic<double> e; // eval only changed by the owner thread after computing static eval and at the end by the main thread when updating full tree
-    double score; // computed from parent score, difference from best sibling, etc.
+    atomic<EV> e; // eval only changed by the owner thread after computing static eval and at the end by the main thread when updating full tree
 } N;
 
+// Queue entry: a queued node's index with its score (computed from parent score, difference from best sibling, etc.).
+// The score is only needed to order the queue, so keeping it here means reordering never reads the nodes.
+typedef struct {
+    float score;
+    int index;
+} QE;
+
 
 // The data source for the node tree.
 atomic<int> numNodes;
 atomic<int> nodeCap; // doesn't need to be modified by a random thread during evaluation unless resizing, which may break the multithreading somehow
 N* nodes;
+unsigned long long* nodeKeys; // Zobrist key of the position of each node.
+
+// The nodes linked to each node (see transpositionIndex), which read their evals from it, so a change of its eval is
+// backtracked from them too (see evalBacktrackChange()). A node's list starts at its first and goes on through the next of
+// each node in it. Nodes are only added to the front, by addNodeLink(), and the lists are rebuilt when the tree is compacted.
+typedef struct {
+    atomic<int> first; // first node linked to this node, or UNDEFINED
+    int next; // next node linked to the same node as this one, or UNDEFINED
+} NL;
+
+NL* nodeLinks;
+int* reclaimIndex; // New index of each node while reclaiming memory (see reclaimNodes()).
+
+// Transposition table entry linking a position's Zobrist key to the node holding that position.
+// The key is stored XORed with the data, so an entry torn by two threads writing at once never matches either key.
+typedef struct {
+    atomic<unsigned long long> check; // key ^ data
+    atomic<unsigned long long> data; // search generation in the high 32 bits, node index in the low 32 bits
+} TE;
+
+// The transposition table shared by all threads. Its size is a power of two.
+TE* transpositionTable;
+int transpositionTableMask;
+unsigned int transpositionGeneration = 0; // Incremented by every setupEvaluation() so old entries never match.
 
 // The moves from the root which will be sorted by eval.
 N** sortedMoves; // Length is stored in root as number of children.
 
 atomic<int> globalMoveLength;
 atomic<int> globalMoveCap; // doesn't need to be modified by a random thread during evaluation unless resizing, which may break the multithreading somehow
-char* globalMoveFrom;
-char* globalMoveTo;
+MV* globalMoves;
+
+// Memory placement settings, used by the next init() (see allocateLargeArray(), prefaultLargeArrays(), and pinCurrentThread()).
+bool largePages = 0; // Allocate the nodes, their keys, and the moves with large pages if the system allows it.
+bool prefaultMemory = 0; // Touch every page of those arrays during init(), split between the threads, instead of during the search.
+bool pinThreads = 0; // Run each calculating thread on its own processor.
+
+#define LARGE_PAGE_SIZE (2 * 1024 * 1024) // Used to round mapped sizes when the system does not say.
+#define SMALL_PAGE_SIZE 4096 // Stride for touching pages, at most the real page size.
+
+// Memory of an array allocated by allocateLargeArray().
+typedef struct {
+    void* memory;
+    size_t size;
+    bool mapped; // Whether the memory came from the system's page allocator rather than malloc().
+} LA;
+
+LA nodesMemory;
+LA nodeKeysMemory;
+LA nodeLinksMemory;
+LA reclaimIndexMemory;
+LA globalMovesMemory;
+
+// Free the memory of an array allocated by allocateLargeArray().
+void freeLargeArray(LA* a) {
+    if (a->memory == NULL) return;
+    if (a->mapped) {
+    #if defined(_WIN32)
+        VirtualFree(a->memory, 0, MEM_RELEASE);
+    #elif defined(__linux__)
+        munmap(a->memory, a->size);
+    #endif
+    }
+    else {
+        free(a->memory);
+    }
+    a->memory = NULL;
+    a->size = 0;
+    a->mapped = 0;
+}
+
+#if defined(_WIN32)
+// Enable the privilege that Windows needs for large pages, which the user must have been granted ("Lock pages in memory").
+// Return whether it is enabled.
+bool enableLargePagePrivilege() {
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) return 0;
+    TOKEN_PRIVILEGES tp;
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool enabled = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid)
+        && AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return enabled;
+}
+#endif
+
+// Allocate size bytes for an array, freeing its old memory without keeping the contents.
+// With largePages, the memory is taken from the system in large pages (Windows) or mapped and marked for transparent
+// huge pages (Linux), so the arrays that every thread writes to at random need far fewer TLB entries.
+// If that is not possible, the memory comes from malloc() like any other array.
+void* allocateLargeArray(LA* a, size_t size) {
+    if (!largePages && !a->mapped) {
+        a->memory = realloc(a->memory, size);
+        if (a->memory == NULL) crash();
+        a->size = size;
+        return a->memory;
+    }
+    freeLargeArray(a);
+
+    if (largePages) {
+    #if defined(_WIN32)
+        size_t page = GetLargePageMinimum();
+        if (page > 0 && enableLargePagePrivilege()) {
+            size_t s = (size + page - 1) / page * page;
+            void* m = VirtualAlloc(NULL, s, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (m != NULL) {
+                a->memory = m;
+                a->size = s;
+                a->mapped = 1;
+                return m;
+            }
+        }
+    #elif defined(__linux__)
+        size_t s = (size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+        void* m = mmap(NULL, s, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, s, MADV_HUGEPAGE);
+            a->memory = m;
+            a->size = s;
+            a->mapped = 1;
+            return m;
+        }
+    #endif
+    }
+
+    a->memory = malloc(size);
+    if (a->memory == NULL) crash();
+    a->size = size;
+    return a->memory;
+}
+
+// A set of board squares with bit x set iff square x (0 = a1, 1 = b1, ..., 63 = h8) is in the set.
+typedef unsigned long long BB;
 
 // Move for playing and undoing moves.
 typedef struct {
     char f;
-    char t;
-    char tt;
-    char promotion;
+    char t; // true destination square
+    char promotion; // piece placed by a promotion, or -1
     char mover;
     char captured;
     char enPassantSquare;
@@ -389,6 +736,80 @@ typedef struct {
 } D;
 
 #define MAX_DEPTH 100
+#define CACHE_LINE_SIZE 64
+
+// Search stats of one thread. Only the thread itself writes them (see countStat()), and they are summed over the threads
+// whenever they are read (see sumCalcStats()). The padding keeps any other data out of the cache lines they are counted in.
+typedef struct {
+    char paddingBefore[CACHE_LINE_SIZE];
+
+    atomic<int> nodesAdded;
+    atomic<int> movesAdded;
+    atomic<int> nodesExamined;
+    // Average number of moves in a position is calculable from the above three stats.
+    atomic<int> stalematesFound;
+    atomic<int> whiteWinsFound;
+    atomic<int> blackWinsFound;
+    atomic<int> normalsFound;
+    atomic<int> repetitionsFound; // Nodes drawn by repeating a position on their path or in the game.
+    atomic<int> fiftyMoveDrawsFound;
+    atomic<int> endgameHits; // Nodes made terminal by probeEndgame().
+    atomic<int> transpositionProbes;
+    atomic<int> transpositionHits; // Each hit is a node that is linked instead of examined.
+    atomic<int> transpositionMovesSaved; // Moves (future child nodes) that the hit nodes did not have to generate.
+
+    // Sizes of the thread's queue and stash, and its reserved node and move slots left unused, as of its last expansion.
+    atomic<int> queueSize;
+    atomic<int> stashSize;
+    atomic<int> nodeSlotsUnused;
+    atomic<int> moveSlotsUnused;
+
+    // Nanoseconds spent examining positions, not counting the current run, and the clock time the current run started at (0 if not running).
+    atomic<long long> runTime;
+    atomic<long long> runStartTime;
+
+    atomic<int> nodesAddedDepth[MAX_DEPTH]; // Number of total positions found at each depth.
+    atomic<int> nodesQueuedDepth[MAX_DEPTH]; // Number of positions queued (total found minus checkmates, stalemates, and transpositions) at each depth.
+    atomic<int> nodesExaminedDepth[MAX_DEPTH]; // Number of positions examined at each depth.
+
+    char paddingAfter[CACHE_LINE_SIZE];
+} CS;
+
+// Phases of examining nodes that profiling (ENGINE_PROFILE) counts the cycles of.
+enum profilePhases {
+    PHASE_POP = 0, // getFirstFuture()
+    PHASE_REPLAY = 1, // moving the calculating board to the node and back (see moveBoardToNode())
+    PHASE_PROBE = 2, // the draw, endgame, and transposition checks
+    PHASE_MOVEGEN = 3, // finding the legal moves
+    PHASE_EVAL = 4, // computeChildEvals()
+    PHASE_ALLOCATE = 5, // reserving node and move slots (see allocateSlots())
+    PHASE_CHILDREN = 6, // setting up the child nodes and storing moves and transpositions
+    PHASE_PUSH = 7, // queueing nodes (see queueChildren() and addFutureQueue())
+    PHASE_BACKTRACK = 8, // evalBacktrack() and evalBacktrackChange()
+    NUM_PROFILE_PHASES = 9
+};
+
+#define PROFILE_TRACE_CAP 65536 // most phase events each thread records for the trace (see writeProfileTrace())
+
+const char* profilePhaseNames[NUM_PROFILE_PHASES] = { "pop", "replay", "probe", "movegen", "eval", "allocate", "children", "push", "backtrack" };
+
+#if ENGINE_PROFILE
+// One timed phase in a thread's trace.
+typedef struct {
+    unsigned long long start; // cycle count (see readCycles())
+    unsigned int cycles;
+    unsigned char phase;
+} PE;
+
+// Profile of one thread, written only by the thread itself and read while the threads are stopped.
+typedef struct {
+    unsigned long long cycles[NUM_PROFILE_PHASES];
+    long long calls[NUM_PROFILE_PHASES];
+    long long backtrackLengths[MAX_DEPTH + 1]; // number of backtracks that changed the evals of that many ancestors
+    PE* trace; // the first PROFILE_TRACE_CAP phases since the profile was reset
+    int traceLength;
+} PF;
+#endif
 
 // Information only accessed by one thread.
 typedef struct {
@@ -401,30 +822,66 @@ typedef struct {
     // Calculating board to play and undo moves on.
     char cb[64];
 
+    // The squares of each piece type on the calculating board.
+    BB bb[NUM_PIECES];
+
+    // Piece-square table sum and phase (see piecePhases) of the calculating board, kept up to date with the bitboards.
+    int boardEval;
+    int boardPhase;
+
     // Shared size (number of nodes) for both heap and bucket list.
     int futuresQueueSize;
 
-    // Heap of nodes indices that this thread will evaluate next, sorted by their own score values.
-    // Each element is a pointer because the nodes themselves (besides the root) are never being stored, only pointed to.
-    int* futuresHeap;
+    // Heap of nodes indices that this thread will evaluate next, sorted by the scores stored with them.
+    // It is allocated as futuresHeapMemory and starts at the first cache line boundary in it (see resizeFuturesHeap()).
+    QE* futuresHeap;
     int futuresHeapCap;
+    char* futuresHeapMemory;
 
-    // Buckets of nodes to evaluate next.
-    int** buckets;
+    // Buckets of nodes to evaluate next, for scores from bucketStart in steps of bucketWidth (0 until the first is queued).
+    QE** buckets;
     int* bucketCap;
     int* bucketLength;
     int lowestBucketIndex; // the least bucket index containing a value
+    float bucketStart;
+    float bucketWidth;
+    bool bucketUnderflow; // whether a score below bucketStart was put in the first bucket since the buckets were started
+
+    // Nodes deeper than evaluationDepthLimit, kept with their scores in case the limit is raised (see queueFuture()).
+    QE* stash;
+    int stashLength;
+    int stashCap;
 
     // All legal children of a position before setting the examined node's child start.
-    char* childFroms;
-    char* childTos;
-    double* childEvals;
-    double bestChildEval;
+    MV* childMoves;
+    int* childEvals; // Evals of the resulting positions in EVAL_SCALE units (see computeChildEvals()).
     int childPoolCap;
     int childPoolLength;
 
     // Move sequence for playing and undoing moves.
     M* moves;
+
+    // Node index at each depth of the path from the root to the node the calculating board represents.
+    int* pathNodes;
+    int pathDepth;
+    int* pathReplay; // Nodes to play when moving the calculating board to another node.
+
+    long long stopTime; // Clock time (see clockNanoseconds()) at which the thread last stopped examining positions.
+
+    // Blocks of global node and move slots reserved for this thread (see allocateSlots()): the next free slot, the end of the block,
+    // and the number of slots left unused in the blocks replaced since the stats were reset.
+    int nodeBlockNext;
+    int nodeBlockEnd;
+    int nodeSlotsAbandoned;
+    int moveBlockNext;
+    int moveBlockEnd;
+    int moveSlotsAbandoned;
+
+    CS stats;
+
+#if ENGINE_PROFILE
+    PF profile;
+#endif
 } T;
 
 T* threads;
@@ -432,26 +889,221 @@ int numThreads;
 atomic<int> numThreadsRunning;
 atomic<int> numThreadsAlive;
 
+// Idle threads sleep instead of spinning. The running, live, and thread count changes are made while holding threadStateMutex.
+mutex threadStateMutex;
+condition_variable threadWakeCondition; // Notified when threads are asked to run or die.
+condition_variable threadStopCondition; // Notified when a thread stops running.
+
+// Return the time of a steady clock in nanoseconds, used for evaluation deadlines and thread run times.
+inline long long clockNanoseconds() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#if ENGINE_PROFILE
+// Return the processor's cycle counter, or the clock in nanoseconds on processors without one that is cheap to read.
+inline unsigned long long readCycles() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    unsigned long long c;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(c));
+    return c;
+#else
+    return (unsigned long long)clockNanoseconds();
+#endif
+}
+
+// Cycle count and clock time when the profile was last reset (see resetProfile()), to convert the trace's cycles to time.
+unsigned long long profileStartCycles = 0;
+long long profileStartTime = 0;
+
+// Count the cycles since start in the given phase of the thread, and record the phase in its trace while there is room.
+inline void profilePhase(T* t, int phase, unsigned long long start) {
+    PF* p = &(t->profile);
+    unsigned long long now = readCycles();
+    p->cycles[phase] += now - start;
+    p->calls[phase]++;
+    if (p->traceLength < PROFILE_TRACE_CAP) {
+        PE* e = p->trace + p->traceLength;
+        e->start = start;
+        e->cycles = (unsigned int)(now - start);
+        e->phase = (unsigned char)phase;
+        p->traceLength++;
+    }
+}
+
+// Profiling a phase: PROFILE_START(name) where it starts and PROFILE_STOP(t, phase, name) where it ends.
+// Without ENGINE_PROFILE, both are empty.
+#define PROFILE_START(name) unsigned long long name = readCycles()
+#define PROFILE_STOP(t, phase, name) profilePhase(t, phase, name)
+#define PROFILE_BACKTRACK_LENGTH(t, length) ((t)->profile.backtrackLengths[(length) < MAX_DEPTH ? (length) : MAX_DEPTH]++)
+#else
+#define PROFILE_START(name)
+#define PROFILE_STOP(t, phase, name)
+#define PROFILE_BACKTRACK_LENGTH(t, length) (void)(length)
+#endif
+
+// Return the most memory the process has used so far in bytes, or 0 if it is not known.
+long long peakMemoryBytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return (long long)counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+    return (long long)usage.ru_maxrss;
+#else
+    return (long long)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Return the time of day in nanoseconds since 1970, which unlike clockNanoseconds() differs between runs.
+inline long long wallClockNanoseconds() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+#if !ENGINE_HEADLESS
+// Console input and output, which only the menu UI uses.
+// Elsewhere than Windows the terminal is switched out of line input only while a key is checked or read, so the
+// typed keys are seen as they are pressed without changing how the lines of the UI and the driver protocol are read.
+
+#if !defined(_WIN32)
+// Switch the terminal of stdin to reading keys as they are typed and without echo, saving its mode in saved.
+// Return 0 if stdin is not a terminal.
+bool startKeyInput(struct termios* saved) {
+    if (tcgetattr(STDIN_FILENO, saved) != 0) return 0;
+    struct termios raw = *saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    return 1;
+}
+#endif
+
+// Return whether a key has been pressed and not read yet with readKey().
+bool keyPressed() {
+#if defined(_WIN32)
+    return _kbhit();
+#else
+    struct termios saved;
+    if (!startKeyInput(&saved)) return 0;
+    int waiting = 0;
+    ioctl(STDIN_FILENO, FIONREAD, &waiting);
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    return waiting > 0;
+#endif
+}
+
+// Wait for and return the next key pressed, or -1 if there are no more.
+int readKey() {
+#if defined(_WIN32)
+    return _getch();
+#else
+    struct termios saved;
+    bool terminal = startKeyInput(&saved);
+    unsigned char c;
+    ssize_t r = read(STDIN_FILENO, &c, 1);
+    if (terminal) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    return r == 1 ? c : -1;
+#endif
+}
+
+// Make the console show the UTF-8 text of the UI (such as the board's pieces), which other terminals show already.
+void setupConsole() {
+#if defined(_WIN32)
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+}
+#endif
+
+// The threads stop themselves once the clock (see clockNanoseconds()) reaches the deadline, so the main thread
+// does not have to wake up on time to stop them.
+atomic<long long> evaluationDeadline; // LLONG_MAX if there is no deadline.
+long long stopRequestTime; // Clock time at which the threads were last asked to stop, by the deadline or by stopAllThreads().
+bool evaluationStarted = 0; // Whether the threads were started by evaluateStartUntil() and not stopped by evaluateStop() yet.
+
+
+// Combined stats from all threads, summed by sumCalcStats() before they are read.
+CS calcStats;
+int calcExaminedPerSecond; // Sum of the threads' rates of examining positions while running.
+int calcMaxDepth; // The deepest depth any position was found at.
 
-// Combined stats from all threads.
-atomic<int> calcNumNodesAdded;
-atomic<int> calcNumMovesAdded;
-atomic<int> calcNumNodesExamined;
-// Average number of moves in a position is calculable from the above three stats.
-atomic<int> calcNumStalematesFound;
-atomic<int> calcNumWhiteWinsFound;
-atomic<int> calcNumBlackWinsFound;
-atomic<int> calcNumNormalsFound;
+// Stats counted by whichever thread reclaims memory or stops the threads.
+atomic<int> calcNumReclaims; // Times that node and move memory ran out and was reclaimed.
+atomic<long long> calcNumNodesReclaimed;
+atomic<long long> calcNumMovesReclaimed;
+atomic<int> calcStopLatency; // Microseconds from the last stop request until the last thread stopped.
 
-//int* calcNumNodesAddedDepth; // Number of total positions found at each depth.
-//int* calcNumMovesAddedDepth; // Number of positions queued (total found minus checkmates/stalemates) at each depth.
-//int* calcNumNodesExaminedDepth; // Number of positions examined at each depth.
+// Add to a stat of the calling thread. Only that thread writes it, so this does not need an atomic read-modify-write.
+inline void countStat(atomic<int>& s, int x) {
+    s.store(s.load(memory_order_relaxed) + x, memory_order_relaxed);
+}
 
 
 
 // An arbitrary value that should never be checked by the program.
 #define UNDEFINED -1
 
+// Return the first of n contiguous slots of the global nodes or moves for a thread, or UNDEFINED if there are not enough left.
+// The slots come from the thread's block (from *next to *end), so the threads rarely touch the shared length. When the block
+// runs out, the rest of it is abandoned and a new block of up to blockSize slots is reserved from the length.
+// The slots must come after index after (UNDEFINED for any), so if the block's next slot does not, they are taken from the length.
+inline int allocateSlots(int n, int after, int* next, int* end, int* abandoned, atomic<int>* length, int cap, int blockSize) {
+    if (*end - *next >= n && *next > after) {
+        int l = *next;
+        *next += n;
+        return l;
+    }
+
+    // Take too many slots for a block, or slots that must come after the block's next one, straight from the length,
+    // which is past every block.
+    int limit = cap / (8 * numThreads);
+    if (blockSize > limit) blockSize = limit;
+    if (n > blockSize || *end - *next >= n) {
+        int l = length->fetch_add(n);
+        return l + n > cap ? UNDEFINED : l;
+    }
+
+    int l = length->fetch_add(blockSize);
+    if (l + n > cap) return UNDEFINED;
+    *abandoned += *end - *next;
+    *next = l + n;
+    *end = l + blockSize < cap ? l + blockSize : cap;
+    return l;
+}
+
+// Drop every thread's node and move blocks, which must be done whenever the global lengths are reset or lowered.
+// The slots abandoned before are gone with them.
+void resetSlotBlocks() {
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        t->nodeBlockNext = 0;
+        t->nodeBlockEnd = 0;
+        t->nodeSlotsAbandoned = 0;
+        t->moveBlockNext = 0;
+        t->moveBlockEnd = 0;
+        t->moveSlotsAbandoned = 0;
+    }
+}
+
+// Return the number of nodes in use: the global length less the slots the threads reserved in blocks and did not use
+// (see allocateSlots()). Must be called while no thread is running.
+int nodesInUse() {
+    int l = numNodes.load();
+    if (l > nodeCap.load()) l = nodeCap.load();
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        l -= t->nodeSlotsAbandoned + (t->nodeBlockEnd > t->nodeBlockNext ? t->nodeBlockEnd - t->nodeBlockNext : 0);
+    }
+    return l;
+}
+
 /*
 
 
@@ -482,12 +1134,15 @@ enum gameStates {
 #define WHITE_WINS_EVAL 1e9 // The eval of a White checkmate position.
 #define BLACK_WINS_EVAL -1e9 // The eval of a Black checkmate position.
 #define DRAW_EVAL 0 // The eval of a stalemate position.
+#define TABLEBASE_WIN_EVAL 1e6 // The eval of a position the tablebases show White winning, less than any forced mate.
 #define WHITE_WINS_EVAL_THRESHOLD 1e8 // The minimum eval to be considered a forced mate by White.
 #define BLACK_WINS_EVAL_THRESHOLD -1e8 // The maximum eval to be considered a forced mate by Black.
 #define EVAL_FORCED_MATE_INCREMENT 1000 // The difference in eval between a checkmate and mate-in-one, etc.
+#define EVAL_SCALE 100 // Integer eval units per 1.0 of eval, used by the piece-square table and child evals.
+#define KING_CAPTURE_EVAL INT_MAX // Integer child eval of capturing the Black king, negated for the White king.
+#define MAX_PHASE 24 // Phase with all the starting pieces on the board (see piecePhases).
 
 
-#define NUM_PIECES 12
 enum pieces {
     EMPTY = -1,
     wPAWN = 0,
@@ -510,12 +1165,45 @@ enum playerTurn {
 };
 
 
-// Basic data used to fill the evalBoards.
+// Basic data used to fill the piece-square table.
 char startingPieceCounts[NUM_PIECES] = { 8, 2, 2, 2, 1, 1, 8, 2, 2, 2, 1, 1 };
 double piecePointValues[NUM_PIECES] = { 1.0, 3.0, 3.3, 5.0, 9.0, 0.0, -1.0, -3.0, -3.3, -5.0, -9.0, -0.0 };
 double pieceEdgeContribution[NUM_PIECES] = { 0.05, 0.08, 0.07, 0.07, 0.15, 0.0, -0.05, -0.08, -0.07, -0.07, -0.15, -0.0 }; // How much moving a piece 1 square changes eval.
 
-double** evalBoards;
+// Eval of each piece on each square in EVAL_SCALE units, indexed by piece * 64 + square.
+alignas(64) short pieceSquareTable[NUM_PIECES * 64];
+
+// How much each piece counts towards the game phase, which goes from MAX_PHASE at the start down to 0 with only kings and pawns left.
+char piecePhases[NUM_PIECES] = { 0, 1, 1, 2, 4, 0, 0, 1, 1, 2, 4, 0 };
+
+// Eval of the White king on each square in EVAL_SCALE units at MAX_PHASE and at phase 0, blended by the phase (see kingPlacementEval()).
+// The Black king uses the square with its row flipped.
+short kingMiddlegameValues[64] = {
+     10,  15,   5,   0,   0,   5,  15,  10,
+     10,  10,   0,   0,   0,   0,  10,  10,
+     -5, -10, -10, -10, -10, -10, -10,  -5,
+    -10, -15, -15, -20, -20, -15, -15, -10,
+    -15, -20, -20, -25, -25, -20, -20, -15,
+    -15, -20, -20, -25, -25, -20, -20, -15,
+    -15, -20, -20, -25, -25, -20, -20, -15,
+    -15, -20, -20, -25, -25, -20, -20, -15
+};
+short kingEndgameValues[64] = {
+    -25, -15, -15, -15, -15, -15, -15, -25,
+    -15, -15,   0,   0,   0,   0, -15, -15,
+    -15,  -5,  10,  15,  15,  10,  -5, -15,
+    -15,  -5,  15,  20,  20,  15,  -5, -15,
+    -15,  -5,  15,  20,  20,  15,  -5, -15,
+    -15,  -5,  10,  15,  15,  10,  -5, -15,
+    -15, -10,  -5,   0,   0,  -5, -10, -15,
+    -25, -20, -15, -10, -10, -15, -20, -25
+};
+
+// Random keys for each board, castling, en passant, and turn state which are XORed together to get a position's Zobrist key.
+unsigned long long zobristPieces[NUM_PIECES][64];
+unsigned long long zobristCastling[4];
+unsigned long long zobristEnPassant[8];
+unsigned long long zobristTurn;
 
 // First row is rank 1, etc.
 char startingBoard[64] = {
@@ -543,6 +1231,7 @@ D analysisD;
 // All previous board states in this game including the current one.
 char** history;
 D* historyD; // Extra data about each position.
+unsigned long long* historyKeys; // Zobrist key of each position (see storeHistoryKey()).
 int gameLength = 0; // Number of positions in this game (length of history)
 
 
@@ -565,7 +1254,7 @@ int gameLength = 0; // Number of positions in this game (length of history)
 // Return true if the piece at square x on the calculating board is not empty.
 #define ifNonEmpty(x) if(b[x] != EMPTY)
 
-#define mv(y) examineMove(t, x, y)
+#define mv(y) examineMove(t, makeMove(x, y))
 
 
 unsigned long long randPrev = 0x940b19e3fd06b7a5;
@@ -579,20 +1268,20 @@ void setSeed(unsigned long long seed) {
 
 // Seed the RNG with a value based on the current time.
 void seedRandom() {
-    struct timespec now;
-    timespec_get(&now, TIME_UTC);
-    unsigned long long s = (unsigned long long)now.tv_sec;
-    unsigned long long ns = (unsigned long long)now.tv_nsec;
+    long long now = wallClockNanoseconds();
+    unsigned long long s = (unsigned long long)(now / 1000000000);
+    unsigned long long ns = (unsigned long long)(now % 1000000000);
     unsigned long long seed = s * 0xb619280e4fa733c5 + ns * 0x442c04f61ea63cb7;
     setSeed(seed);
 }
 
-// Get a random u64.
-unsigned long long random() {
+// Get a random u64. (Not named random(), which POSIX C libraries declare.)
+unsigned long long nextRandom() {
     randPrev = (randPrev * 0xa63e40147c582b49 + (randState += 0x51f84b2308a7d929)) * 0x681ac9427d5fe8b3;
     return randPrev;
 }
 
+#if !ENGINE_HEADLESS
 // Clear the console window.
 void clearConsole() {
     #if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
@@ -802,6 +1491,7 @@ void setupBoard() {
 
     history = (char**)realloc(history, sizeof(char*));
     historyD = (D*)realloc(historyD, sizeof(D));
+    historyKeys = (unsigned long long*)realloc(historyKeys, sizeof(unsigned long long));
 
     history[0] = (char*)calloc(64, 1);
 
@@ -823,45 +1513,89 @@ void setupBoard() {
 
     // 1, 1, 1, 1, -1, 0, 4, 60, UNDEFINED, UNDEFINED, WHITE, NORMAL
 }
+#endif
+
+// Fill the Zobrist keys from a fixed seed so keys are the same in every run (without changing the move choice RNG).
+void setupZobristKeys() {
+    unsigned long long z = 0x9b5f2c1e47a3d805;
+    unsigned long long* keys[] = { zobristPieces[0], zobristCastling, zobristEnPassant, &zobristTurn };
+    int counts[] = { NUM_PIECES * 64, 4, 8, 1 };
+
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < counts[i]; j++) {
+            z += 0x9e3779b97f4a7c15;
+            unsigned long long x = z;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+            keys[i][j] = x ^ (x >> 31);
+        }
+    }
+}
+
+// Return the part of a Zobrist key representing the castling abilities and en passant file.
+inline unsigned long long zobristStateKey(char wk, char wq, char bk, char bq, char epf) {
+    unsigned long long k = 0;
+    if (wk) k ^= zobristCastling[0];
+    if (wq) k ^= zobristCastling[1];
+    if (bk) k ^= zobristCastling[2];
+    if (bq) k ^= zobristCastling[3];
+    if (epf > -1) k ^= zobristEnPassant[epf];
+    return k;
+}
 
-// Given a full board state, compute its eval using the evalBoards. Only used at start.
-double computeEval(char* b) {
-    double o = 0.0f;
+// Compute the full Zobrist key of a position from its board, turn, and zobristStateKey().
+unsigned long long computeZobristKey(char* b, char playerTurn, unsigned long long stateKey) {
+    unsigned long long k = stateKey;
 
-    for(int i=0;i<64;i++){
+    for (int i = 0; i < 64; i++) {
         ifNonEmpty(i) {
-            o += evalBoards[b[i]][i];
+            k ^= zobristPieces[b[i]][i];
         }
     }
 
-    // TODO: Add other eval criteria.
+    if (playerTurn == BLACK) k ^= zobristTurn;
+    return k;
+}
+
+// Compute the full Zobrist key of the position of board b and its data d.
+unsigned long long computePositionKey(char* b, D* d) {
+    return computeZobristKey(b, d->PLAYER_TURN,
+        zobristStateKey(d->wKINGSIDE_CASTLE, d->wQUEENSIDE_CASTLE, d->bKINGSIDE_CASTLE, d->bQUEENSIDE_CASTLE, d->EN_PASSANT_FILE));
+}
 
+// Return the eval of the kings' placements in EVAL_SCALE units given their squares and the game phase.
+inline int kingPlacementEval(char wKingSquare, char bKingSquare, int phase) {
+    if (phase > MAX_PHASE) phase = MAX_PHASE;
+    int w = kingMiddlegameValues[wKingSquare] * phase + kingEndgameValues[wKingSquare] * (MAX_PHASE - phase);
+    int k = kingMiddlegameValues[bKingSquare ^ 56] * phase + kingEndgameValues[bKingSquare ^ 56] * (MAX_PHASE - phase);
+    return (w - k) / MAX_PHASE;
+}
 
-    return o;
+// Return an integer eval in EVAL_SCALE units as an eval.
+inline EV evalFromUnits(int e) {
+    if (e == KING_CAPTURE_EVAL) return WHITE_WINS_EVAL;
+    if (e == -KING_CAPTURE_EVAL) return BLACK_WINS_EVAL;
+    return (EV)e / EVAL_SCALE;
 }
 
-// Play a given move on the given board and update all miscs.
+// Play a given move on the given board and update all miscs and the given Zobrist key of the position.
 // Return the en passant square or -1.
-char playMoveUpdating(char* b, N* n) {
+char playMoveUpdating(char* b, N* n, unsigned long long* key) {
     char eps = -1;
-    char from = n->SQUARE_FROM;
-    char to = n->SQUARE_TO;
-
-    // Get the type of piece being promoted to or negative if no promotion.
-    char promotion = (to - 64) / 8;
-
-    // Set moveTo to the true destination square.
-    if (to >= 96) {
-        to = to % 8;
-    }
-    else if (to >= 64) {
-        to = 56 + (to % 8);
-    }
+    MV move = n->move;
+    char from = moveFromSquare(move);
+    char to = moveToSquare(move);
+    char promotion = movePromotion(move); // piece being promoted to or 0 if no promotion
 
     char rf = from / 8, cf = from % 8, rt = to / 8, ct = to % 8;
     char p = b[from];
     char q = b[to];
 
+    // Remove the moving piece, the captured piece, and the states this move can change from the key.
+    unsigned long long k = *key ^ zobristTurn ^ zobristPieces[p][from];
+    k ^= zobristStateKey(n->wKINGSIDE_CASTLE, n->wQUEENSIDE_CASTLE, n->bKINGSIDE_CASTLE, n->bQUEENSIDE_CASTLE, n->EN_PASSANT_FILE);
+    if (q != EMPTY) k ^= zobristPieces[q][to];
+
     if (n->FIFTY_MOVE_COUNTER < 100) (n->FIFTY_MOVE_COUNTER)++;
 
     // If capturing, reset 50-move counter.
@@ -883,12 +1617,13 @@ char playMoveUpdating(char* b, N* n) {
         if (rf == 1 && rt == 3) { // en passant availability
             n->EN_PASSANT_FILE = ct;
         }
-        else if (promotion > -1) { // white promotion
-            b[to] = promotion + 1;
+        else if (promotion) { // white promotion
+            b[to] = promotion;
         }
         else if (rf == 4 && !capture && cf != ct) { // white en passant
             b[to - 8] = EMPTY;
             eps = to - 8;
+            k ^= zobristPieces[bPAWN][eps];
         }
         break;
     case bPAWN:
@@ -896,12 +1631,13 @@ char playMoveUpdating(char* b, N* n) {
         if (rf == 6 && rt == 4) { // en passant availability
             n->EN_PASSANT_FILE = ct;
         }
-        else if (promotion > -1) { // black promotion
-            b[to] = promotion + 3;
+        else if (promotion) { // black promotion
+            b[to] = promotion;
         }
         else if (rf == 3 && !capture && cf != ct) { // black en passant
             b[to + 8] = EMPTY;
             eps = to + 8;
+            k ^= zobristPieces[wPAWN][eps];
         }
         break;
     case wKING:
@@ -910,9 +1646,11 @@ char playMoveUpdating(char* b, N* n) {
         n->wKING_SQUARE = to;
         if (from == 4 && to == 6) { // WK
             b[5] = wROOK; b[7] = EMPTY;
+            k ^= zobristPieces[wROOK][5] ^ zobristPieces[wROOK][7];
         }
         else if (from == 4 && to == 2) { // WQ
             b[3] = wROOK; b[0] = EMPTY;
+            k ^= zobristPieces[wROOK][3] ^ zobristPieces[wROOK][0];
         }
         break;
     case bKING:
@@ -921,9 +1659,11 @@ char playMoveUpdating(char* b, N* n) {
         n->bKING_SQUARE = to;
         if (from == 60 && to == 62) { // BK
             b[61] = bROOK; b[63] = EMPTY;
+            k ^= zobristPieces[bROOK][61] ^ zobristPieces[bROOK][63];
         }
         else if (from == 60 && to == 58) { // BQ
             b[59] = bROOK; b[56] = EMPTY;
+            k ^= zobristPieces[bROOK][59] ^ zobristPieces[bROOK][56];
         }
         break;
     case wROOK:
@@ -944,6 +1684,11 @@ char playMoveUpdating(char* b, N* n) {
         break;
     }
 
+    // Add the piece now on the destination and the new states to the key.
+    k ^= zobristPieces[b[to]][to];
+    k ^= zobristStateKey(n->wKINGSIDE_CASTLE, n->wQUEENSIDE_CASTLE, n->bKINGSIDE_CASTLE, n->bQUEENSIDE_CASTLE, n->EN_PASSANT_FILE);
+    *key = k;
+
     return eps;
 }
 
@@ -952,10 +1697,8 @@ char playMoveUpdating(char* b, N* n) {
 char playMove(char* b, N* n, M* move) {
     char eps = -1;
 
-    // Set moveTo to the true destination square.
     char from = move->f;
     char to = move->t;
-    char tt = move->tt;
 
     char p = b[from];
     char q = b[to];
@@ -1106,11 +1849,62 @@ void playMoveDriver(char* b, D* d) {
     }
 }
 
-// Undo a move on this thread's calculating board.
+// Set the bit of square x in the thread's bitboards to match its calculating board, moving the board eval and phase with it.
+inline void syncBitboardSquare(T* t, char x) {
+    BB m = 1ull << x;
+    char o = EMPTY;
+    for (int i = 0; i < NUM_PIECES; i++) {
+        if ((t->bb)[i] & m) o = i;
+        (t->bb)[i] &= ~m;
+    }
+    if (o != EMPTY) {
+        t->boardEval -= pieceSquareTable[o * 64 + x];
+        t->boardPhase -= piecePhases[o];
+    }
+    char p = (t->cb)[x];
+    if (p != EMPTY) {
+        (t->bb)[p] |= m;
+        t->boardEval += pieceSquareTable[p * 64 + x];
+        t->boardPhase += piecePhases[p];
+    }
+}
+
+// Update the thread's bitboards on the squares that playing or undoing a move on the calculating board changes.
+inline void syncBitboards(T* t, M* m) {
+    syncBitboardSquare(t, m->f);
+    syncBitboardSquare(t, m->t);
+    if (m->enPassantSquare > -1) syncBitboardSquare(t, m->enPassantSquare);
+
+    // A king moving two squares is castling, which also moves a rook.
+    if ((m->mover == wKING || m->mover == bKING) && (m->t - m->f == 2 || m->f - m->t == 2)) {
+        char r = m->f - (m->f % 8);
+        syncBitboardSquare(t, r + (m->t > m->f ? 5 : 3));
+        syncBitboardSquare(t, r + (m->t > m->f ? 7 : 0));
+    }
+}
+
+// Set all of the thread's bitboards, board eval, and phase from its calculating board.
+void setupBitboards(T* t) {
+    for (int i = 0; i < NUM_PIECES; i++) {
+        (t->bb)[i] = 0;
+    }
+    t->boardEval = 0;
+    t->boardPhase = 0;
+    for (int i = 0; i < 64; i++) {
+        char p = (t->cb)[i];
+        if (p != EMPTY) {
+            (t->bb)[p] |= 1ull << i;
+            t->boardEval += pieceSquareTable[p * 64 + i];
+            t->boardPhase += piecePhases[p];
+        }
+    }
+}
+
+// Undo a move on this thread's calculating board and bitboards.
 void undoMove(T* t, M* m) {
     char* b = t->cb;
     b[m->f] = m->mover;
-    b[m->tt] = m->captured;
+    b[m->t] = m->captured;
     
     // Undo an en passant move.
     if (m->enPassantSquare > -1) {
@@ -1137,6 +1931,8 @@ void undoMove(T* t, M* m) {
             }
         }
     }
+
+    syncBitboards(t, m);
 }
 
 // Return whether the given king is being attacked on the board given the king's square.
@@ -1270,86 +2066,80 @@ bool kingNotInCheck(char* b, char x, bool isBlack) {
     return 1;
 }
 
-// Return the difference in eval between this position and what this position would be after making this move.
-inline double computeEvalMove(char* b, char moveFrom, char trueMoveto, char promotion) {
-    double o = 0.0;
-
-    // Account for the captured piece.
-    if (b[trueMoveto] != EMPTY) {
-        if (b[trueMoveto] >= 64 || b[trueMoveto] < 0) {
-            printf("FOUND BAD VALUE: %i %i\n", trueMoveto, b[trueMoveto]);
-        }
-        o -= evalBoards[b[trueMoveto]][trueMoveto];
-    }
-
-    if (b[moveFrom] >= 64 || b[moveFrom] < 0) {
-        printf("%i %i %i\n", moveFrom, trueMoveto, b[moveFrom]);
-    }
-
-    double* z = evalBoards[b[moveFrom]];
-
-    // Account for moving from.
-    o -= z[moveFrom];
-
-    // Account for moving to.
-    if (promotion == -1) {
-        o += z[trueMoveto];
-    }
-    else {
-        o += evalBoards[promotion][trueMoveto];
-    }
-
-    return o;
-}
-
 // Execute an already known to be semilegal move while calculating, creating a new future position.
 // This function is also called when finding all legal moves to determine the legal moves outside of a position evaluation and to determine if stalemate happens.
-void examineMove(T* t, char moveFrom, char moveTo) {
+void examineMove(T* t, MV move) {
 
     // Add this move.
     int l = t->childPoolLength;
-    (t->childFroms)[l] = moveFrom;
-    (t->childTos)[l] = moveTo;
+    (t->childMoves)[l] = move;
     (t->childPoolLength)++;
+}
 
-    char trueMoveto = moveTo;
-    char promotion = -1;
-    if (trueMoveto >= 96) {
-        trueMoveto %= 8;
-        promotion = (trueMoveto / 8) - 5;
-    } else if (trueMoveto >= 64) {
-        trueMoveto = 56 + (trueMoveto % 8);
-        promotion = (trueMoveto / 8) - 7;
-    }
-    
-    double e = 0.0;
+// Make the four promotions (knight, bishop, rook, queen) of a pawn moving from square f to the last rank square x.
+inline void examinePromotions(T* t, char f, char x, char pawn) {
+    examineMove(t, makePromotion(f, x, pawn + 1));
+    examineMove(t, makePromotion(f, x, pawn + 2));
+    examineMove(t, makePromotion(f, x, pawn + 3));
+    examineMove(t, makePromotion(f, x, pawn + 4));
+}
 
-    // If moving to other king, we define this to be a guaranteed checkmate.
+// Fill the thread's childEvals with the eval of the position after each move in its child pool, in one pass from the board eval and phase of node n.
+// Moves capturing a king get KING_CAPTURE_EVAL, negated when capturing the White king. Only a position set up with the
+// player not to move in check has them, since the moves found are legal.
+void computeChildEvals(T* t, N* n) {
     char* b = t->cb;
-    ifBlack(moveFrom) {
-        if (b[trueMoveto] == wKING) {
-            e = BLACK_WINS_EVAL;
+    MV* moves = t->childMoves;
+    int* evals = t->childEvals;
+    int l = t->childPoolLength;
+
+    int boardEval = t->boardEval;
+    int phase = t->boardPhase;
+    char wk = n->wKING_SQUARE, bk = n->bKING_SQUARE;
+    int kingEval = kingPlacementEval(wk, bk, phase);
+
+    for (int i = 0; i < l; i++) {
+        MV move = moves[i];
+        char f = moveFromSquare(move);
+        char x = moveToSquare(move);
+        char mover = b[f];
+        char placed = movePromotion(move) ? movePromotion(move) : mover;
+
+        // A pawn moving diagonally to an empty square captures en passant.
+        char captureSquare = x;
+        if (b[x] == EMPTY && (mover == wPAWN || mover == bPAWN) && (x - f) % 8 != 0) {
+            captureSquare = mover == wPAWN ? x - 8 : x + 8;
         }
-        else {
-            // Evaluate what the position would be after moving.
-            e = computeEvalMove(b, moveFrom, trueMoveto, promotion);
+        char captured = b[captureSquare];
+
+        // If moving to other king, we define this to be a guaranteed checkmate.
+        if (captured == bKING || captured == wKING) {
+            evals[i] = captured == bKING ? KING_CAPTURE_EVAL : -KING_CAPTURE_EVAL;
+            continue;
         }
 
-        if (e < t->bestChildEval) t->bestChildEval = e;
-    }
-    else {
-        if (b[trueMoveto] == bKING) {
-            e = WHITE_WINS_EVAL;
+        int e = boardEval - pieceSquareTable[mover * 64 + f] + pieceSquareTable[placed * 64 + x];
+        int p = phase - piecePhases[mover] + piecePhases[placed];
+        if (captured != EMPTY) {
+            e -= pieceSquareTable[captured * 64 + captureSquare];
+            p -= piecePhases[captured];
         }
-        else {
-            // Evaluate what the position would be after moving.
-            e = computeEvalMove(b, moveFrom, trueMoveto, promotion);
+
+        char w = wk, k = bk;
+        if (mover == wKING || mover == bKING) {
+            if (mover == wKING) w = x;
+            else k = x;
+
+            // A king moving two squares is castling, which also moves a rook.
+            if (x - f == 2 || f - x == 2) {
+                char r = f - (f % 8);
+                int rook = (mover == wKING ? wROOK : bROOK) * 64;
+                e += pieceSquareTable[rook + r + (x > f ? 5 : 3)] - pieceSquareTable[rook + r + (x > f ? 7 : 0)];
+            }
         }
 
-        if (e > t->bestChildEval) t->bestChildEval = e;
+        evals[i] = e + (w == wk && k == bk && p == phase ? kingEval : kingPlacementEval(w, k, p));
     }
-
-    (t->childEvals)[l] = e;
 }
 
 // Make all semilegal moves for a white pawn.
@@ -1359,25 +2149,16 @@ inline void examineWhitePawn(T* t, char x, char epf) {
 
     if (r == 6) {
         ifEmpty(56 + c) { // promoting move
-            mv(64 + c);
-            mv(72 + c);
-            mv(80 + c);
-            mv(88 + c);
+            examinePromotions(t, x, 56 + c, wPAWN);
         }
         if (c > 0) { // promoting capture left
             ifBlack(55 + c) {
-                mv(63 + c);
-                mv(71 + c);
-                mv(79 + c);
-                mv(87 + c);
+                examinePromotions(t, x, 55 + c, wPAWN);
             }
         }
         if (c < 7) { // promoting capture right
-            ifBlack(56 + c) {
-                mv(65 + c);
-                mv(73 + c);
-                mv(81 + c);
-                mv(89 + c);
+            ifBlack(57 + c) {
+                examinePromotions(t, x, 57 + c, wPAWN);
             }
         }
     }
@@ -1412,25 +2193,16 @@ inline void examineBlackPawn(T* t, char x, char epf) {
     
     if (r == 1) {
         ifEmpty(0 + c) { // promoting move
-            mv(96 + c);
-            mv(104 + c);
-            mv(112 + c);
-            mv(120 + c);
+            examinePromotions(t, x, c, bPAWN);
         }
         if (c > 0) { // promoting capture left
             ifWhite(-1 + c) {
-                mv(95 + c);
-                mv(103 + c);
-                mv(111 + c);
-                mv(119 + c);
+                examinePromotions(t, x, c - 1, bPAWN);
             }
         }
         if (c < 7) { // promoting capture right
             ifWhite(1 + c) {
-                mv(97 + c);
-                mv(105 + c);
-                mv(113 + c);
-                mv(121 + c);
+                examinePromotions(t, x, c + 1, bPAWN);
             }
         }
     }
@@ -1892,204 +2664,366 @@ inline void examineBQ(T* t, char x) {
     }
 }
 
-// Add the given node index to this thread's queue based on the given score.
-void addFutureQueue(T* t, int q) {
-
-#if USE_SCORE_BUCKETS
-    double s = (nodes + q)->score;
+// Bitboard square sets used by the bitboard move generator.
+#define FILE_A_SQUARES 0x0101010101010101ull
+#define FILE_H_SQUARES 0x8080808080808080ull
+#define RANK_1_SQUARES 0x00000000000000ffull
+#define RANK_3_SQUARES 0x0000000000ff0000ull
+#define RANK_6_SQUARES 0x0000ff0000000000ull
+#define RANK_8_SQUARES 0xff00000000000000ull
 
-    // Find the bucket to add to.
-    int b;
-    if (s < bucketStart) {
-        b = 0;
-    }
-    else if ((s - bucketStart) / bucketRange >= numBuckets) {
-        b = numBuckets - 1;
-    }
-    else {
-        b = (int)((s - bucketStart) / bucketRange);
-    }
+// Attack sets of the non-sliding pieces from each square.
+BB knightAttacks[64];
+BB kingAttacks[64];
+BB pawnAttacks[2][64]; // Squares attacked by a pawn of the given player on the given square.
 
-    // Resize that bucket if necessary.
-    if ((t->bucketLength)[b] >= (t->bucketCap)[b]) {
-        (t->bucketCap)[b] = (int)((double)((t->bucketCap)[b]) * bucketCapMultiplier + (double)bucketCapAdder);
-        (t->buckets)[b] = (int*)realloc((t->buckets)[b], (t->bucketCap)[b] * 4);
-    }
+// Magic bitboard lookup of a sliding piece's attack set on one square.
+typedef struct {
+    BB mask; // Squares whose occupancy can block the piece (excluding the board edges the rays end at).
+    BB magic;
+    BB* attacks; // Attack sets indexed by ((occupancy & mask) * magic) >> shift.
+    int shift;
+} MG;
+
+MG bishopMagics[64];
+MG rookMagics[64];
+BB* slidingAttackTable;
+
+// Return the lowest square in a non-empty bitboard.
+inline int lowestSquare(BB b) {
+#if defined(_MSC_VER)
+    unsigned long x;
+    _BitScanForward64(&x, b);
+    return (int)x;
+#else
+    return __builtin_ctzll(b);
+#endif
+}
 
-    // Add to the end of that bucket.
-    (t->buckets)[b][(t->bucketLength)[b]] = q;
+// Return the number of squares in a bitboard. Only used while setting up the attack tables.
+int countSquares(BB b) {
+    int c = 0;
+    for (; b; b &= b - 1) c++;
+    return c;
+}
 
-    if (b < t->lowestBucketIndex) t->lowestBucketIndex = b;
+// Return the attack set of a bishop (or rook) on square x by walking its rays square by square.
+BB slidingAttacksSlow(char x, BB occupancy, bool rook) {
+    char dr[2][4] = { { 1, 1, -1, -1 }, { 1, -1, 0, 0 } };
+    char dc[2][4] = { { 1, -1, 1, -1 }, { 0, 0, 1, -1 } };
+    BB o = 0;
 
-    (t->bucketLength[b])++;
-    (t->futuresQueueSize)++;
-#else
-    (t->futuresQueueSize)++;
-    int l = t->futuresQueueSize;
-    if (l >= t->futuresHeapCap) { // one greater due to heap offset
-        t->futuresHeapCap = (int)((double)(t->futuresHeapCap) * futuresHeapCapMultiplier + (double)futuresHeapCapAdder);
-        t->futuresHeap = (int*)realloc(t->futuresHeap, t->futuresHeapCap * 4);
+    for (int i = 0; i < 4; i++) {
+        char r = x / 8 + dr[rook][i], c = x % 8 + dc[rook][i];
+        while (r >= 0 && r <= 7 && c >= 0 && c <= 7) {
+            BB m = 1ull << (r * 8 + c);
+            o |= m;
+            if (occupancy & m) break;
+            r += dr[rook][i];
+            c += dc[rook][i];
+        }
     }
+    return o;
+}
 
-    int* h = t->futuresHeap;
-    h[l] = q; // one greater due to heap offset
+// Return the attack set of a bishop on square x given all occupied squares.
+inline BB bishopAttacks(char x, BB occupancy) {
+    MG* m = bishopMagics + x;
+    return m->attacks[((occupancy & m->mask) * m->magic) >> m->shift];
+}
 
-    // Reheap.
-    int i = l; // one greater due to heap offset
-    while (i > 1) {
-        int p = i / 2;
-        if ((nodes + h[i])->score < (nodes + h[p])->score) {
-            int temp = h[i];
-            h[i] = h[p];
-            h[p] = temp;
-        }
-        else {
+// Return the attack set of a rook on square x given all occupied squares.
+inline BB rookAttacks(char x, BB occupancy) {
+    MG* m = rookMagics + x;
+    return m->attacks[((occupancy & m->mask) * m->magic) >> m->shift];
+}
+
+// Find a magic number for one square of a sliding piece and fill its part of the attack table.
+// Return the number of table entries used.
+int setupSlidingMagic(MG* m, char x, bool rook, BB* table, unsigned long long* seed) {
+    BB edges = ((RANK_1_SQUARES | RANK_8_SQUARES) & ~(RANK_1_SQUARES << (8 * (x / 8))))
+        | ((FILE_A_SQUARES | FILE_H_SQUARES) & ~(FILE_A_SQUARES << (x % 8)));
+    m->mask = slidingAttacksSlow(x, 0, rook) & ~edges;
+    int bits = countSquares(m->mask);
+    int size = 1 << bits;
+    m->shift = 64 - bits;
+    m->attacks = table;
+
+    // List every blocker subset of the mask with its attack set (Carry-Rippler enumeration).
+    BB* occupancies = (BB*)calloc(size, sizeof(BB));
+    BB* reference = (BB*)calloc(size, sizeof(BB));
+    int* used = (int*)calloc(size, sizeof(int)); // Attempt number that last wrote each table entry.
+    if (occupancies == NULL || reference == NULL || used == NULL) crash();
+    BB sub = 0;
+    for (int i = 0; i < size; i++) {
+        occupancies[i] = sub;
+        reference[i] = slidingAttacksSlow(x, sub, rook);
+        sub = (sub - m->mask) & m->mask;
+    }
+
+    // Try sparse random numbers until one maps every subset to a table entry without a harmful collision.
+    for (int attempt = 1;; attempt++) {
+        BB magic;
+        do {
+            BB r[3];
+            for (int j = 0; j < 3; j++) {
+                *seed ^= *seed >> 12;
+                *seed ^= *seed << 25;
+                *seed ^= *seed >> 27;
+                r[j] = *seed * 0x2545f4914f6cdd1dull;
+            }
+            magic = r[0] & r[1] & r[2];
+        } while (countSquares((m->mask * magic) >> 56) < 6);
+
+        bool ok = 1;
+        for (int i = 0; i < size; i++) {
+            int index = (int)((occupancies[i] * magic) >> m->shift);
+            if (used[index] != attempt) {
+                used[index] = attempt;
+                table[index] = reference[i];
+            }
+            else if (table[index] != reference[i]) {
+                ok = 0;
+                break;
+            }
+        }
+
+        if (ok) {
+            m->magic = magic;
             break;
         }
-        i = p;
     }
 
-#endif
+    clear(occupancies);
+    clear(reference);
+    clear(used);
+    return size;
 }
 
-// If e is the eval of a checkmate, return the eval of a mate in one, etc.
-inline double evalForcedMateDelay(double e) {
-    if (e >= WHITE_WINS_EVAL_THRESHOLD) {
-        return e - EVAL_FORCED_MATE_INCREMENT;
+// Fill the attack tables of all pieces. The magic numbers are found from a fixed seed, so they are the same in every run.
+void setupAttackTables() {
+    for (int x = 0; x < 64; x++) {
+        char r = x / 8, c = x % 8;
+        knightAttacks[x] = 0;
+        kingAttacks[x] = 0;
+        pawnAttacks[WHITE][x] = 0;
+        pawnAttacks[BLACK][x] = 0;
+
+        for (int dr = -2; dr <= 2; dr++) {
+            for (int dc = -2; dc <= 2; dc++) {
+                if (r + dr < 0 || r + dr > 7 || c + dc < 0 || c + dc > 7) continue;
+                BB m = 1ull << (x + 8 * dr + dc);
+                int a = dr * dr + dc * dc;
+                if (a == 5) knightAttacks[x] |= m;
+                if (a == 1 || a == 2) kingAttacks[x] |= m;
+                if (a == 2 && dr == 1) pawnAttacks[WHITE][x] |= m;
+                if (a == 2 && dr == -1) pawnAttacks[BLACK][x] |= m;
+            }
+        }
     }
-    if (e <= BLACK_WINS_EVAL_THRESHOLD) {
-        return e + EVAL_FORCED_MATE_INCREMENT;
+
+    if (slidingAttackTable != NULL) return;
+
+    // Bishop tables use 5248 entries and rook tables use 102400 entries in total.
+    slidingAttackTable = (BB*)calloc(5248 + 102400, sizeof(BB));
+    if (slidingAttackTable == NULL) crash();
+
+    unsigned long long seed = 0x7c3a91d5e2b84f06;
+    BB* table = slidingAttackTable;
+    for (int x = 0; x < 64; x++) {
+        table += setupSlidingMagic(bishopMagics + x, x, 0, table, &seed);
+    }
+    for (int x = 0; x < 64; x++) {
+        table += setupSlidingMagic(rookMagics + x, x, 1, table, &seed);
     }
-    return e;
 }
 
-// Backtrack up the tree, keeping the eval of every node in the tree perfectly up-to-date.
-inline void evalBacktrack(N* n) {
-    double oldEval;
-    N* first = n;
-
-    // Update the parents' evals to keep the eval of every node in the tree perfectly up-to-date.
-    while(1) {
+// Return the squares strictly between squares a and b, which share a rank or file (rook) or a diagonal (not rook).
+inline BB squaresBetween(char a, char b, bool rook) {
+    if (rook) return rookAttacks(a, 1ull << b) & rookAttacks(b, 1ull << a);
+    return bishopAttacks(a, 1ull << b) & bishopAttacks(b, 1ull << a);
+}
 
-        char turn = n->PLAYER_TURN;
-        if (turn == BLACK) {
+// Return whether squares a and b share a rank or file.
+inline bool sameRankOrFile(char a, char b) {
+    return a / 8 == b / 8 || a % 8 == b % 8;
+}
 
-            oldEval = (n->e).load();
+// Return whether square x is attacked by any piece of the given player on the thread's bitboards.
+inline bool squareAttacked(T* t, char x, bool byBlack, BB occupancy) {
+    BB* p = t->bb;
+    char z = byBlack ? 6 : 0;
 
-            // Set the parent's eval to be the best (minimum considering it's Black's turn) of the child evals.
-            int nc = n->numChildren;
-            N* c = nodes + n->childStartIndex;
-            double e = evalForcedMateDelay((c->e).load());
-            for (int i = 1; i < nc; i++) {
-                c++;
-                double childEval = evalForcedMateDelay((c->e).load());
-                if (childEval < e) e = childEval;
-            }
+    if (pawnAttacks[!byBlack][x] & p[z + wPAWN]) return 1;
+    if (knightAttacks[x] & p[z + wKNIGHT]) return 1;
+    if (kingAttacks[x] & p[z + wKING]) return 1;
+    if (bishopAttacks(x, occupancy) & (p[z + wBISHOP] | p[z + wQUEEN])) return 1;
+    if (rookAttacks(x, occupancy) & (p[z + wROOK] | p[z + wQUEEN])) return 1;
+    return 0;
+}
 
-            // If the parent's eval did not change, there is no reason to keep going.
-            if (oldEval == e) {
-                break;
-            }
+// Make a move from square f to every square in the given set.
+inline void examineMovesTo(T* t, char f, BB targets) {
+    while (targets) {
+        examineMove(t, makeMove(f, lowestSquare(targets)));
+        targets &= targets - 1;
+    }
+}
 
-            (n->e).store(e);
-            if (n - nodes == 1) {
-                printf("%i %i %f %f  ", first - n, n - nodes, oldEval, e);
+// Make all legal moves of the player whose turn it is in node n using the thread's bitboards.
+// While in check, the other pieces may only capture a single checking piece or block its line (checkMask), pinned pieces
+// may only move along the line between the king and the piece pinning them, and the king only moves to squares not
+// attacked with it taken off the board. Without a king, the moves are only semilegal.
+// This finds the legal moves among those of examineAllMovesMailbox() (possibly in a different order).
+void examineAllMovesBitboard(T* t, N* n) {
+    BB* p = t->bb;
+    BB white = p[wPAWN] | p[wKNIGHT] | p[wBISHOP] | p[wROOK] | p[wQUEEN] | p[wKING];
+    BB black = p[bPAWN] | p[bKNIGHT] | p[bBISHOP] | p[bROOK] | p[bQUEEN] | p[bKING];
+    BB occupancy = white | black;
+    BB empty = ~occupancy;
+    bool isBlack = n->PLAYER_TURN == BLACK;
+    char z = isBlack ? 6 : 0;
+    char ez = isBlack ? 0 : 6;
+    BB own = isBlack ? black : white;
+    BB enemy = isBlack ? white : black;
+    char epf = n->EN_PASSANT_FILE;
+
+    // Find the pieces checking the king, the pieces pinned to it, and the squares the king cannot move to.
+    BB king = p[z + wKING];
+    BB enemyRQ = p[ez + wROOK] | p[ez + wQUEEN];
+    BB enemyBQ = p[ez + wBISHOP] | p[ez + wQUEEN];
+    char ks = king ? lowestSquare(king) : UNDEFINED;
+    BB checkers = 0, pinned = 0;
+    BB checkMask = ~0ull;
+    BB pinRays[64];
+    if (king) {
+        checkers = (pawnAttacks[isBlack][ks] & p[ez + wPAWN]) | (knightAttacks[ks] & p[ez + wKNIGHT])
+            | (bishopAttacks(ks, occupancy) & enemyBQ) | (rookAttacks(ks, occupancy) & enemyRQ);
+        if (checkers & (checkers - 1)) {
+            checkMask = 0;
+        }
+        else if (checkers) {
+            char c = lowestSquare(checkers);
+            checkMask = checkers;
+            if (checkers & (enemyRQ | enemyBQ)) checkMask |= squaresBetween(ks, c, sameRankOrFile(ks, c));
+        }
+
+        // A sliding piece that would attack the king if only its own pieces were on the board pins a lone piece between them.
+        BB snipers = (rookAttacks(ks, enemy) & enemyRQ) | (bishopAttacks(ks, enemy) & enemyBQ);
+        for (; snipers; snipers &= snipers - 1) {
+            char s = lowestSquare(snipers);
+            BB between = squaresBetween(ks, s, sameRankOrFile(ks, s));
+            BB blockers = between & occupancy;
+            if ((blockers & own) && !(blockers & (blockers - 1))) {
+                pinned |= blockers;
+                pinRays[lowestSquare(blockers)] = between | (1ull << s);
             }
         }
-        else {
-
-            oldEval = (n->e).load();
+    }
 
-            // Set the parent's eval to be the best (maximum considering it's White's turn) of the child evals.
-            int nc = n->numChildren;
-            N* c = nodes + n->childStartIndex;
-            double e = evalForcedMateDelay((c->e).load());
-            for (int i = 1; i < nc; i++) {
-                c++;
-                double childEval = evalForcedMateDelay((c->e).load());
-                if (childEval > e) e = childEval;
+    // Pawn pushes and captures, shifting all pawns at once.
+    BB pawns = p[z + wPAWN];
+    BB push, doublePush, left, right;
+    char forward;
+    if (isBlack) {
+        forward = -8;
+        push = (pawns >> 8) & empty;
+        doublePush = ((push & RANK_6_SQUARES) >> 8) & empty;
+        left = ((pawns & ~FILE_A_SQUARES) >> 9) & enemy;
+        right = ((pawns & ~FILE_H_SQUARES) >> 7) & enemy;
+    }
+    else {
+        forward = 8;
+        push = (pawns << 8) & empty;
+        doublePush = ((push & RANK_3_SQUARES) << 8) & empty;
+        left = ((pawns & ~FILE_A_SQUARES) << 7) & enemy;
+        right = ((pawns & ~FILE_H_SQUARES) << 9) & enemy;
+    }
+
+    BB lastRank = isBlack ? RANK_1_SQUARES : RANK_8_SQUARES;
+    BB sets[4] = { push & checkMask, left & checkMask, right & checkMask, doublePush & checkMask };
+    char offsets[4] = { forward, (char)(forward - 1), (char)(forward + 1), (char)(2 * forward) };
+    for (int i = 0; i < 4; i++) {
+        for (BB m = sets[i]; m; m &= m - 1) {
+            char x = lowestSquare(m);
+            char f = x - offsets[i];
+            if (((pinned >> f) & 1) && !((pinRays[f] >> x) & 1)) continue;
+            if ((1ull << x) & lastRank) {
+                examinePromotions(t, f, x, z + wPAWN);
             }
-
-            // If the parent's eval did not change, there is no reason to keep going.
-            if (oldEval == e) {
-                break;
+            else {
+                examineMove(t, makeMove(f, x));
             }
+        }
+    }
 
-            (n->e).store(e);
-            if (n - nodes == 1) {
-                printf("%i %i %f %f  ", first - n, n - nodes, oldEval, e);
+    // En passant captures onto the square the enemy pawn skipped. Removing both pawns from their rank can expose the king,
+    // so the capture is checked against the sliding pieces directly.
+    if (epf > -1) {
+        char x = isBlack ? 16 + epf : 40 + epf;
+        char captured = x - forward;
+        for (BB m = pawnAttacks[!isBlack][x] & pawns; m; m &= m - 1) {
+            char f = lowestSquare(m);
+            if (king) {
+                BB o = (occupancy ^ (1ull << f) ^ (1ull << captured)) | (1ull << x);
+                if (checkers & ~(1ull << captured) & (p[ez + wPAWN] | p[ez + wKNIGHT])) continue;
+                if ((rookAttacks(ks, o) & enemyRQ) || (bishopAttacks(ks, o) & enemyBQ)) continue;
             }
+            examineMove(t, makeMove(f, x));
         }
-
-        if (n == nodes) break;
-        n = nodes + n->parentIndex;
     }
-}
-
-// Called after creating a node from a move.
-// Play the move in the node on the node's miscellaneous data.
-// Find, execute, evaluate, and queue (using global move parallel array indices) all moves from there.
-// Called both to expand tree and find all legal moves in an arbitrary position.
-// Return whether there are no more global moves available.
-bool examineAllSemilegalMoves(T* t, int nodeIndex) {
-    N* n = nodes + nodeIndex;
-    char* b = t->cb;
 
-    char ob[64] = {
-        0,0,0,0,0,0,0,0,
-        0,0,0,0,0,0,0,0,
-        0,0,0,0,0,0,0,0,
-        0,0,0,0,0,0,0,0,
-        0,0,0,0,0,0,0,0,
-        0,0,0,0,0,0,0,0,
-        0,0,0,0,0,0,0,0,
-        0,0,0,0,0,0,0,0
-    };
-    for (int i = 0; i < 64; i++) {
-        ob[i] = b[i];
+    // Piece moves.
+    BB targets = ~own & checkMask;
+    for (BB m = p[z + wKNIGHT] & ~pinned; m; m &= m - 1) {
+        char x = lowestSquare(m);
+        examineMovesTo(t, x, knightAttacks[x] & targets);
+    }
+    for (BB m = p[z + wBISHOP]; m; m &= m - 1) {
+        char x = lowestSquare(m);
+        BB a = bishopAttacks(x, occupancy) & targets;
+        if ((pinned >> x) & 1) a &= pinRays[x];
+        examineMovesTo(t, x, a);
+    }
+    for (BB m = p[z + wROOK]; m; m &= m - 1) {
+        char x = lowestSquare(m);
+        BB a = rookAttacks(x, occupancy) & targets;
+        if ((pinned >> x) & 1) a &= pinRays[x];
+        examineMovesTo(t, x, a);
+    }
+    for (BB m = p[z + wQUEEN]; m; m &= m - 1) {
+        char x = lowestSquare(m);
+        BB a = (bishopAttacks(x, occupancy) | rookAttacks(x, occupancy)) & targets;
+        if ((pinned >> x) & 1) a &= pinRays[x];
+        examineMovesTo(t, x, a);
+    }
+    // The king's destinations are checked with the king off the board, so it cannot step back along a checking line.
+    BB kingOff = occupancy & ~king;
+    for (BB m = king ? kingAttacks[ks] & ~own : 0; m; m &= m - 1) {
+        char x = lowestSquare(m);
+        if (!squareAttacked(t, x, !isBlack, kingOff)) examineMove(t, makeMove(ks, x));
     }
-    
-    // Clear the child pool so we can find all children.
-    t->childPoolLength = 0;
-
-    // Traverse back to the root node, collecting the moves.
-    N* p = n;
-    M* move;
-    int d = 0;
-
-    if (n != nodes) { // This check is needed to avoid making the undefined root move (stored in the queued node).
-
-        while (p != nodes) {
-            move = t->moves + d;
-            d++;
-
-            move->f = p->SQUARE_FROM;
-            char to = p->SQUARE_TO;
-            move->t = to;
-            move->tt = to < 64 ? to : to < 96 ? 56 + (to % 8) : to % 8;
-            move->promotion = to < 64 ? -1 : to < 96 ? (to / 8) - 7 : (to / 8) - 5;
 
-            if (p->parentIndex == 0) break;
-            p = nodes + p->parentIndex;
+    // Castling, which requires the king's start, pass-through, and destination squares to not be attacked.
+    char k = isBlack ? 60 : 4;
+    char* b = t->cb;
+    bool kingside = isBlack ? n->bKINGSIDE_CASTLE : n->wKINGSIDE_CASTLE;
+    bool queenside = isBlack ? n->bQUEENSIDE_CASTLE : n->wQUEENSIDE_CASTLE;
+    if ((kingside || queenside) && b[k] == z + wKING && !checkers) {
+        if (kingside && b[k + 3] == z + wROOK && !(occupancy & (3ull << (k + 1)))
+            && !squareAttacked(t, k + 1, !isBlack, occupancy) && !squareAttacked(t, k + 2, !isBlack, occupancy)) {
+            examineMove(t, makeMove(k, k + 2));
         }
-
-        // Play those moves in reverse order on the thread's calculating board.
-        for (int i = d - 1; i > 0; i--) {
-            move = t->moves + i;
-
-            // Find the other characteristics of the moves so we can undo.
-            move->mover = b[move->f];
-            move->captured = b[move->tt];
-            move->enPassantSquare = playMove(b, n, move);
+        if (queenside && b[k - 4] == z + wROOK && !(occupancy & (7ull << (k - 3)))
+            && !squareAttacked(t, k - 1, !isBlack, occupancy) && !squareAttacked(t, k - 2, !isBlack, occupancy)) {
+            examineMove(t, makeMove(k, k - 2));
         }
-
-        // Make the chosen move stored in the queued node, updating the data in n.
-        move = t->moves;
-        move->mover = b[move->f];
-        move->captured = b[move->tt];
-        move->enPassantSquare = playMoveUpdating(b, n);
     }
+}
 
+// Make all semilegal moves of the player whose turn it is in node n by scanning the calculating board.
+void examineAllMovesMailbox(T* t, N* n) {
+    char* b = t->cb;
     char playerTurn = n->PLAYER_TURN;
 
     if (playerTurn == WHITE) {
@@ -2136,298 +3070,2437 @@ bool examineAllSemilegalMoves(T* t, int nodeIndex) {
             }
         }
     }
+}
 
-    // Undo the moves starting at the queued node and going to the root on the thread's calculating board.
-    for (int i = 0; i < d; i++) {
-        undoMove(t, t->moves + i);
+// Return whether a semilegal move of the player whose turn it is in node n leaves their king unattacked on board b.
+// Castling is only generated when the squares the king crosses are not attacked, so only the king's destination is checked.
+bool semilegalMoveIsLegal(char* b, N* n, MV move) {
+    char B[64];
+    memcpy(B, b, 64);
+
+    char f = moveFromSquare(move);
+    char x = moveToSquare(move);
+    char mover = B[f];
+
+    // A pawn moving diagonally to an empty square captures en passant.
+    if (B[x] == EMPTY && (mover == wPAWN || mover == bPAWN) && (x - f) % 8 != 0) {
+        B[mover == wPAWN ? x - 8 : x + 8] = EMPTY;
     }
+    B[x] = mover;
+    B[f] = EMPTY;
 
-    // Debug: Check if position is now start        TODO: remove
-    
-    for (int i = 0; i < 64; i++) {
-        if (b[i] != ob[i]) {
-            printf("Node %i: B[%i] is %i and old B[%i] is %i.\n", nodeIndex, i, b[i], i, ob[i]);
-            for (int j = d - 1; j >= 0; j--) {
-                printf("- Node %i, depth %i: %i -> %i, %i captured %i, eps %i\n", nodeIndex, d - 1 - j,
-                    ((t->moves) + j)->f, ((t->moves) + j)->t, ((t->moves) + j)->mover, ((t->moves) + j)->captured, ((t->moves) + j)->enPassantSquare
-                );
-            }
-        }
+    bool isBlack = n->PLAYER_TURN == BLACK;
+    char kingSquare = isBlack ? n->bKING_SQUARE : n->wKING_SQUARE;
+    if (mover == wKING || mover == bKING) kingSquare = x;
+    return kingNotInCheck(B, kingSquare, isBlack);
+}
+
+// Remove the moves in the thread's child pool that leave the king of the player whose turn it is in node n attacked,
+// which only the mailbox generator makes.
+void removeIllegalMoves(T* t, N* n) {
+    MV* moves = t->childMoves;
+    int l = 0;
+    for (int i = 0; i < t->childPoolLength; i++) {
+        if (semilegalMoveIsLegal(t->cb, n, moves[i])) moves[l++] = moves[i];
     }
+    t->childPoolLength = l;
+}
 
-    int newNC = t->childPoolLength;
+// Heap entries are stored from position d - 1, where d is the number of children per entry, so the children of the entry
+// at position i are at positions d * (i - d + 2) onwards and the parent of the entry at position i is at i / d + d - 2.
+// With d = 2, this is the usual heap from position 1. Each entry's children are next to each other, so a heap with more
+// children per entry is shallower and compares the children of an entry within one or two cache lines.
 
-    // If there are no semilegal moves, mark this node as checkmate or stalemate.
-    if (newNC == 0) {
-        char kingSquare = playerTurn == BLACK ? n->bKING_SQUARE : n->wKING_SQUARE;
+// Move entry e up from heap position i until its place is found, in a heap with d children per entry.
+inline void heapMoveUp(QE* h, int i, QE e, int d) {
+    while (i >= d) {
+        int p = i / d + d - 2;
+        if (e.score < h[p].score) {
+            h[i] = h[p];
+            i = p;
+        }
+        else {
+            break;
+        }
+    }
+    h[i] = e;
+}
 
-        if (kingNotInCheck(b, kingSquare, playerTurn)) {
-            n->GAME_STATE = DRAW;
-            n->e.store(DRAW_EVAL);
+// Move entry e down from heap position i until its place is found, in a heap with d children per entry that ends before end.
+inline void heapMoveDown(QE* h, int i, QE e, int end, int d) {
+    while (1) {
+        int c = d * (i - d + 2);
+        if (c >= end) break;
+        int last = c + d < end ? c + d : end;
+        int b = c;
+        for (int j = c + 1; j < last; j++) {
+            if (h[j].score < h[b].score) b = j;
         }
-        else if (playerTurn == BLACK) {
-            n->GAME_STATE = WHITE_WIN;
-            n->e.store(WHITE_WINS_EVAL);
+        if (h[b].score < e.score) {
+            h[i] = h[b];
+            i = b;
         }
         else {
-            n->GAME_STATE = BLACK_WIN;
-            n->e.store(BLACK_WINS_EVAL);
+            break;
         }
-
-        return 0;
     }
+    h[i] = e;
+}
+
+// Change the capacity of a thread's heap, keeping its entries. The heap starts at a cache line boundary so that the children
+// of an entry, which start at a multiple of the number of children, share as few cache lines as possible.
+void resizeFuturesHeap(T* t, int cap) {
+    int oldOffset = t->futuresHeapMemory == NULL ? 0 : (int)((char*)(t->futuresHeap) - t->futuresHeapMemory);
+    int kept = t->futuresHeapCap < cap ? t->futuresHeapCap : cap;
+    char* m = (char*)realloc(t->futuresHeapMemory, (size_t)cap * sizeof(QE) + CACHE_LINE_SIZE);
+    if (m == NULL) crash();
+    int offset = (int)((CACHE_LINE_SIZE - (unsigned long long)m % CACHE_LINE_SIZE) % CACHE_LINE_SIZE);
+    if (offset != oldOffset) memmove(m + offset, m + oldOffset, (size_t)kept * sizeof(QE));
+    t->futuresHeapMemory = m;
+    t->futuresHeap = (QE*)(m + offset);
+    t->futuresHeapCap = cap;
+}
 
-    char* froms = t->childFroms;
-    char* tos = t->childTos;
-    double* evals = t->childEvals;
+// Allocate the bucket list of a thread if it has none, with no nodes.
+void allocateBuckets(T* t) {
+    if (t->buckets != NULL) return;
+    t->buckets = (QE**)calloc(numBuckets, sizeof(QE*));
+    t->bucketCap = (int*)calloc(numBuckets, 4);
+    t->bucketLength = (int*)calloc(numBuckets, 4);
+    if (t->buckets == NULL || t->bucketCap == NULL || t->bucketLength == NULL) crash();
+    t->lowestBucketIndex = INT_MAX;
+    t->bucketWidth = 0;
+}
 
-    int nl = globalMoveLength.fetch_add(newNC);
-    if (nl >= globalMoveCap.load()) {
-        return 1;
+// Return the bucket for the given score, starting the buckets at it if it is the first score queued.
+inline int getBucketIndex(T* t, float s) {
+    if (t->bucketWidth <= 0) {
+        t->bucketStart = s;
+        t->bucketWidth = (float)bucketRange;
+        t->bucketUnderflow = 0;
+    }
+    if (s < t->bucketStart) {
+        t->bucketUnderflow = 1;
+        return 0;
     }
-    calcNumMovesAdded.fetch_add(newNC);
+    float b = (s - t->bucketStart) / t->bucketWidth;
+    return b >= (float)(numBuckets - 1) ? numBuckets - 1 : (int)b;
+}
 
-    // Store the moves in the new node and get the new node's eval.
-    n->numMoves = newNC;
-    n->moveStartIndex = nl;
+// Add an entry to the end of bucket b.
+inline void addBucket(T* t, int b, QE e) {
+    if ((t->bucketLength)[b] >= (t->bucketCap)[b]) {
+        (t->bucketCap)[b] = (int)((double)((t->bucketCap)[b]) * bucketCapMultiplier + (double)bucketCapAdder);
+        (t->buckets)[b] = (QE*)realloc((t->buckets)[b], (t->bucketCap)[b] * sizeof(QE));
+        if ((t->buckets)[b] == NULL) crash();
+    }
+    (t->buckets)[b][(t->bucketLength)[b]] = e;
+    (t->bucketLength)[b]++;
+    if (b < t->lowestBucketIndex) t->lowestBucketIndex = b;
+}
 
-    double parentEval = 0.0;
-    if(n->parentIndex >= 0) parentEval = (nodes + n->parentIndex)->e;
-    double best = playerTurn == BLACK ? WHITE_WINS_EVAL : BLACK_WINS_EVAL;
+// Spread the scores in the last bucket, which must be the only one with nodes, over all the buckets.
+// Return 0 if they are all the same score, so there is nothing to spread.
+bool spreadLastBucket(T* t) {
+    int l = numBuckets - 1;
+    QE* b = (t->buckets)[l];
+    int n = (t->bucketLength)[l];
+    float lo = b[0].score, hi = b[0].score;
+    for (int i = 1; i < n; i++) {
+        if (b[i].score < lo) lo = b[i].score;
+        if (b[i].score > hi) hi = b[i].score;
+    }
+    float w = (hi - lo) / (float)(numBuckets - 1);
+    if (!(w > 0)) return 0;
+
+    // Take the entries out of the last bucket and add them again with the new bucket range.
+    (t->buckets)[l] = NULL;
+    (t->bucketCap)[l] = 0;
+    (t->bucketLength)[l] = 0;
+    t->lowestBucketIndex = INT_MAX;
+    t->bucketStart = lo;
+    t->bucketWidth = w;
+    for (int i = 0; i < n; i++) {
+        addBucket(t, getBucketIndex(t, b[i].score), b[i]);
+    }
+    free(b);
+    return 1;
+}
 
-    for (int i = 0; i < newNC; i++) {
-        globalMoveFrom[nl + i] = froms[i];
-        globalMoveTo[nl + i] = tos[i];
+// Move the buckets down to start at the lowest score in the first bucket, which must be the lowest one with nodes, when
+// it has scores below bucketStart. The other buckets move up by whole widths so they keep their ranges (the ones moved
+// past the last bucket join it), and the first bucket's entries are added again.
+// Return 0 if it has no score below bucketStart, so there is nothing to rebase.
+bool rebaseFirstBucket(T* t) {
+    t->bucketUnderflow = 0;
+    QE* b = (t->buckets)[0];
+    int n = (t->bucketLength)[0];
+    float lo = b[0].score;
+    for (int i = 1; i < n; i++) {
+        if (b[i].score < lo) lo = b[i].score;
+    }
+    if (!(lo < t->bucketStart)) return 0;
+
+    // Find the number of widths to move the buckets up by, so the lowest score is in the first bucket.
+    int l = numBuckets - 1;
+    double k = ceil(((double)(t->bucketStart) - (double)lo) / (double)(t->bucketWidth));
+    int shift = k < (double)l ? (int)k : l;
+    if (shift < 1) shift = 1;
+
+    // Merge the buckets that would move past the last bucket into it, then move the others up, highest first.
+    int first = l - shift < 1 ? 1 : l - shift;
+    for (int i = first; i < l; i++) {
+        for (int j = 0; j < (t->bucketLength)[i]; j++) {
+            addBucket(t, l, (t->buckets)[i][j]);
+        }
+        clear((t->buckets)[i]);
+        (t->bucketCap)[i] = 0;
+        (t->bucketLength)[i] = 0;
+    }
+    for (int i = first - 1; i >= 1; i--) {
+        (t->buckets)[i + shift] = (t->buckets)[i];
+        (t->bucketCap)[i + shift] = (t->bucketCap)[i];
+        (t->bucketLength)[i + shift] = (t->bucketLength)[i];
+        (t->buckets)[i] = NULL;
+        (t->bucketCap)[i] = 0;
+        (t->bucketLength)[i] = 0;
+    }
+
+    // Take the entries out of the first bucket and add them again with the new bucket start.
+    (t->buckets)[0] = NULL;
+    (t->bucketCap)[0] = 0;
+    (t->bucketLength)[0] = 0;
+    t->lowestBucketIndex = INT_MAX;
+    t->bucketStart = shift == l ? lo : (float)((double)(t->bucketStart) - (double)shift * (double)(t->bucketWidth));
+    if (t->bucketStart > lo) t->bucketStart = lo;
+    for (int i = 0; i < n; i++) {
+        addBucket(t, getBucketIndex(t, b[i].score), b[i]);
+    }
+    free(b);
+    return 1;
+}
 
-        // TODO: If capture king, quit and handle parent as checkmate (also find and handle stalemates)
+// Add the given node index to this thread's queue based on the given score.
+void addFutureQueue(T* t, int q, float s) {
+    QE e;
+    e.score = s;
+    e.index = q;
+
+    if (queueType == QUEUE_BUCKETS) {
+        addBucket(t, getBucketIndex(t, s), e);
+        (t->futuresQueueSize)++;
+        return;
+    }
 
-        double eval = parentEval + evals[i];
+    // Grow the heap if the new entry's position does not fit.
+    int d = queueType;
+    int end = t->futuresQueueSize + d - 1;
+    if (end >= t->futuresHeapCap) {
+        resizeFuturesHeap(t, (int)((double)(t->futuresHeapCap) * futuresHeapCapMultiplier + (double)futuresHeapCapAdder) + d);
+    }
+    (t->futuresQueueSize)++;
 
-        // Get the best of the resulting position evals.
-        if (playerTurn == BLACK) {
-            if (eval < best) best = eval;
-        }
-        else {
-            if (eval > best) best = eval;
-        }
+    // Constant numbers of children let each heap be compiled on its own.
+    QE* h = t->futuresHeap;
+    switch (d) {
+    case 2:
+        heapMoveUp(h, end, e, 2);
+        break;
+    case 8:
+        heapMoveUp(h, end, e, 8);
+        break;
+    default:
+        heapMoveUp(h, end, e, 4);
     }
+}
 
-    // Set the new node's eval to be the best.
-    n->e = best;
+// Add the given node index to this thread's stash of nodes deeper than evaluationDepthLimit.
+void addStash(T* t, int q, float s) {
+    if (t->stashLength >= t->stashCap) {
+        t->stashCap = (int)((double)(t->stashCap) * futuresHeapCapMultiplier + (double)futuresHeapCapAdder);
+        t->stash = (QE*)realloc(t->stash, t->stashCap * sizeof(QE));
+        if (t->stash == NULL) crash();
+    }
+    QE* e = t->stash + t->stashLength;
+    e->score = s;
+    e->index = q;
+    (t->stashLength)++;
+}
 
-    // If max depth is reached, do not examine.
-    // (I wish there was a way to stash these nodes to be able to evaluate them when increasing max depth in the middle of the evaluation.)
-    //if (depth >= evaluationDepthLimit) {
-    //    continue;
-    //}     TODO: Decide what to do with depth. Maybe an int in the node struct?
+// Queue the given examined node with the given score if it has moves to expand.
+// Nodes deeper than evaluationDepthLimit are stashed instead, so they can be queued if the limit is raised (see setEvaluationDepthLimit()).
+void queueFuture(T* t, int q, float s) {
+    N* n = nodes + q;
 
-    addFutureQueue(t, nodeIndex);
-    return 0;
-}
+    // Checkmates, stalemates, and transpositions have no moves of their own.
+    // Nodes that have not been examined yet (see lazyExpansion and compactTree()) do not have theirs yet.
+    if (n->examined && n->numMoves <= 0) return;
 
-// Pop and return the global index of the first (lowest score) queued node from this thread's queue.
-// Assume the queue is not empty.
-int getFirstFuture(T* t) {
-    calcNumNodesExamined.fetch_add(1);
+    // The move stacks hold at most MAX_DEPTH moves, so nodes this deep are never expanded.
+    if (n->depth >= MAX_DEPTH - 1) return;
 
-    #if USE_SCORE_BUCKETS
+    countStat(t->stats.nodesQueuedDepth[n->depth], 1);
 
-        // Remove the last element in the bucket with the lowest index containing an element.
-        int* bl = t->bucketLength;
-        for (int i = t->lowestBucketIndex;; i++) {
-            if (bl[i] > 0) {
-                bl[i]--;
-                (t->futuresQueueSize)--;
-                int o = (t->buckets)[i][bl[i]];
-                t->lowestBucketIndex = i;
-                return o;
-            }
-        }
+    if (n->depth > evaluationDepthLimit) {
+        addStash(t, q, s);
+    }
+    else {
+        addFutureQueue(t, q, s);
+    }
+}
 
-    #else
+// Return the index of the node holding the position with the given key in this evaluation, or UNDEFINED.
+inline int probeTranspositionTable(unsigned long long key) {
+    TE* e = transpositionTable + (key & transpositionTableMask);
+    unsigned long long data = (e->data).load(memory_order_acquire);
+    unsigned long long check = (e->check).load(memory_order_acquire);
 
-        // Remove the minimum element at index 1 due to heap offset.
-        int* h = t->futuresHeap;
-        int o = h[1];
-        int s = t->futuresQueueSize; // one greater due to heap offset
-        (t->futuresQueueSize)--;
-        h[1] = h[s];
+    if ((check ^ data) != key || (unsigned int)(data >> 32) != transpositionGeneration) return UNDEFINED;
+    return (int)(data & 0xffffffff);
+}
 
-        // Reheap the heap.
-        int i = 1;
-        while (1) {
+// Record that the node at the given index holds the position with the given key, replacing any older entry.
+// The entry is stored with release ordering so a thread linking to the node sees everything written to it before.
+inline void storeTranspositionTable(unsigned long long key, int nodeIndex) {
+    TE* e = transpositionTable + (key & transpositionTableMask);
+    unsigned long long data = ((unsigned long long)transpositionGeneration << 32) | (unsigned int)nodeIndex;
+    (e->data).store(data, memory_order_release);
+    (e->check).store(key ^ data, memory_order_release);
+}
 
-            int l = i * 2, r = i * 2 + 1;
+// Add node l, which was just linked to node x, to the front of x's list of linked nodes (see nodeLinks).
+// Threads add to a list at once without locks. The caller reads x's eval only after adding l, so either that read sees a
+// change of x's eval or the thread changing it sees l in the list and backtracks the change from l.
+inline void addNodeLink(int l, int x) {
+    NL* link = nodeLinks + x;
+    int first = (link->first).load();
+    do {
+        nodeLinks[l].next = first;
+    } while (!(link->first).compare_exchange_weak(first, l));
+}
 
-            if (l >= s) {
-                break;
-            }
-            else if (r >= s) {
-                if ((nodes + h[i])->score > (nodes + h[l])->score) {
-                    int temp = h[i];
-                    h[i] = h[l];
-                    h[l] = temp;
-                }
-                break;
-            }
-            else if ((nodes + h[i])->score > (nodes + h[l])->score || (nodes + h[i])->score > (nodes + h[r])->score) {
-                // Find the minimum score of left and right children and swap with that one.
-                if ((nodes + h[l])->score < (nodes + h[r])->score) {
-                    int temp = h[i];
-                    h[i] = h[l];
-                    h[l] = temp;
-                    i = l;
-                }
-                else {
-                    int temp = h[i];
-                    h[i] = h[r];
-                    h[r] = temp;
-                    i = r;
-                }
-            }
-            else {
-                break;
-            }
-        }
+// Return the eval of a node, reading it from the node holding the same position if it is a transposition.
+inline double nodeEval(N* n) {
+    if (n->transpositionIndex != UNDEFINED) n = nodes + n->transpositionIndex;
+    return (n->e).load();
+}
 
-        return o;
+// If e is the eval of a checkmate, return the eval of a mate in one, etc.
+inline double evalForcedMateDelay(double e) {
+    if (e >= WHITE_WINS_EVAL_THRESHOLD) {
+        return e - EVAL_FORCED_MATE_INCREMENT;
+    }
+    if (e <= BLACK_WINS_EVAL_THRESHOLD) {
+        return e + EVAL_FORCED_MATE_INCREMENT;
+    }
+    return e;
+}
 
-    #endif
+// Return whether eval a is better than eval b for the player choosing between them.
+inline bool evalBetter(EV a, EV b, bool isBlack) {
+    return isBlack ? a < b : a > b;
 }
 
-// Examine the highest-priority node.
-// Create a new node for each move.
-// Update the original node's eval based on their evals.
-// Return whether there is no space for more nodes (we can't keep going).
-bool examineNextPosition(T* t) {
+// Return the eval that child c gives its parent, which is one move further from any forced mate.
+inline EV childEvalForParent(N* c) {
+    return (EV)evalForcedMateDelay(nodeEval(c));
+}
 
-    int index = getFirstFuture(t);
-    N* n = nodes + index;
+// Return the best of the evals that the children of expanded node n give it.
+inline EV bestChildEval(N* n) {
+    bool isBlack = n->PLAYER_TURN == BLACK;
+    int nc = n->numChildren;
+    N* c = nodes + n->childStartIndex;
+    EV e = childEvalForParent(c);
+    for (int i = 1; i < nc; i++) {
+        EV x = childEvalForParent(c + i);
+        if (evalBetter(x, e, isBlack)) e = x;
+    }
+    return e;
+}
 
-    // Make the possible moves into nodes.
-    int nc = n->numMoves;
-    int l = numNodes.fetch_add(nc);
-    if (l >= nodeCap.load()) return 1;
-    calcNumNodesAdded.fetch_add(nc);
+// Set the eval of expanded node n to the best of its children's, in O(children).
+// Another thread may change a child between reading it and storing the eval, so the eval is only stored with a
+// compare-and-swap and then checked again, until the children read agree with the stored eval.
+// Set oldEval and newEval to the eval before and after. Return whether it changed.
+inline bool evalRecompute(N* n, EV* oldEval, EV* newEval) {
+    EV first = (n->e).load();
+    while (1) {
+        EV old = (n->e).load();
+        EV e = bestChildEval(n);
+        if (e == old) {
+            *oldEval = first;
+            *newEval = e;
+            return e != first;
+        }
+        (n->e).compare_exchange_strong(old, e);
+    }
+}
 
-    n->numChildren = nc;
-    n->childStartIndex = l;
+// Update the eval of expanded node n after the eval that one of its children gives it changed from oldChild to newChild.
+// This is O(1) unless the child may have been the best one and got worse, which needs the children to be read again.
+// Set oldEval and newEval to the eval before and after. Return whether it changed.
+inline bool evalUpdateFromChild(N* n, N* c, EV oldChild, EV newChild, EV* oldEval, EV* newEval) {
+    bool isBlack = n->PLAYER_TURN == BLACK;
+    while (1) {
+        EV e = (n->e).load();
 
-    char* b = t->cb;
+        // A child better than the eval becomes the eval, unless the child changed again meanwhile.
+        if (evalBetter(newChild, e, isBlack)) {
+            if (!(n->e).compare_exchange_weak(e, newChild)) continue;
+            if (childEvalForParent(c) != newChild) evalRecompute(n, oldEval, newEval);
+            else *newEval = newChild;
+            *oldEval = e;
+            return *newEval != e;
+        }
 
-    for (int i = 0; i < nc; i++, l++) {
-        N* newN = nodes + l;
-        
-        // Set some info about the node based on the found move used to create it.
-        int moveIndex = n->moveStartIndex + i;
-        newN->parentIndex = index;
-        newN->SQUARE_FROM = globalMoveFrom[moveIndex];
-        newN->SQUARE_TO = globalMoveTo[moveIndex];
-        newN->score = n->score + 10.0;
-
-        char playerTurn = 1 - n->PLAYER_TURN;
-        
-        // Set the rest of the info based on the parent node.
-        newN->wKINGSIDE_CASTLE = n->wKINGSIDE_CASTLE;
-        newN->wQUEENSIDE_CASTLE = n->wQUEENSIDE_CASTLE;
-        newN->bKINGSIDE_CASTLE = n->bKINGSIDE_CASTLE;
-        newN->bQUEENSIDE_CASTLE = n->bQUEENSIDE_CASTLE;
-        newN->EN_PASSANT_FILE = -1;
-        newN->FIFTY_MOVE_COUNTER = n->FIFTY_MOVE_COUNTER + 1;
-        newN->wKING_SQUARE = n->wKING_SQUARE;
-        newN->bKING_SQUARE = n->bKING_SQUARE;
-        newN->GAME_STATE = NORMAL;
-        newN->PLAYER_TURN = playerTurn;
-
-        // Set defaults that may be accessed before being set depending on future modifications to this program.
-        newN->numChildren = 0;
-        newN->numMoves = 0;
-        newN->childStartIndex = UNDEFINED;
-        newN->moveStartIndex = 0;
-        newN->e = 0.0;
+        // A child that was not as good as the eval and still is not leaves it unchanged.
+        if (evalBetter(e, oldChild, isBlack)) return 0;
 
-        // Examine all moves from this node.
-        if(examineAllSemilegalMoves(t, l)) return 1;
+        return evalRecompute(n, oldEval, newEval);
     }
+}
 
-    evalBacktrack(n);
+int evalBacktrackLinks(N* x, EV oldEval, EV newEval, int hops);
 
-    return 0;
+// Backtrack up the tree from node n, whose eval changed from oldEval to newEval, keeping the eval of every ancestor up-to-date.
+// The change of n and of every ancestor it changes is backtracked from the nodes linked to them as well (see nodeLinks),
+// hops being the number of links followed to reach n. Return the number of nodes whose evals changed.
+int evalBacktrackChangeFrom(N* n, EV oldEval, EV newEval, int hops) {
+    if (oldEval == newEval) return 0;
+
+    int length = 0;
+    while (1) {
+        if ((nodeLinks[n - nodes].first).load() != UNDEFINED) length += evalBacktrackLinks(n, oldEval, newEval, hops);
+        if (n == nodes) return length;
+        N* p = nodes + n->parentIndex;
+        EV oldChild = (EV)evalForcedMateDelay(oldEval);
+        EV newChild = (EV)evalForcedMateDelay(newEval);
+        if (!evalUpdateFromChild(p, n, oldChild, newChild, &oldEval, &newEval)) return length;
+        length++;
+        n = p;
+    }
 }
 
-// Reset the futures queue to the initial empty state from any length and capacity.
-void clearQueueHeavy() {
-    for (int i = 0; i < numThreads; i++) {
-        T* t = threads + i;
+// Backtrack the change of node x's eval from oldEval to newEval from every node linked to it, which reads its eval from x.
+// Linked positions can form a cycle (a node linked to may have a descendant linked to an ancestor of the node linked to it),
+// so at most MAX_DEPTH links are followed in a row. Return the number of nodes whose evals changed.
+int evalBacktrackLinks(N* x, EV oldEval, EV newEval, int hops) {
+    if (hops >= MAX_DEPTH) return 0;
 
-        #if USE_SCORE_BUCKETS
+    int length = 0;
+    for (int l = (nodeLinks[x - nodes].first).load(); l != UNDEFINED; l = nodeLinks[l].next) {
+        length += evalBacktrackChangeFrom(nodes + l, oldEval, newEval, hops + 1);
+    }
+    return length;
+}
 
-            t->futuresQueueSize = 0;
-            int* bc = t->bucketCap;
-            int* bl = t->bucketLength;
-            int** b = t->buckets;
+// Backtrack up the tree and through the links from node n, whose eval changed from oldEval to newEval (see
+// evalBacktrackChangeFrom()). Return the number of nodes whose evals changed.
+inline int evalBacktrackChange(N* n, EV oldEval, EV newEval) {
+    return evalBacktrackChangeFrom(n, oldEval, newEval, 0);
+}
+
+// Backtrack up the tree from node n, which was just expanded, keeping the eval of every node in the tree up-to-date.
+// Several threads backtrack at once without locks (see evalRecompute()), and when all of them are done every expanded node's eval
+// is the best of its children's. Return the number of nodes whose evals changed.
+inline int evalBacktrack(N* n) {
+    EV oldEval, newEval;
+    if (!evalRecompute(n, &oldEval, &newEval)) return 0;
+    return evalBacktrackChange(n, oldEval, newEval);
+}
+
+#if ENGINE_DEBUG_VERIFY
+// Check that every expanded node in the tree has the best of its children's evals while no thread is running.
+void verifyTreeEvals() {
+    int numN = numNodes.load();
+    if (numN > nodeCap.load()) numN = nodeCap.load();
+    if (numN == 0) return;
+
+    // Reserved slots that were never used hold old nodes, so only go through the nodes reached from the root.
+    // Parents always come before their children, so one pass in index order reaches every node.
+    for (int i = 0; i < numN; i++) {
+        reclaimIndex[i] = UNDEFINED;
+    }
+    reclaimIndex[0] = 0;
+    for (int i = 0; i < numN; i++) {
+        N* n = nodes + i;
+        if (reclaimIndex[i] == UNDEFINED || n->numChildren <= 0) continue;
+
+        for (int j = 0; j < n->numChildren; j++) {
+            reclaimIndex[n->childStartIndex + j] = 0;
+        }
+        if ((n->e).load() != bestChildEval(n)) {
+            printf("Node %i: eval %f should be %f.\n", i, (double)(n->e).load(), (double)bestChildEval(n));
+        }
+    }
+}
+#endif
+
+// Set the squares and promotion of a move from the node it creates.
+inline void loadNodeMove(M* move, N* p) {
+    MV m = p->move;
+    move->f = moveFromSquare(m);
+    move->t = moveToSquare(m);
+    move->promotion = movePromotion(m) ? movePromotion(m) : -1;
+}
+
+// Move this thread's calculating board from the node it currently represents to the given node.
+// Only the moves below the common ancestor of the two nodes are undone and replayed.
+void moveBoardToNode(T* t, int nodeIndex) {
+    char* b = t->cb;
+    int* path = t->pathNodes;
+    int* replay = t->pathReplay;
+    int numReplay = 0;
+
+    // Climb from the target node until it is no deeper than the board.
+    int x = nodeIndex;
+    int dx = (nodes + x)->depth;
+    while (dx > t->pathDepth) {
+        replay[numReplay++] = x;
+        x = (nodes + x)->parentIndex;
+        dx--;
+    }
+
+    // Undo moves until the board is as deep as the target node's ancestor.
+    while (t->pathDepth > dx) {
+        (t->pathDepth)--;
+        undoMove(t, t->moves + t->pathDepth);
+    }
+
+    // Climb both paths together until they meet at the common ancestor.
+    while (path[dx] != x) {
+        replay[numReplay++] = x;
+        x = (nodes + x)->parentIndex;
+        dx--;
+        (t->pathDepth)--;
+        undoMove(t, t->moves + t->pathDepth);
+    }
+
+    // Play the moves from the common ancestor down to the target node.
+    while (numReplay > 0) {
+        N* y = nodes + replay[--numReplay];
+        M* move = t->moves + t->pathDepth;
+        loadNodeMove(move, y);
+        move->mover = b[move->f];
+        move->captured = b[move->t];
+        move->enPassantSquare = playMove(b, y, move);
+        syncBitboards(t, move);
+        (t->pathDepth)++;
+        path[t->pathDepth] = replay[numReplay];
+    }
+}
+
+// Opening book and endgame probes
+
+// A file mapped into memory, or read into it where mapping is not available.
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    bool mapped;
+#if defined(_WIN32)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} MF;
+
+// Unmap or free a file opened with mapFile(), leaving it empty.
+void unmapFile(MF* f) {
+    if (f->data != NULL) {
+        if (f->mapped) {
+        #if defined(_WIN32)
+            UnmapViewOfFile(f->data);
+            CloseHandle(f->mapping);
+            CloseHandle(f->file);
+        #elif defined(__linux__)
+            munmap(f->data, f->size);
+        #endif
+        }
+        else {
+            free(f->data);
+        }
+    }
+    f->data = NULL;
+    f->size = 0;
+    f->mapped = 0;
+}
+
+// Map the file at path read-only into f, replacing what f held. Return 0 if it cannot be opened or is empty.
+bool mapFile(MF* f, const char* path) {
+    unmapFile(f);
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    void* data = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL) data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        if (mapping != NULL) CloseHandle(mapping);
+        CloseHandle(file);
+        return 0;
+    }
+    f->data = (unsigned char*)data;
+    f->size = (size_t)size.QuadPart;
+    f->mapped = 1;
+    f->file = file;
+    f->mapping = mapping;
+    return 1;
+#elif defined(__linux__)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    f->data = (unsigned char*)data;
+    f->size = (size_t)st.st_size;
+    f->mapped = 1;
+    return 1;
+#else
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return 0;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size <= 0) {
+        fclose(file);
+        return 0;
+    }
+    f->data = (unsigned char*)malloc(size);
+    if (f->data == NULL) crash();
+    f->size = fread(f->data, 1, size, file);
+    fclose(file);
+    return 1;
+#endif
+}
+
+#define BOOK_ENTRY_SIZE 16
+
+MF bookFile; // The opening book used at the root (see probeBook()), empty if none.
+
+// Book entries added by addBookEntry() and not written yet.
+typedef struct {
+    unsigned long long key;
+    unsigned short move;
+    unsigned short weight;
+} BE;
+
+BE* newBookEntries = NULL;
+int numNewBookEntries = 0;
+int newBookEntriesCap = 0;
+
+// Return the big-endian unsigned number of the given number of bytes at p.
+inline unsigned long long readBigEndian(const unsigned char* p, int bytes) {
+    unsigned long long x = 0;
+    for (int i = 0; i < bytes; i++) {
+        x = (x << 8) | p[i];
+    }
+    return x;
+}
+
+// Write x as a big-endian unsigned number of the given number of bytes to p.
+inline void writeBigEndian(unsigned char* p, int bytes, unsigned long long x) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        p[i] = (unsigned char)x;
+        x >>= 8;
+    }
+}
+
+// Return the book move of move on board b, where castling is written as the king taking its own rook.
+unsigned short bookMoveFromMove(char* b, MV move) {
+    char f = moveFromSquare(move);
+    char x = moveToSquare(move);
+    char promotion = movePromotion(move);
+    if ((b[f] == wKING || b[f] == bKING) && (x - f == 2 || f - x == 2)) x = x > f ? f + 3 : f - 4;
+    return (unsigned short)(x | (f << 6) | ((promotion ? promotion % 6 : 0) << 12));
+}
+
+// Return the move of book move m on board b (see bookMoveFromMove()).
+MV moveFromBookMove(char* b, unsigned short m) {
+    char x = m & 63;
+    char f = (m >> 6) & 63;
+    char promotion = (m >> 12) & 7;
+    char mover = b[f];
+    if ((mover == wKING && f == 4 && (x == 7 || x == 0)) || (mover == bKING && f == 60 && (x == 63 || x == 56))) {
+        x = x > f ? f + 2 : f - 2;
+    }
+    if (promotion == 0) return makeMove(f, x);
+    return makePromotion(f, x, (mover == bPAWN ? bPAWN : wPAWN) + promotion);
+}
+
+// The Random64 numbers of the Polyglot book format: 64 squares for each of the 12 piece kinds (black pawn, white pawn,
+// black knight, and so on to white king), then the 4 castling rights, the 8 en passant files, and White to move.
+#define POLYGLOT_CASTLING 768
+#define POLYGLOT_EN_PASSANT 772
+#define POLYGLOT_TURN 780
+#define POLYGLOT_START_KEY 0x463b96181691fc9c // the key of the start position
+const unsigned long long polyglotRandom[781] = {
+    0x9d39247e33776d41, 0x2af7398005aaa5c7, 0x44db015024623547, 0x9c15f73e62a76ae2,
+    0x75834465489c0c89, 0x3290ac3a203001bf, 0x0fbbad1f61042279, 0xe83a908ff2fb60ca,
+    0x0d7e765d58755c10, 0x1a083822ceafe02d, 0x9605d5f0e25ec3b0, 0xd021ff5cd13a2ed5,
+    0x40bdf15d4a672e32, 0x011355146fd56395, 0x5db4832046f3d9e5, 0x239f8b2d7ff719cc,
+    0x05d1a1ae85b49aa1, 0x679f848f6e8fc971, 0x7449bbff801fed0b, 0x7d11cdb1c3b7adf0,
+    0x82c7709e781eb7cc, 0xf3218f1c9510786c, 0x331478f3af51bbe6, 0x4bb38de5e7219443,
+    0xaa649c6ebcfd50fc, 0x8dbd98a352afd40b, 0x87d2074b81d79217, 0x19f3c751d3e92ae1,
+    0xb4ab30f062b19abf, 0x7b0500ac42047ac4, 0xc9452ca81a09d85d, 0x24aa6c514da27500,
+    0x4c9f34427501b447, 0x14a68fd73c910841, 0xa71b9b83461cbd93, 0x03488b95b0f1850f,
+    0x637b2b34ff93c040, 0x09d1bc9a3dd90a94, 0x3575668334a1dd3b, 0x735e2b97a4c45a23,
+    0x18727070f1bd400b, 0x1fcbacd259bf02e7, 0xd310a7c2ce9b6555, 0xbf983fe0fe5d8244,
+    0x9f74d14f7454a824, 0x51ebdc4ab9ba3035, 0x5c82c505db9ab0fa, 0xfcf7fe8a3430b241,
+    0x3253a729b9ba3dde, 0x8c74c368081b3075, 0xb9bc6c87167c33e7, 0x7ef48f2b83024e20,
+    0x11d505d4c351bd7f, 0x6568fca92c76a243, 0x4de0b0f40f32a7b8, 0x96d693460cc37e5d,
+    0x42e240cb63689f2f, 0x6d2bdcdae2919661, 0x42880b0236e4d951, 0x5f0f4a5898171bb6,
+    0x39f890f579f92f88, 0x93c5b5f47356388b, 0x63dc359d8d231b78, 0xec16ca8aea98ad76,
+    0x5355f900c2a82dc7, 0x07fb9f855a997142, 0x5093417aa8a7ed5e, 0x7bcbc38da25a7f3c,
+    0x19fc8a768cf4b6d4, 0x637a7780decfc0d9, 0x8249a47aee0e41f7, 0x79ad695501e7d1e8,
+    0x14acbaf4777d5776, 0xf145b6beccdea195, 0xdabf2ac8201752fc, 0x24c3c94df9c8d3f6,
+    0xbb6e2924f03912ea, 0x0ce26c0b95c980d9, 0xa49cd132bfbf7cc4, 0xe99d662af4243939,
+    0x27e6ad7891165c3f, 0x8535f040b9744ff1, 0x54b3f4fa5f40d873, 0x72b12c32127fed2b,
+    0xee954d3c7b411f47, 0x9a85ac909a24eaa1, 0x70ac4cd9f04f21f5, 0xf9b89d3e99a075c2,
+    0x87b3e2b2b5c907b1, 0xa366e5b8c54f48b8, 0xae4a9346cc3f7cf2, 0x1920c04d47267bbd,
+    0x87bf02c6b49e2ae9, 0x092237ac237f3859, 0xff07f64ef8ed14d0, 0x8de8dca9f03cc54e,
+    0x9c1633264db49c89, 0xb3f22c3d0b0b38ed, 0x390e5fb44d01144b, 0x5bfea5b4712768e9,
+    0x1e1032911fa78984, 0x9a74acb964e78cb3, 0x4f80f7a035dafb04, 0x6304d09a0b3738c4,
+    0x2171e64683023a08, 0x5b9b63eb9ceff80c, 0x506aacf489889342, 0x1881afc9a3a701d6,
+    0x6503080440750644, 0xdfd395339cdbf4a7, 0xef927dbcf00c20f2, 0x7b32f7d1e03680ec,
+    0xb9fd7620e7316243, 0x05a7e8a57db91b77, 0xb5889c6e15630a75, 0x4a750a09ce9573f7,
+    0xcf464cec899a2f8a, 0xf538639ce705b824, 0x3c79a0ff5580ef7f, 0xede6c87f8477609d,
+    0x799e81f05bc93f31, 0x86536b8cf3428a8c, 0x97d7374c60087b73, 0xa246637cff328532,
+    0x043fcae60cc0eba0, 0x920e449535dd359e, 0x70eb093b15b290cc, 0x73a1921916591cbd,
+    0x56436c9fe1a1aa8d, 0xefac4b70633b8f81, 0xbb215798d45df7af, 0x45f20042f24f1768,
+    0x930f80f4e8eb7462, 0xff6712ffcfd75ea1, 0xae623fd67468aa70, 0xdd2c5bc84bc8d8fc,
+    0x7eed120d54cf2dd9, 0x22fe545401165f1c, 0xc91800e98fb99929, 0x808bd68e6ac10365,
+    0xdec468145b7605f6, 0x1bede3a3aef53302, 0x43539603d6c55602, 0xaa969b5c691ccb7a,
+    0xa87832d392efee56, 0x65942c7b3c7e11ae, 0xded2d633cad004f6, 0x21f08570f420e565,
+    0xb415938d7da94e3c, 0x91b859e59ecb6350, 0x10cff333e0ed804a, 0x28aed140be0bb7dd,
+    0xc5cc1d89724fa456, 0x5648f680f11a2741, 0x2d255069f0b7dab3, 0x9bc5a38ef729abd4,
+    0xef2f054308f6a2bc, 0xaf2042f5cc5c2858, 0x480412bab7f5be2a, 0xaef3af4a563dfe43,
+    0x19afe59ae451497f, 0x52593803dff1e840, 0xf4f076e65f2ce6f0, 0x11379625747d5af3,
+    0xbce5d2248682c115, 0x9da4243de836994f, 0x066f70b33fe09017, 0x4dc4de189b671a1c,
+    0x51039ab7712457c3, 0xc07a3f80c31fb4b4, 0xb46ee9c5e64a6e7c, 0xb3819a42abe61c87,
+    0x21a007933a522a20, 0x2df16f761598aa4f, 0x763c4a1371b368fd, 0xf793c46702e086a0,
+    0xd7288e012aeb8d31, 0xde336a2a4bc1c44b, 0x0bf692b38d079f23, 0x2c604a7a177326b3,
+    0x4850e73e03eb6064, 0xcfc447f1e53c8e1b, 0xb05ca3f564268d99, 0x9ae182c8bc9474e8,
+    0xa4fc4bd4fc5558ca, 0xe755178d58fc4e76, 0x69b97db1a4c03dfe, 0xf9b5b7c4acc67c96,
+    0xfc6a82d64b8655fb, 0x9c684cb6c4d24417, 0x8ec97d2917456ed0, 0x6703df9d2924e97e,
+    0xc547f57e42a7444e, 0x78e37644e7cad29e, 0xfe9a44e9362f05fa, 0x08bd35cc38336615,
+    0x9315e5eb3a129ace, 0x94061b871e04df75, 0xdf1d9f9d784ba010, 0x3bba57b68871b59d,
+    0xd2b7adeeded1f73f, 0xf7a255d83bc373f8, 0xd7f4f2448c0ceb81, 0xd95be88cd210ffa7,
+    0x336f52f8ff4728e7, 0xa74049dac312ac71, 0xa2f61bb6e437fdb5, 0x4f2a5cb07f6a35b3,
+    0x87d380bda5bf7859, 0x16b9f7e06c453a21, 0x7ba2484c8a0fd54e, 0xf3a678cad9a2e38c,
+    0x39b0bf7dde437ba2, 0xfcaf55c1bf8a4424, 0x18fcf680573fa594, 0x4c0563b89f495ac3,
+    0x40e087931a00930d, 0x8cffa9412eb642c1, 0x68ca39053261169f, 0x7a1ee967d27579e2,
+    0x9d1d60e5076f5b6f, 0x3810e399b6f65ba2, 0x32095b6d4ab5f9b1, 0x35cab62109dd038a,
+    0xa90b24499fcfafb1, 0x77a225a07cc2c6bd, 0x513e5e634c70e331, 0x4361c0ca3f692f12,
+    0xd941aca44b20a45b, 0x528f7c8602c5807b, 0x52ab92beb9613989, 0x9d1dfa2efc557f73,
+    0x722ff175f572c348, 0x1d1260a51107fe97, 0x7a249a57ec0c9ba2, 0x04208fe9e8f7f2d6,
+    0x5a110c6058b920a0, 0x0cd9a497658a5698, 0x56fd23c8f9715a4c, 0x284c847b9d887aae,
+    0x04feabfbbdb619cb, 0x742e1e651c60ba83, 0x9a9632e65904ad3c, 0x881b82a13b51b9e2,
+    0x506e6744cd974924, 0xb0183db56ffc6a79, 0x0ed9b915c66ed37e, 0x5e11e86d5873d484,
+    0xf678647e3519ac6e, 0x1b85d488d0f20cc5, 0xdab9fe6525d89021, 0x0d151d86adb73615,
+    0xa865a54edcc0f019, 0x93c42566aef98ffb, 0x99e7afeabe000731, 0x48cbff086ddf285a,
+    0x7f9b6af1ebf78baf, 0x58627e1a149bba21, 0x2cd16e2abd791e33, 0xd363eff5f0977996,
+    0x0ce2a38c344a6eed, 0x1a804aadb9cfa741, 0x907f30421d78c5de, 0x501f65edb3034d07,
+    0x37624ae5a48fa6e9, 0x957baf61700cff4e, 0x3a6c27934e31188a, 0xd49503536abca345,
+    0x088e049589c432e0, 0xf943aee7febf21b8, 0x6c3b8e3e336139d3, 0x364f6ffa464ee52e,
+    0xd60f6dcedc314222, 0x56963b0dca418fc0, 0x16f50edf91e513af, 0xef1955914b609f93,
+    0x565601c0364e3228, 0xecb53939887e8175, 0xbac7a9a18531294b, 0xb344c470397bba52,
+    0x65d34954daf3cebd, 0xb4b81b3fa97511e2, 0xb422061193d6f6a7, 0x071582401c38434d,
+    0x7a13f18bbedc4ff5, 0xbc4097b116c524d2, 0x59b97885e2f2ea28, 0x99170a5dc3115544,
+    0x6f423357e7c6a9f9, 0x325928ee6e6f8794, 0xd0e4366228b03343, 0x565c31f7de89ea27,
+    0x30f5611484119414, 0xd873db391292ed4f, 0x7bd94e1d8e17debc, 0xc7d9f16864a76e94,
+    0x947ae053ee56e63c, 0xc8c93882f9475f5f, 0x3a9bf55ba91f81ca, 0xd9a11fbb3d9808e4,
+    0x0fd22063edc29fca, 0xb3f256d8aca0b0b9, 0xb03031a8b4516e84, 0x35dd37d5871448af,
+    0xe9f6082b05542e4e, 0xebfafa33d7254b59, 0x9255abb50d532280, 0xb9ab4ce57f2d34f3,
+    0x693501d628297551, 0xc62c58f97dd949bf, 0xcd454f8f19c5126a, 0xbbe83f4ecc2bdecb,
+    0xdc842b7e2819e230, 0xba89142e007503b8, 0xa3bc941d0a5061cb, 0xe9f6760e32cd8021,
+    0x09c7e552bc76492f, 0x852f54934da55cc9, 0x8107fccf064fcf56, 0x098954d51fff6580,
+    0x23b70edb1955c4bf, 0xc330de426430f69d, 0x4715ed43e8a45c0a, 0xa8d7e4dab780a08d,
+    0x0572b974f03ce0bb, 0xb57d2e985e1419c7, 0xe8d9ecbe2cf3d73f, 0x2fe4b17170e59750,
+    0x11317ba87905e790, 0x7fbf21ec8a1f45ec, 0x1725cabfcb045b00, 0x964e915cd5e2b207,
+    0x3e2b8bcbf016d66d, 0xbe7444e39328a0ac, 0xf85b2b4fbcde44b7, 0x49353fea39ba63b1,
+    0x1dd01aafcd53486a, 0x1fca8a92fd719f85, 0xfc7c95d827357afa, 0x18a6a990c8b35ebd,
+    0xcccb7005c6b9c28d, 0x3bdbb92c43b17f26, 0xaa70b5b4f89695a2, 0xe94c39a54a98307f,
+    0xb7a0b174cff6f36e, 0xd4dba84729af48ad, 0x2e18bc1ad9704a68, 0x2de0966daf2f8b1c,
+    0xb9c11d5b1e43a07e, 0x64972d68dee33360, 0x94628d38d0c20584, 0xdbc0d2b6ab90a559,
+    0xd2733c4335c6a72f, 0x7e75d99d94a70f4d, 0x6ced1983376fa72b, 0x97fcaacbf030bc24,
+    0x7b77497b32503b12, 0x8547eddfb81ccb94, 0x79999cdff70902cb, 0xcffe1939438e9b24,
+    0x829626e3892d95d7, 0x92fae24291f2b3f1, 0x63e22c147b9c3403, 0xc678b6d860284a1c,
+    0x5873888850659ae7, 0x0981dcd296a8736d, 0x9f65789a6509a440, 0x9ff38fed72e9052f,
+    0xe479ee5b9930578c, 0xe7f28ecd2d49eecd, 0x56c074a581ea17fe, 0x5544f7d774b14aef,
+    0x7b3f0195fc6f290f, 0x12153635b2c0cf57, 0x7f5126dbba5e0ca7, 0x7a76956c3eafb413,
+    0x3d5774a11d31ab39, 0x8a1b083821f40cb4, 0x7b4a38e32537df62, 0x950113646d1d6e03,
+    0x4da8979a0041e8a9, 0x3bc36e078f7515d7, 0x5d0a12f27ad310d1, 0x7f9d1a2e1ebe1327,
+    0xda3a361b1c5157b1, 0xdcdd7d20903d0c25, 0x36833336d068f707, 0xce68341f79893389,
+    0xab9090168dd05f34, 0x43954b3252dc25e5, 0xb438c2b67f98e5e9, 0x10dcd78e3851a492,
+    0xdbc27ab5447822bf, 0x9b3cdb65f82ca382, 0xb67b7896167b4c84, 0xbfced1b0048eac50,
+    0xa9119b60369ffebd, 0x1fff7ac80904bf45, 0xac12fb171817eee7, 0xaf08da9177dda93d,
+    0x1b0cab936e65c744, 0xb559eb1d04e5e932, 0xc37b45b3f8d6f2ba, 0xc3a9dc228caac9e9,
+    0xf3b8b6675a6507ff, 0x9fc477de4ed681da, 0x67378d8eccef96cb, 0x6dd856d94d259236,
+    0xa319ce15b0b4db31, 0x073973751f12dd5e, 0x8a8e849eb32781a5, 0xe1925c71285279f5,
+    0x74c04bf1790c0efe, 0x4dda48153c94938a, 0x9d266d6a1cc0542c, 0x7440fb816508c4fe,
+    0x13328503df48229f, 0xd6bf7baee43cac40, 0x4838d65f6ef6748f, 0x1e152328f3318dea,
+    0x8f8419a348f296bf, 0x72c8834a5957b511, 0xd7a023a73260b45c, 0x94ebc8abcfb56dae,
+    0x9fc10d0f989993e0, 0xde68a2355b93cae6, 0xa44cfe79ae538bbe, 0x9d1d84fcce371425,
+    0x51d2b1ab2ddfb636, 0x2fd7e4b9e72cd38c, 0x65ca5b96b7552210, 0xdd69a0d8ab3b546d,
+    0x604d51b25fbf70e2, 0x73aa8a564fb7ac9e, 0x1a8c1e992b941148, 0xaac40a2703d9bea0,
+    0x764dbeae7fa4f3a6, 0x1e99b96e70a9be8b, 0x2c5e9deb57ef4743, 0x3a938fee32d29981,
+    0x26e6db8ffdf5adfe, 0x469356c504ec9f9d, 0xc8763c5b08d1908c, 0x3f6c6af859d80055,
+    0x7f7cc39420a3a545, 0x9bfb227ebdf4c5ce, 0x89039d79d6fc5c5c, 0x8fe88b57305e2ab6,
+    0xa09e8c8c35ab96de, 0xfa7e393983325753, 0xd6b6d0ecc617c699, 0xdfea21ea9e7557e3,
+    0xb67c1fa481680af8, 0xca1e3785a9e724e5, 0x1cfc8bed0d681639, 0xd18d8549d140caea,
+    0x4ed0fe7e9dc91335, 0xe4dbf0634473f5d2, 0x1761f93a44d5aefe, 0x53898e4c3910da55,
+    0x734de8181f6ec39a, 0x2680b122baa28d97, 0x298af231c85bafab, 0x7983eed3740847d5,
+    0x66c1a2a1a60cd889, 0x9e17e49642a3e4c1, 0xedb454e7badc0805, 0x50b704cab602c329,
+    0x4cc317fb9cddd023, 0x66b4835d9eafea22, 0x219b97e26ffc81bd, 0x261e4e4c0a333a9d,
+    0x1fe2cca76517db90, 0xd7504dfa8816edbb, 0xb9571fa04dc089c8, 0x1ddc0325259b27de,
+    0xcf3f4688801eb9aa, 0xf4f5d05c10cab243, 0x38b6525c21a42b0e, 0x36f60e2ba4fa6800,
+    0xeb3593803173e0ce, 0x9c4cd6257c5a3603, 0xaf0c317d32adaa8a, 0x258e5a80c7204c4b,
+    0x8b889d624d44885d, 0xf4d14597e660f855, 0xd4347f66ec8941c3, 0xe699ed85b0dfb40d,
+    0x2472f6207c2d0484, 0xc2a1e7b5b459aeb5, 0xab4f6451cc1d45ec, 0x63767572ae3d6174,
+    0xa59e0bd101731a28, 0x116d0016cb948f09, 0x2cf9c8ca052f6e9f, 0x0b090a7560a968e3,
+    0xabeeddb2dde06ff1, 0x58efc10b06a2068d, 0xc6e57a78fbd986e0, 0x2eab8ca63ce802d7,
+    0x14a195640116f336, 0x7c0828dd624ec390, 0xd74bbe77e6116ac7, 0x804456af10f5fb53,
+    0xebe9ea2adf4321c7, 0x03219a39ee587a30, 0x49787fef17af9924, 0xa1e9300cd8520548,
+    0x5b45e522e4b1b4ef, 0xb49c3b3995091a36, 0xd4490ad526f14431, 0x12a8f216af9418c2,
+    0x001f837cc7350524, 0x1877b51e57a764d5, 0xa2853b80f17f58ee, 0x993e1de72d36d310,
+    0xb3598080ce64a656, 0x252f59cf0d9f04bb, 0xd23c8e176d113600, 0x1bda0492e7e4586e,
+    0x21e0bd5026c619bf, 0x3b097adaf088f94e, 0x8d14dedb30be846e, 0xf95cffa23af5f6f4,
+    0x3871700761b3f743, 0xca672b91e9e4fa16, 0x64c8e531bff53b55, 0x241260ed4ad1e87d,
+    0x106c09b972d2e822, 0x7fba195410e5ca30, 0x7884d9bc6cb569d8, 0x0647dfedcd894a29,
+    0x63573ff03e224774, 0x4fc8e9560f91b123, 0x1db956e450275779, 0xb8d91274b9e9d4fb,
+    0xa2ebee47e2fbfce1, 0xd9f1f30ccd97fb09, 0xefed53d75fd64e6b, 0x2e6d02c36017f67f,
+    0xa9aa4d20db084e9b, 0xb64be8d8b25396c1, 0x70cb6af7c2d5bcf0, 0x98f076a4f7a2322e,
+    0xbf84470805e69b5f, 0x94c3251f06f90cf3, 0x3e003e616a6591e9, 0xb925a6cd0421aff3,
+    0x61bdd1307c66e300, 0xbf8d5108e27e0d48, 0x240ab57a8b888b20, 0xfc87614baf287e07,
+    0xef02cdd06ffdb432, 0xa1082c0466df6c0a, 0x8215e577001332c8, 0xd39bb9c3a48db6cf,
+    0x2738259634305c14, 0x61cf4f94c97df93d, 0x1b6baca2ae4e125b, 0x758f450c88572e0b,
+    0x959f587d507a8359, 0xb063e962e045f54d, 0x60e8ed72c0dff5d1, 0x7b64978555326f9f,
+    0xfd080d236da814ba, 0x8c90fd9b083f4558, 0x106f72fe81e2c590, 0x7976033a39f7d952,
+    0xa4ec0132764ca04b, 0x733ea705fae4fa77, 0xb4d8f77bc3e56167, 0x9e21f4f903b33fd9,
+    0x9d765e419fb69f6d, 0xd30c088ba61ea5ef, 0x5d94337fbfaf7f5b, 0x1a4e4822eb4d7a59,
+    0x6ffe73e81b637fb3, 0xddf957bc36d8b9ca, 0x64d0e29eea8838b3, 0x08dd9bdfd96b9f63,
+    0x087e79e5a57d1d13, 0xe328e230e3e2b3fb, 0x1c2559e30f0946be, 0x720bf5f26f4d2eaa,
+    0xb0774d261cc609db, 0x443f64ec5a371195, 0x4112cf68649a260e, 0xd813f2fab7f5c5ca,
+    0x660d3257380841ee, 0x59ac2c7873f910a3, 0xe846963877671a17, 0x93b633abfa3469f8,
+    0xc0c0f5a60ef4cdcf, 0xcaf21ecd4377b28c, 0x57277707199b8175, 0x506c11b9d90e8b1d,
+    0xd83cc2687a19255f, 0x4a29c6465a314cd1, 0xed2df21216235097, 0xb5635c95ff7296e2,
+    0x22af003ab672e811, 0x52e762596bf68235, 0x9aeba33ac6ecc6b0, 0x944f6de09134dfb6,
+    0x6c47bec883a7de39, 0x6ad047c430a12104, 0xa5b1cfdba0ab4067, 0x7c45d833aff07862,
+    0x5092ef950a16da0b, 0x9338e69c052b8e7b, 0x455a4b4cfe30e3f5, 0x6b02e63195ad0cf8,
+    0x6b17b224bad6bf27, 0xd1e0ccd25bb9c169, 0xde0c89a556b9ae70, 0x50065e535a213cf6,
+    0x9c1169fa2777b874, 0x78edefd694af1eed, 0x6dc93d9526a50e68, 0xee97f453f06791ed,
+    0x32ab0edb696703d3, 0x3a6853c7e70757a7, 0x31865ced6120f37d, 0x67fef95d92607890,
+    0x1f2b1d1f15f6dc9c, 0xb69e38a8965c6b65, 0xaa9119ff184cccf4, 0xf43c732873f24c13,
+    0xfb4a3d794a9a80d2, 0x3550c2321fd6109c, 0x371f77e76bb8417e, 0x6bfa9aae5ec05779,
+    0xcd04f3ff001a4778, 0xe3273522064480ca, 0x9f91508bffcfc14a, 0x049a7f41061a9e60,
+    0xfcb6be43a9f2fe9b, 0x08de8a1c7797da9b, 0x8f9887e6078735a1, 0xb5b4071dbfc73a66,
+    0x230e343dfba08d33, 0x43ed7f5a0fae657d, 0x3a88a0fbbcb05c63, 0x21874b8b4d2dbc4f,
+    0x1bdea12e35f6a8c9, 0x53c065c6c8e63528, 0xe34a1d250e7a8d6b, 0xd6b04d3b7651dd7e,
+    0x5e90277e7cb39e2d, 0x2c046f22062dc67d, 0xb10bb459132d0a26, 0x3fa9ddfb67e2f199,
+    0x0e09b88e1914f7af, 0x10e8b35af3eeab37, 0x9eedeca8e272b933, 0xd4c718bc4ae8ae5f,
+    0x81536d601170fc20, 0x91b534f885818a06, 0xec8177f83f900978, 0x190e714fada5156e,
+    0xb592bf39b0364963, 0x89c350c893ae7dc1, 0xac042e70f8b383f2, 0xb49b52e587a1ee60,
+    0xfb152fe3ff26da89, 0x3e666e6f69ae2c15, 0x3b544ebe544c19f9, 0xe805a1e290cf2456,
+    0x24b33c9d7ed25117, 0xe74733427b72f0c1, 0x0a804d18b7097475, 0x57e3306d881edb4f,
+    0x4ae7d6a36eb5dbcb, 0x2d8d5432157064c8, 0xd1e649de1e7f268b, 0x8a328a1cedfe552c,
+    0x07a3aec79624c7da, 0x84547ddc3e203c94, 0x990a98fd5071d263, 0x1a4ff12616eefc89,
+    0xf6f7fd1431714200, 0x30c05b1ba332f41c, 0x8d2636b81555a786, 0x46c9feb55d120902,
+    0xccec0a73b49c9921, 0x4e9d2827355fc492, 0x19ebb029435dcb0f, 0x4659d2b743848a2c,
+    0x963ef2c96b33be31, 0x74f85198b05a2e7d, 0x5a0f544dd2b1fb18, 0x03727073c2e134b1,
+    0xc7f6aa2de59aea61, 0x352787baa0d7c22f, 0x9853eab63b5e0b35, 0xabbdcdd7ed5c0860,
+    0xcf05daf5ac8d77b0, 0x49cad48cebf4a71e, 0x7a4c10ec2158c4a6, 0xd9e92aa246bf719e,
+    0x13ae978d09fe5557, 0x730499af921549ff, 0x4e4b705b92903ba4, 0xff577222c14f0a3a,
+    0x55b6344cf97aafae, 0xb862225b055b6960, 0xcac09afbddd2cdb4, 0xdaf8e9829fe96b5f,
+    0xb5fdfc5d3132c498, 0x310cb380db6f7503, 0xe87fbb46217a360e, 0x2102ae466ebb1148,
+    0xf8549e1a3aa5e00d, 0x07a69afdcc42261a, 0xc4c118bfe78feaae, 0xf9f4892ed96bd438,
+    0x1af3dbe25d8f45da, 0xf5b4b0b0d2deeeb4, 0x962aceefa82e1c84, 0x046e3ecaaf453ce9,
+    0xf05d129681949a4c, 0x964781ce734b3c84, 0x9c2ed44081ce5fbd, 0x522e23f3925e319e,
+    0x177e00f9fc32f791, 0x2bc60a63a6f3b3f2, 0x222bbfae61725606, 0x486289ddcc3d6780,
+    0x7dc7785b8efdfc80, 0x8af38731c02ba980, 0x1fab64ea29a2ddf7, 0xe4d9429322cd065a,
+    0x9da058c67844f20c, 0x24c0e332b70019b0, 0x233003b5a6cfe6ad, 0xd586bd01c5c217f6,
+    0x5e5637885f29bc2b, 0x7eba726d8c94094b, 0x0a56a5f0bfe39272, 0xd79476a84ee20d06,
+    0x9e4c1269baa4bf37, 0x17efee45b0dee640, 0x1d95b0a5fcf90bc6, 0x93cbe0b699c2585d,
+    0x65fa4f227a2b6d79, 0xd5f9e858292504d5, 0xc2b5a03f71471a6f, 0x59300222b4561e00,
+    0xce2f8642ca0712dc, 0x7ca9723fbb2e8988, 0x2785338347f2ba08, 0xc61bb3a141e50e8c,
+    0x150f361dab9dec26, 0x9f6a419d382595f4, 0x64a53dc924fe7ac9, 0x142de49fff7a7c3d,
+    0x0c335248857fa9e7, 0x0a9c32d5eae45305, 0xe6c42178c4bbb92e, 0x71f1ce2490d20b07,
+    0xf1bcc3d275afe51a, 0xe728e8c83c334074, 0x96fbf83a12884624, 0x81a1549fd6573da5,
+    0x5fa7867caf35e149, 0x56986e2ef3ed091b, 0x917f1dd5f8886c61, 0xd20d8c88c8ffe65f,
+    0x31d71dce64b2c310, 0xf165b587df898190, 0xa57e6339dd2cf3a0, 0x1ef6e6dbb1961ec9,
+    0x70cc73d90bc26e24, 0xe21a6b35df0c3ad7, 0x003a93d8b2806962, 0x1c99ded33cb890a1,
+    0xcf3145de0add4289, 0xd0e4427a5514fb72, 0x77c621cc9fb3a483, 0x67a34dac4356550b,
+    0xf8d626aaaf278509
+};
+
+// Return the Polyglot key of the position of board b and data d, so books made by other programs can be used.
+// The en passant file only counts when a pawn can take en passant, so a position has one key whether or not a double step
+// that nothing can take led to it.
+unsigned long long bookKey(char* b, D* d) {
+    unsigned long long key = 0;
+    for (int i = 0; i < 64; i++) {
+        if (b[i] == EMPTY) continue;
+        int kind = b[i] < bPAWN ? 2 * (b[i] - wPAWN) + 1 : 2 * (b[i] - bPAWN);
+        key ^= polyglotRandom[64 * kind + i];
+    }
+
+    if (d->wKINGSIDE_CASTLE) key ^= polyglotRandom[POLYGLOT_CASTLING];
+    if (d->wQUEENSIDE_CASTLE) key ^= polyglotRandom[POLYGLOT_CASTLING + 1];
+    if (d->bKINGSIDE_CASTLE) key ^= polyglotRandom[POLYGLOT_CASTLING + 2];
+    if (d->bQUEENSIDE_CASTLE) key ^= polyglotRandom[POLYGLOT_CASTLING + 3];
+
+    char ep = d->EN_PASSANT_FILE;
+    if (ep > -1) {
+        char pawn = d->PLAYER_TURN == WHITE ? wPAWN : bPAWN;
+        int rank = d->PLAYER_TURN == WHITE ? 32 : 24;
+        if ((ep > 0 && b[rank + ep - 1] == pawn) || (ep < 7 && b[rank + ep + 1] == pawn)) key ^= polyglotRandom[POLYGLOT_EN_PASSANT + ep];
+    }
+
+    if (d->PLAYER_TURN == WHITE) key ^= polyglotRandom[POLYGLOT_TURN];
+    return key;
+}
+
+#if ENGINE_DEBUG_VERIFY
+// Check that bookKey() gives the start position the key other Polyglot programs give it.
+void verifyBookKey() {
+    D d = { 1, 1, 1, 1, -1, 0, 4, 60, UNDEFINED, UNDEFINED, WHITE, NORMAL };
+    unsigned long long key = bookKey(startingBoard, &d);
+    if (key != POLYGLOT_START_KEY) {
+        printf("Book key of the start position is %016llx instead of %016llx.\n", key, (unsigned long long)POLYGLOT_START_KEY);
+    }
+}
+#endif
+
+// Return a move from the opening book for the position of board b with the given book key, chosen at random in proportion to
+// the weights of its entries among those whose moves are in moves, or NO_MOVE if there are none.
+MV probeBook(char* b, unsigned long long key, MV* moves, int numMoves) {
+    if (bookFile.data == NULL) return NO_MOVE;
+    const unsigned char* entries = bookFile.data;
+    long long numEntries = (long long)(bookFile.size / BOOK_ENTRY_SIZE);
+
+    // Find the first entry with the key.
+    long long lo = 0, hi = numEntries;
+    while (lo < hi) {
+        long long mid = (lo + hi) / 2;
+        if (readBigEndian(entries + mid * BOOK_ENTRY_SIZE, 8) < key) lo = mid + 1;
+        else hi = mid;
+    }
+
+    MV found[LEGAL_MOVES_UPPER_BOUND];
+    int weights[LEGAL_MOVES_UPPER_BOUND];
+    int numFound = 0, totalWeight = 0;
+    for (long long i = lo; i < numEntries && numFound < LEGAL_MOVES_UPPER_BOUND; i++) {
+        const unsigned char* e = entries + i * BOOK_ENTRY_SIZE;
+        if (readBigEndian(e, 8) != key) break;
+        MV move = moveFromBookMove(b, (unsigned short)readBigEndian(e + 8, 2));
+        for (int j = 0; j < numMoves; j++) {
+            if (moves[j] != move) continue;
+            found[numFound] = move;
+            weights[numFound] = (int)readBigEndian(e + 10, 2);
+            totalWeight += weights[numFound];
+            numFound++;
+            break;
+        }
+    }
+
+    if (numFound == 0) return NO_MOVE;
+    if (totalWeight == 0) return found[0];
+    int r = (int)(nextRandom() % (unsigned long long)totalWeight);
+    for (int i = 0; i < numFound; i++) {
+        r -= weights[i];
+        if (r < 0) return found[i];
+    }
+    return found[numFound - 1];
+}
+
+// Add an entry for move with the given weight in the position of board b and data d to the book written by writeBook().
+void addBookEntry(char* b, D* d, MV move, int weight) {
+    if (numNewBookEntries == newBookEntriesCap) {
+        newBookEntriesCap = newBookEntriesCap > 0 ? newBookEntriesCap * 2 : 256;
+        newBookEntries = (BE*)realloc(newBookEntries, newBookEntriesCap * sizeof(BE));
+        if (newBookEntries == NULL) crash();
+    }
+    BE* e = newBookEntries + numNewBookEntries;
+    e->key = bookKey(b, d);
+    e->move = bookMoveFromMove(b, move);
+    e->weight = (unsigned short)(weight < 0 ? 0 : weight > 65535 ? 65535 : weight);
+    numNewBookEntries++;
+}
+
+// Order book entries by key, then by weight from highest to lowest.
+int compareBookEntries(const void* a, const void* b) {
+    const BE* x = (const BE*)a;
+    const BE* y = (const BE*)b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return (int)y->weight - (int)x->weight;
+}
+
+// Write the entries added since the last write to a book file at path, sorted so probeBook() can search it.
+// Return whether the file was written.
+bool writeBook(const char* path) {
+    qsort(newBookEntries, numNewBookEntries, sizeof(BE), compareBookEntries);
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return 0;
+    bool written = 1;
+    for (int i = 0; i < numNewBookEntries && written; i++) {
+        unsigned char e[BOOK_ENTRY_SIZE] = { 0 };
+        writeBigEndian(e, 8, newBookEntries[i].key);
+        writeBigEndian(e + 8, 2, newBookEntries[i].move);
+        writeBigEndian(e + 10, 2, newBookEntries[i].weight);
+        written = fwrite(e, 1, BOOK_ENTRY_SIZE, file) == BOOK_ENTRY_SIZE;
+    }
+    written = fclose(file) == 0 && written;
+
+    numNewBookEntries = 0;
+    return written;
+}
+
+#define DARK_SQUARES 0xaa55aa55aa55aa55ull // a1, c1, ..., b2, d2, ...
+
+bool tablebasesLoaded = 0; // Whether Syzygy tablebases were found by loadTablebases() (needs USE_SYZYGY).
+
+// Load the Syzygy tablebases in the directories of path (separated as the Fathom probing code expects).
+// Return the most pieces of any loaded table, or 0 if there are none or the engine is built without USE_SYZYGY.
+int loadTablebases(const char* path) {
+#if USE_SYZYGY
+    tablebasesLoaded = tb_init(path) && TB_LARGEST > 0;
+    return tablebasesLoaded ? (int)TB_LARGEST : 0;
+#else
+    return 0;
+#endif
+}
+
+#if USE_SYZYGY
+// Return the Syzygy WDL or root probe result for the position of the thread's bitboards and node n, or TB_RESULT_FAILED.
+// With root, also return the tablebases' best move in move.
+unsigned probeTablebase(T* t, N* n, bool root, MV* move) {
+    BB* p = t->bb;
+    BB white = p[wPAWN] | p[wKNIGHT] | p[wBISHOP] | p[wROOK] | p[wQUEEN] | p[wKING];
+    BB black = p[bPAWN] | p[bKNIGHT] | p[bBISHOP] | p[bROOK] | p[bQUEEN] | p[bKING];
+    if (!tablebasesLoaded || countSquares(white | black) > (int)TB_LARGEST) return TB_RESULT_FAILED;
+    if (n->wKINGSIDE_CASTLE || n->wQUEENSIDE_CASTLE || n->bKINGSIDE_CASTLE || n->bQUEENSIDE_CASTLE) return TB_RESULT_FAILED;
+
+    bool isBlack = n->PLAYER_TURN == BLACK;
+    unsigned ep = n->EN_PASSANT_FILE > -1 ? (isBlack ? 16 : 40) + n->EN_PASSANT_FILE : 0;
+    BB kings = p[wKING] | p[bKING], queens = p[wQUEEN] | p[bQUEEN], rooks = p[wROOK] | p[bROOK];
+    BB bishops = p[wBISHOP] | p[bBISHOP], knights = p[wKNIGHT] | p[bKNIGHT], pawns = p[wPAWN] | p[bPAWN];
+
+    // WDL tables only hold positions right after a capture or pawn move (the only ones where the material changes).
+    if (!root) {
+        if (n->FIFTY_MOVE_COUNTER != 0) return TB_RESULT_FAILED;
+        return tb_probe_wdl(white, black, kings, queens, rooks, bishops, knights, pawns, 0, 0, ep, !isBlack);
+    }
+
+    unsigned r = tb_probe_root(white, black, kings, queens, rooks, bishops, knights, pawns, n->FIFTY_MOVE_COUNTER, 0, ep, !isBlack, NULL);
+    if (r == TB_RESULT_FAILED || r == TB_RESULT_CHECKMATE || r == TB_RESULT_STALEMATE) return TB_RESULT_FAILED;
+
+    char pawn = isBlack ? bPAWN : wPAWN;
+    char f = TB_GET_FROM(r), x = TB_GET_TO(r);
+    switch (TB_GET_PROMOTES(r)) {
+    case TB_PROMOTES_QUEEN: *move = makePromotion(f, x, pawn + 4); break;
+    case TB_PROMOTES_ROOK: *move = makePromotion(f, x, pawn + 3); break;
+    case TB_PROMOTES_BISHOP: *move = makePromotion(f, x, pawn + 2); break;
+    case TB_PROMOTES_KNIGHT: *move = makePromotion(f, x, pawn + 1); break;
+    default: *move = makeMove(f, x); break;
+    }
+    return r;
+}
+#endif
+
+// Return the result (GAME_STATE) of the position of examined node n on the thread's bitboards if its endgame is known,
+// or NORMAL. Kings with at most one knight or bishop, or with one bishop each on squares of the same color, can never
+// be checkmated. With USE_SYZYGY, positions with few enough pieces are probed in the loaded tablebases, where a win that
+// the 50-move rule would stop is a draw.
+char probeEndgame(T* t, N* n) {
+    BB* p = t->bb;
+    if (!(p[wPAWN] | p[bPAWN] | p[wROOK] | p[bROOK] | p[wQUEEN] | p[bQUEEN])) {
+        BB minors = p[wKNIGHT] | p[bKNIGHT] | p[wBISHOP] | p[bBISHOP];
+        if (!(minors & (minors - 1))) return DRAW;
+        BB wb = p[wBISHOP], bb = p[bBISHOP];
+        if (minors == (wb | bb) && wb && bb && !(wb & (wb - 1)) && !(bb & (bb - 1)) && !(wb & DARK_SQUARES) == !(bb & DARK_SQUARES)) {
+            return DRAW;
+        }
+    }
+
+#if USE_SYZYGY
+    MV move;
+    unsigned r = probeTablebase(t, n, 0, &move);
+    if (r == TB_RESULT_FAILED) return NORMAL;
+    bool isBlack = n->PLAYER_TURN == BLACK;
+    if (r == TB_WIN) return isBlack ? BLACK_WIN : WHITE_WIN;
+    if (r == TB_LOSS) return isBlack ? WHITE_WIN : BLACK_WIN;
+    return DRAW;
+#else
+    return NORMAL;
+#endif
+}
+
+MV rootProbeMove = NO_MOVE; // The root move found by probeRoot(), which getSortedChoices() puts first.
+char rootProbeSource = 0; // Where rootProbeMove came from: 0 nowhere, 1 the opening book, 2 the tablebases.
+
+// Look up the root position of board b and data d with the given legal moves in the tablebases, then in the opening book,
+// setting rootProbeMove and rootProbeSource. The thread's bitboards must hold the position. Return whether a move was found.
+bool probeRoot(T* t, N* n, char* b, D* d, MV* moves, int numMoves) {
+    rootProbeMove = NO_MOVE;
+    rootProbeSource = 0;
+
+#if USE_SYZYGY
+    MV tablebaseMove = NO_MOVE;
+    if (probeTablebase(t, n, 1, &tablebaseMove) != TB_RESULT_FAILED) {
+        for (int i = 0; i < numMoves; i++) {
+            if (moves[i] != tablebaseMove) continue;
+            rootProbeMove = tablebaseMove;
+            rootProbeSource = 2;
+            return 1;
+        }
+    }
+#endif
+
+    MV bookMove = probeBook(b, bookKey(b, d), moves, numMoves);
+    if (bookMove == NO_MOVE) return 0;
+    rootProbeMove = bookMove;
+    rootProbeSource = 1;
+    return 1;
+}
+
+// Return whether the position of node nodeIndex, which has been examined, occurred before on its path from the root or in gameKeys.
+// Positions before the last capture or pawn move cannot recur, and only every second one has the same player to move.
+bool isRepetition(int nodeIndex) {
+    unsigned long long key = nodeKeys[nodeIndex];
+    int plies = nodes[nodeIndex].FIFTY_MOVE_COUNTER;
+    int x = nodeIndex;
+    int i = 1;
+
+    for (; i <= plies && x != 0; i++) {
+        x = nodes[x].parentIndex;
+        if (!(i & 1) && nodeKeys[x] == key) return 1;
+    }
+
+    // Past the root, i plies back from the node is i - depth plies back from the root.
+    int depth = i - 1;
+    for (; i <= plies && i - depth <= gameKeysLength; i++) {
+        if (!(i & 1) && gameKeys[gameKeysLength - (i - depth)] == key) return 1;
+    }
+    return 0;
+}
+
+// Called after creating a node from a move.
+// Play the move in the node on the node's miscellaneous data.
+// Find, execute, evaluate, and queue (using global move parallel array indices) all moves from there.
+// Called both to expand tree and find all legal moves in an arbitrary position.
+// Without storeMoves, the moves and the evals of the positions after them are left in the child pool and the node is not
+// stored in the transposition table, which the caller does once it has made the moves into children (see lazyExpansion).
+// Return whether there are no more global moves available.
+bool examineAllSemilegalMoves(T* t, int nodeIndex, bool storeMoves) {
+    N* n = nodes + nodeIndex;
+    unsigned long long* key = nodeKeys + nodeIndex;
+    char* b = t->cb;
+
+#if ENGINE_DEBUG_VERIFY
+    // Copy the board to check that it is restored after examining this node.
+    char ob[64] = {
+        0,0,0,0,0,0,0,0,
+        0,0,0,0,0,0,0,0,
+        0,0,0,0,0,0,0,0,
+        0,0,0,0,0,0,0,0,
+        0,0,0,0,0,0,0,0,
+        0,0,0,0,0,0,0,0,
+        0,0,0,0,0,0,0,0,
+        0,0,0,0,0,0,0,0
+    };
+    for (int i = 0; i < 64; i++) {
+        ob[i] = b[i];
+    }
+#endif
+
+    // Clear the child pool so we can find all children.
+    t->childPoolLength = 0;
+
+    M* move;
+    int d = 0;
+
+#if USE_INCREMENTAL_BOARD
+    // The calculating board is at this node's parent (see moveBoardToNode()), so only this node's move is made.
+    M* playedMoves = t->moves + t->pathDepth;
+
+    PROFILE_START(replayStart);
+    if (n != nodes) { // This check is needed to avoid making the undefined root move (stored in the queued node).
+        move = playedMoves;
+        loadNodeMove(move, n);
+        move->mover = b[move->f];
+        move->captured = b[move->t];
+        move->enPassantSquare = playMoveUpdating(b, n, key);
+        syncBitboards(t, move);
+        d = 1;
+    }
+#else
+    // Traverse back to the root node, collecting the moves.
+    PROFILE_START(replayStart);
+    N* p = n;
+    M* playedMoves = t->moves;
+
+    if (n != nodes) { // This check is needed to avoid making the undefined root move (stored in the queued node).
+
+        while (p != nodes) {
+            move = t->moves + d;
+            d++;
+
+            loadNodeMove(move, p);
+
+            if (p->parentIndex == 0) break;
+            p = nodes + p->parentIndex;
+        }
+
+        // Play those moves in reverse order on the thread's calculating board.
+        for (int i = d - 1; i > 0; i--) {
+            move = t->moves + i;
+
+            // Find the other characteristics of the moves so we can undo.
+            move->mover = b[move->f];
+            move->captured = b[move->t];
+            move->enPassantSquare = playMove(b, n, move);
+            syncBitboards(t, move);
+        }
+
+        // Make the chosen move stored in the queued node, updating the data in n.
+        move = t->moves;
+        move->mover = b[move->f];
+        move->captured = b[move->t];
+        move->enPassantSquare = playMoveUpdating(b, n, key);
+        syncBitboards(t, move);
+    }
+#endif
+    n->examined = 1;
+    PROFILE_STOP(t, PHASE_REPLAY, replayStart);
+
+#if ENGINE_DEBUG_VERIFY
+    // Check the incrementally updated key against a key computed from scratch.
+    unsigned long long fullKey = computeZobristKey(b, n->PLAYER_TURN,
+        zobristStateKey(n->wKINGSIDE_CASTLE, n->wQUEENSIDE_CASTLE, n->bKINGSIDE_CASTLE, n->bQUEENSIDE_CASTLE, n->EN_PASSANT_FILE));
+    if (*key != fullKey) {
+        printf("Node %i: key is %llx and should be %llx.\n", nodeIndex, *key, fullKey);
+    }
+#endif
+
+    // A drawn position gets no moves. It is checked first since a repeated position would otherwise link to its own ancestor.
+    PROFILE_START(probeStart);
+    if (n != nodes) {
+        bool fiftyMoves = n->FIFTY_MOVE_COUNTER >= 100;
+        if (fiftyMoves || isRepetition(nodeIndex)) {
+            PROFILE_STOP(t, PHASE_PROBE, probeStart);
+            for (int i = 0; i < d; i++) {
+                undoMove(t, playedMoves + i);
+            }
+
+            n->GAME_STATE = DRAW;
+            n->e.store(DRAW_EVAL);
+            if (fiftyMoves) countStat(t->stats.fiftyMoveDrawsFound, 1);
+            else countStat(t->stats.repetitionsFound, 1);
+            return 0;
+        }
+    }
+
+    // A position whose endgame result is known is terminal too (see probeEndgame()).
+    if (n != nodes) {
+        char result = probeEndgame(t, n);
+        if (result != NORMAL) {
+            PROFILE_STOP(t, PHASE_PROBE, probeStart);
+            for (int i = 0; i < d; i++) {
+                undoMove(t, playedMoves + i);
+            }
+
+            n->GAME_STATE = result;
+            n->e.store(result == DRAW ? DRAW_EVAL : result == WHITE_WIN ? TABLEBASE_WIN_EVAL : -TABLEBASE_WIN_EVAL);
+            countStat(t->stats.endgameHits, 1);
+            return 0;
+        }
+    }
+
+    // If this position is already in the tree, link this node to it instead of examining the position again.
+    if (n != nodes) {
+        countStat(t->stats.transpositionProbes, 1);
+        int x = probeTranspositionTable(*key);
+        if (x != UNDEFINED) {
+            PROFILE_STOP(t, PHASE_PROBE, probeStart);
+            for (int i = 0; i < d; i++) {
+                undoMove(t, playedMoves + i);
+            }
+
+            n->transpositionIndex = x;
+            n->e.store((nodes + x)->e.load());
+            countStat(t->stats.transpositionHits, 1);
+            N* linked = nodes + x;
+            countStat(t->stats.transpositionMovesSaved, linked->numMoves > 0 ? linked->numMoves : linked->numChildren);
+            return 0;
+        }
+    }
+
+    PROFILE_STOP(t, PHASE_PROBE, probeStart);
+
+    char playerTurn = n->PLAYER_TURN;
+
+    PROFILE_START(movegenStart);
+#if USE_BITBOARD_MOVEGEN
+    examineAllMovesBitboard(t, n);
+#else
+    examineAllMovesMailbox(t, n);
+    removeIllegalMoves(t, n);
+#endif
+    PROFILE_STOP(t, PHASE_MOVEGEN, movegenStart);
+
+#if ENGINE_DEBUG_VERIFY
+    // Check the bitboards, board eval, and phase against the calculating board and the two move generators against each other.
+    int scanEval = 0, scanPhase = 0;
+    for (int i = 0; i < 64; i++) {
+        for (int j = 0; j < NUM_PIECES; j++) {
+            if ((((t->bb)[j] >> i) & 1) != (b[i] == j)) {
+                printf("Node %i: bitboard %i disagrees with B[%i] = %i.\n", nodeIndex, j, i, b[i]);
+            }
+        }
+        ifNonEmpty(i) {
+            scanEval += pieceSquareTable[b[i] * 64 + i];
+            scanPhase += piecePhases[b[i]];
+        }
+    }
+    if (scanEval != t->boardEval || scanPhase != t->boardPhase) {
+        printf("Node %i: board eval %i and phase %i should be %i and %i.\n", nodeIndex, t->boardEval, t->boardPhase, scanEval, scanPhase);
+    }
+
+    int ol = t->childPoolLength;
+    MV oMoves[LEGAL_MOVES_UPPER_BOUND];
+    for (int i = 0; i < ol; i++) {
+        oMoves[i] = (t->childMoves)[i];
+    }
+
+    for (int i = 0; i < ol; i++) {
+        if (!semilegalMoveIsLegal(b, n, oMoves[i])) {
+            printf("Node %i: the move %i -> %i is illegal.\n", nodeIndex, moveFromSquare(oMoves[i]), moveToSquare(oMoves[i]));
+        }
+    }
+
+    t->childPoolLength = 0;
+#if USE_BITBOARD_MOVEGEN
+    examineAllMovesMailbox(t, n);
+    removeIllegalMoves(t, n);
+#else
+    examineAllMovesBitboard(t, n);
+#endif
+
+    bool sameMoves = t->childPoolLength == ol;
+    for (int i = 0; i < ol && sameMoves; i++) {
+        bool found = 0;
+        for (int j = 0; j < ol; j++) {
+            if ((t->childMoves)[j] == oMoves[i]) found = 1;
+        }
+        sameMoves = found;
+    }
+    if (!sameMoves) {
+        printf("Node %i: the move generators found %i and %i moves.\n", nodeIndex, ol, t->childPoolLength);
+    }
+
+    t->childPoolLength = ol;
+    for (int i = 0; i < ol; i++) {
+        (t->childMoves)[i] = oMoves[i];
+    }
+#endif
+
+    // Without moves, whether the king is attacked tells checkmate from stalemate, and the board is still at this node.
+    bool inCheck = t->childPoolLength == 0 && !kingNotInCheck(b, playerTurn == BLACK ? n->bKING_SQUARE : n->wKING_SQUARE, playerTurn);
+
+    // Evaluate the resulting positions while the calculating board is still at this node.
+    PROFILE_START(evalStart);
+    computeChildEvals(t, n);
+    PROFILE_STOP(t, PHASE_EVAL, evalStart);
+
+    // Undo the moves starting at the queued node and going to the root on the thread's calculating board.
+    PROFILE_START(undoStart);
+    for (int i = 0; i < d; i++) {
+        undoMove(t, playedMoves + i);
+    }
+    PROFILE_STOP(t, PHASE_REPLAY, undoStart);
+
+#if ENGINE_DEBUG_VERIFY
+    // Check that the board is back to where it was before this node's moves were made.
+    for (int i = 0; i < 64; i++) {
+        if (b[i] != ob[i]) {
+            printf("Node %i: B[%i] is %i and old B[%i] is %i.\n", nodeIndex, i, b[i], i, ob[i]);
+            for (int j = d - 1; j >= 0; j--) {
+                printf("- Node %i, depth %i: %i -> %i, %i captured %i, eps %i\n", nodeIndex, d - 1 - j,
+                    (playedMoves + j)->f, (playedMoves + j)->t, (playedMoves + j)->mover, (playedMoves + j)->captured, (playedMoves + j)->enPassantSquare
+                );
+            }
+        }
+    }
+#endif
+
+    int newNC = t->childPoolLength;
+
+    // If there are no legal moves, mark this node as checkmate or stalemate.
+    if (newNC == 0) {
+        if (!inCheck) {
+            n->GAME_STATE = DRAW;
+            n->e.store(DRAW_EVAL);
+            countStat(t->stats.stalematesFound, 1);
+        }
+        else if (playerTurn == BLACK) {
+            n->GAME_STATE = WHITE_WIN;
+            n->e.store(WHITE_WINS_EVAL);
+            countStat(t->stats.whiteWinsFound, 1);
+        }
+        else {
+            n->GAME_STATE = BLACK_WIN;
+            n->e.store(BLACK_WINS_EVAL);
+            countStat(t->stats.blackWinsFound, 1);
+        }
+
+        return 0;
+    }
+
+    MV* moves = t->childMoves;
+    int* evals = t->childEvals;
+
+    // Set the new node's eval to be the best of the resulting position evals.
+    int best = playerTurn == BLACK ? KING_CAPTURE_EVAL : -KING_CAPTURE_EVAL;
+    for (int i = 0; i < newNC; i++) {
+        int eval = evals[i];
+        if (playerTurn == BLACK) {
+            if (eval < best) best = eval;
+        }
+        else {
+            if (eval > best) best = eval;
+        }
+    }
+    n->e = evalFromUnits(best);
+
+    if (!storeMoves) {
+        countStat(t->stats.normalsFound, 1);
+        return 0;
+    }
+
+    PROFILE_START(allocateStart);
+    int nl = allocateSlots(newNC, UNDEFINED, &(t->moveBlockNext), &(t->moveBlockEnd), &(t->moveSlotsAbandoned),
+        &globalMoveLength, globalMoveCap.load(), moveBlockSize);
+    PROFILE_STOP(t, PHASE_ALLOCATE, allocateStart);
+    if (nl == UNDEFINED) {
+        return 1;
+    }
+    countStat(t->stats.movesAdded, newNC);
+    countStat(t->stats.normalsFound, 1);
+
+    // Store the moves in the new node.
+    PROFILE_START(childrenStart);
+    n->numMoves = newNC;
+    n->moveStartIndex = nl;
+    for (int i = 0; i < newNC; i++) {
+        globalMoves[nl + i] = moves[i];
+    }
+
+    // Let later nodes with this position link to this node.
+    storeTranspositionTable(*key, nodeIndex);
+    PROFILE_STOP(t, PHASE_CHILDREN, childrenStart);
+
+    return 0;
+}
+
+// Pop and return the first (lowest score) queued node from this thread's queue.
+// Assume the queue is not empty.
+QE getFirstFuture(T* t) {
+
+    if (queueType == QUEUE_BUCKETS) {
+
+        // Remove the last element in the bucket with the lowest index containing an element.
+        int* bl = t->bucketLength;
+        for (int i = t->lowestBucketIndex;; i++) {
+            if (bl[i] > 0) {
+                if (i == numBuckets - 1 && bl[i] > 1 && spreadLastBucket(t)) {
+                    i = t->lowestBucketIndex - 1;
+                    continue;
+                }
+                if (i == 0 && bl[i] > 1 && t->bucketUnderflow && rebaseFirstBucket(t)) {
+                    i = t->lowestBucketIndex - 1;
+                    continue;
+                }
+                bl[i]--;
+                (t->futuresQueueSize)--;
+                t->lowestBucketIndex = i;
+                return (t->buckets)[i][bl[i]];
+            }
+        }
+    }
+
+    // Remove the minimum element at the first position, then move the lower of the children up until the place of the
+    // last element is found.
+    QE* h = t->futuresHeap;
+    int d = queueType;
+    QE o = h[d - 1];
+    (t->futuresQueueSize)--;
+    int end = t->futuresQueueSize + d - 1;
+    QE last = h[end];
+    switch (d) {
+    case 2:
+        heapMoveDown(h, 1, last, end, 2);
+        break;
+    case 8:
+        heapMoveDown(h, 7, last, end, 8);
+        break;
+    default:
+        heapMoveDown(h, 3, last, end, 4);
+    }
+    return o;
+}
+
+// Renumber every node x in this thread's queue and stash to newIndex[x], removing it if that is UNDEFINED,
+// and restore the queue order.
+void filterFutureQueue(T* t, int* newIndex) {
+
+    if (queueType == QUEUE_BUCKETS) {
+
+        // Filter every bucket in place. The order within a bucket does not matter.
+        t->futuresQueueSize = 0;
+        t->lowestBucketIndex = INT_MAX;
+        for (int i = 0; i < numBuckets; i++) {
+            QE* b = (t->buckets)[i];
+            int l = 0;
+            for (int j = 0; j < (t->bucketLength)[i]; j++) {
+                int x = newIndex[b[j].index];
+                if (x == UNDEFINED) continue;
+                b[l].score = b[j].score;
+                b[l++].index = x;
+            }
+            (t->bucketLength)[i] = l;
+            t->futuresQueueSize += l;
+            if (l > 0 && i < t->lowestBucketIndex) t->lowestBucketIndex = i;
+        }
+    }
+    else {
+
+        // Filter the heap in place.
+        QE* h = t->futuresHeap;
+        int d = queueType;
+        int end = t->futuresQueueSize + d - 1;
+        int l = d - 1;
+        for (int i = d - 1; i < end; i++) {
+            int x = newIndex[h[i].index];
+            if (x == UNDEFINED) continue;
+            h[l].score = h[i].score;
+            h[l++].index = x;
+        }
+        t->futuresQueueSize = l - (d - 1);
+
+        // Reheap by moving each element up from where it is.
+        for (int i = d; i < l; i++) {
+            heapMoveUp(h, i, h[i], d);
+        }
+    }
+
+    QE* st = t->stash;
+    int sl = 0;
+    for (int i = 0; i < t->stashLength; i++) {
+        int x = newIndex[st[i].index];
+        if (x == UNDEFINED) continue;
+        st[sl].score = st[i].score;
+        st[sl++].index = x;
+    }
+    t->stashLength = sl;
+}
+
+// Set up node l as the child of node index made by the given move, with the given eval, before the move is played on it.
+// The move is played on the node's data and key when the node is examined (see examineAllSemilegalMoves()).
+inline void setupChildNode(int l, int index, MV move, EV e) {
+    N* n = nodes + index;
+    N* newN = nodes + l;
+
+    // Set some info about the node based on the found move used to create it.
+    newN->parentIndex = index;
+    newN->depth = n->depth + 1;
+    newN->move = move;
+    newN->examined = 0;
+
+    // Set the rest of the info based on the parent node.
+    newN->wKINGSIDE_CASTLE = n->wKINGSIDE_CASTLE;
+    newN->wQUEENSIDE_CASTLE = n->wQUEENSIDE_CASTLE;
+    newN->bKINGSIDE_CASTLE = n->bKINGSIDE_CASTLE;
+    newN->bQUEENSIDE_CASTLE = n->bQUEENSIDE_CASTLE;
+    newN->EN_PASSANT_FILE = n->EN_PASSANT_FILE; // replaced when the move is played, after removing it from the key
+    newN->FIFTY_MOVE_COUNTER = n->FIFTY_MOVE_COUNTER; // counted when the move is played
+    newN->wKING_SQUARE = n->wKING_SQUARE;
+    newN->bKING_SQUARE = n->bKING_SQUARE;
+    newN->GAME_STATE = NORMAL;
+    newN->PLAYER_TURN = 1 - n->PLAYER_TURN;
+    nodeKeys[l] = nodeKeys[index];
+    newN->transpositionIndex.store(UNDEFINED, memory_order_relaxed);
+    nodeLinks[l].first.store(UNDEFINED, memory_order_relaxed);
+
+    // Set defaults that may be accessed before being set depending on future modifications to this program.
+    newN->numChildren = 0;
+    newN->numMoves = 0;
+    newN->childStartIndex = UNDEFINED;
+    newN->moveStartIndex = 0;
+    newN->e = e;
+}
+
+// Queue the children of node n, which was popped with the given score.
+// Score each child by how much worse it is than its best sibling for the player choosing between them,
+// plus a penalty for its depth, so the most promising lines are examined first (see EVAL AND SCORE VISUALIZATION).
+inline void queueChildren(T* t, N* n, float score) {
+    int nc = n->numChildren;
+    int c = n->childStartIndex;
+    bool isBlack = n->PLAYER_TURN == BLACK;
+    double best = nodeEval(nodes + c);
+    for (int i = 1; i < nc; i++) {
+        double e = nodeEval(nodes + c + i);
+        if (isBlack ? e < best : e > best) best = e;
+    }
+    for (int i = 0; i < nc; i++) {
+        double loss = isBlack ? nodeEval(nodes + c + i) - best : best - nodeEval(nodes + c + i);
+        queueFuture(t, c + i, score + (float)(loss + scoreDepthPenalty));
+    }
+}
+
+// Publish the sizes of this thread's queue, stash, and unused slots after an expansion.
+inline void storeQueueStats(T* t) {
+    t->stats.queueSize.store(t->futuresQueueSize, memory_order_relaxed);
+    t->stats.stashSize.store(t->stashLength, memory_order_relaxed);
+    t->stats.nodeSlotsUnused.store(t->nodeSlotsAbandoned + t->nodeBlockEnd - t->nodeBlockNext, memory_order_relaxed);
+    t->stats.moveSlotsUnused.store(t->moveSlotsAbandoned + t->moveBlockEnd - t->moveBlockNext, memory_order_relaxed);
+}
+
+// Expand the popped node of queue entry q with lazyExpansion: find its moves if it has not been examined yet, make them into
+// children evaluated from their positions only, and queue those children without examining them.
+// Return whether there are no more global nodes available, in which case the node is queued again as it was.
+bool expandLazily(T* t, QE q) {
+    int index = q.index;
+    N* n = nodes + index;
+    EV before = (n->e).load();
+    bool examined = n->examined;
+
+    if (examined) {
+        // A child of the root, examined with its moves stored: only the evals of the positions after them are needed.
+        PROFILE_START(replayStart);
+        moveBoardToNode(t, index);
+        PROFILE_STOP(t, PHASE_REPLAY, replayStart);
+        int nm = n->numMoves;
+        for (int i = 0; i < nm; i++) {
+            (t->childMoves)[i] = globalMoves[n->moveStartIndex + i];
+        }
+        t->childPoolLength = nm;
+        PROFILE_START(evalStart);
+        computeChildEvals(t, n);
+        PROFILE_STOP(t, PHASE_EVAL, evalStart);
+    }
+    else {
+        // The calculating board must be at the parent, where examining the node plays its move.
+        PROFILE_START(replayStart);
+        moveBoardToNode(t, n->parentIndex);
+        PROFILE_STOP(t, PHASE_REPLAY, replayStart);
+        examineAllSemilegalMoves(t, index, 0);
+
+        // A checkmate, stalemate, draw, or transposition gets no children.
+        if (t->childPoolLength == 0) {
+            PROFILE_START(backtrackStart);
+            if (n->transpositionIndex != UNDEFINED) addNodeLink(index, n->transpositionIndex);
+            int length = evalBacktrackChange(n, before, (EV)nodeEval(n));
+            PROFILE_STOP(t, PHASE_BACKTRACK, backtrackStart);
+            PROFILE_BACKTRACK_LENGTH(t, length);
+            return 0;
+        }
+    }
+
+    // Make the moves into nodes after this one. If they do not fit, set the node back to how it was queued.
+    int nc = t->childPoolLength;
+    PROFILE_START(allocateStart);
+    int l = allocateSlots(nc, index, &(t->nodeBlockNext), &(t->nodeBlockEnd), &(t->nodeSlotsAbandoned),
+        &numNodes, nodeCap.load(), nodeBlockSize);
+    PROFILE_STOP(t, PHASE_ALLOCATE, allocateStart);
+    if (l == UNDEFINED) {
+        if (!examined) setupChildNode(index, n->parentIndex, n->move, before);
+        PROFILE_START(pushStart);
+        addFutureQueue(t, index, q.score);
+        PROFILE_STOP(t, PHASE_PUSH, pushStart);
+        return 1;
+    }
+    countStat(t->stats.nodesAdded, nc);
+    countStat(t->stats.nodesAddedDepth[n->depth + 1], nc);
+
+    PROFILE_START(childrenStart);
+    MV* moves = t->childMoves;
+    int* evals = t->childEvals;
+    for (int i = 0; i < nc; i++) {
+        setupChildNode(l + i, index, moves[i], evalFromUnits(evals[i]));
+    }
+    n->childStartIndex = l;
+    n->numChildren = nc;
+
+    // Let later nodes with this position link to this node.
+    if (!examined) storeTranspositionTable(nodeKeys[index], index);
+    PROFILE_STOP(t, PHASE_CHILDREN, childrenStart);
+
+    PROFILE_START(pushStart);
+    queueChildren(t, n, q.score);
+    PROFILE_STOP(t, PHASE_PUSH, pushStart);
+    PROFILE_START(backtrackStart);
+    EV oldEval, newEval;
+    evalRecompute(n, &oldEval, &newEval);
+    int length = evalBacktrackChange(n, before, newEval);
+    PROFILE_STOP(t, PHASE_BACKTRACK, backtrackStart);
+    PROFILE_BACKTRACK_LENGTH(t, length);
+    return 0;
+}
+
+// Examine the highest-priority node.
+// Create a new node for each move.
+// Update the original node's eval based on their evals.
+// Return whether there is no space for more nodes (we can't keep going).
+bool examineNextPosition(T* t) {
+
+    PROFILE_START(popStart);
+    QE q = getFirstFuture(t);
+    PROFILE_STOP(t, PHASE_POP, popStart);
+    int index = q.index;
+    N* n = nodes + index;
+    countStat(t->stats.nodesExamined, 1);
+    countStat(t->stats.nodesExaminedDepth[n->depth], 1);
+
+    if (lazyExpansion && index != 0) {
+        if (expandLazily(t, q)) return 1;
+        storeQueueStats(t);
+        return 0;
+    }
+
+    // A node whose transposition was reclaimed is queued before it is examined (see compactTree()), so find its moves first.
+    if (!n->examined) {
+        EV before = (n->e).load();
+#if USE_INCREMENTAL_BOARD
+        PROFILE_START(replayStart);
+        moveBoardToNode(t, n->parentIndex);
+        PROFILE_STOP(t, PHASE_REPLAY, replayStart);
+#endif
+        if (examineAllSemilegalMoves(t, index, 1)) {
+            setupChildNode(index, n->parentIndex, n->move, before);
+            addFutureQueue(t, index, q.score);
+            return 1;
+        }
+
+        // A checkmate, stalemate, draw, or transposition gets no children.
+        PROFILE_START(backtrackStart);
+        if (n->numMoves <= 0 && n->transpositionIndex != UNDEFINED) addNodeLink(index, n->transpositionIndex);
+        int length = evalBacktrackChange(n, before, (EV)nodeEval(n));
+        PROFILE_STOP(t, PHASE_BACKTRACK, backtrackStart);
+        PROFILE_BACKTRACK_LENGTH(t, length);
+        if (n->numMoves <= 0) {
+            storeQueueStats(t);
+            return 0;
+        }
+    }
+
+    // Make the possible moves into nodes after this one, queueing this node again if they do not fit.
+    int nc = n->numMoves;
+    PROFILE_START(allocateStart);
+    int l = allocateSlots(nc, index, &(t->nodeBlockNext), &(t->nodeBlockEnd), &(t->nodeSlotsAbandoned),
+        &numNodes, nodeCap.load(), nodeBlockSize);
+    PROFILE_STOP(t, PHASE_ALLOCATE, allocateStart);
+    if (l == UNDEFINED) {
+        addFutureQueue(t, index, q.score);
+        return 1;
+    }
+    countStat(t->stats.nodesAdded, nc);
+    countStat(t->stats.nodesAddedDepth[n->depth + 1], nc);
+
+    n->numChildren = nc;
+    n->childStartIndex = l;
+
+#if USE_INCREMENTAL_BOARD
+    PROFILE_START(replayStart);
+    moveBoardToNode(t, index);
+    PROFILE_STOP(t, PHASE_REPLAY, replayStart);
+#endif
+
+    for (int i = 0; i < nc; i++, l++) {
+        PROFILE_START(childrenStart);
+        setupChildNode(l, index, globalMoves[n->moveStartIndex + i], 0.0);
+        PROFILE_STOP(t, PHASE_CHILDREN, childrenStart);
+
+        // Examine all moves from this node.
+        if (examineAllSemilegalMoves(t, l, 1)) {
+
+            // Undo this expansion so the node can be expanded again once memory is reclaimed.
+            // The children examined so far are not queued yet and are left unreachable.
+            n->numChildren = 0;
+            n->childStartIndex = UNDEFINED;
+            addFutureQueue(t, index, q.score);
+            return 1;
+        }
+    }
+
+    PROFILE_START(pushStart);
+    queueChildren(t, n, q.score);
+    PROFILE_STOP(t, PHASE_PUSH, pushStart);
+    PROFILE_START(backtrackStart);
+
+    // The children linked to transpositions are only added to the lists of the nodes they link to now that all the children
+    // are set up, since a change of a node linked to is backtracked from each of them to this node.
+    for (int i = 0; i < nc; i++) {
+        int x = (nodes + n->childStartIndex + i)->transpositionIndex;
+        if (x != UNDEFINED) addNodeLink(n->childStartIndex + i, x);
+    }
+    int length = evalBacktrack(n);
+    PROFILE_STOP(t, PHASE_BACKTRACK, backtrackStart);
+    PROFILE_BACKTRACK_LENGTH(t, length);
+    storeQueueStats(t);
+
+    return 0;
+}
+
+// Threads expanding nodes hold the tree (see enterTree()) so that a thread reclaiming memory can wait until none are.
+atomic<int> treeUsers;
+atomic<bool> treeReclaiming;
+condition_variable treeReclaimCondition; // Notified when reclaiming ends, with threadStateMutex.
+
+// Start using the tree, waiting while another thread is reclaiming memory.
+inline void enterTree() {
+    while (1) {
+        treeUsers.fetch_add(1);
+        if (!treeReclaiming.load()) return;
+
+        // Step back out and sleep until the reclaiming ends.
+        treeUsers.fetch_add(-1);
+        unique_lock<mutex> lock(threadStateMutex);
+        treeReclaimCondition.wait(lock, [] { return !treeReclaiming.load(); });
+    }
+}
+
+// Stop using the tree.
+inline void leaveTree() {
+    treeUsers.fetch_add(-1);
+}
+
+// Mark the nodes kept by reclaiming in reclaimIndex: UNDEFINED for removed, 0 for kept, and 1 for kept without children.
+// An expanded node loses its subtree if its eval is more than margin worse than its best sibling's for the player choosing.
+// Add the number of kept nodes and an estimate of the moves kept (by the kept unexpanded nodes) to keptNodes and keptMoves.
+void markReclaimedNodes(double margin, int numN, long long* keptNodes, long long* keptMoves) {
+    for (int i = 0; i < numN; i++) {
+        reclaimIndex[i] = UNDEFINED;
+    }
+    reclaimIndex[0] = 0;
+
+    // Parents always come before their children, so one pass in index order reaches every kept node.
+    for (int i = 0; i < numN; i++) {
+        if (reclaimIndex[i] == UNDEFINED) continue;
+        (*keptNodes)++;
+
+        N* n = nodes + i;
+        int nc = n->numChildren;
+        if (reclaimIndex[i] == 1 || nc == 0) {
+            if (reclaimIndex[i] == 0 && n->transpositionIndex == UNDEFINED) *keptMoves += n->numMoves;
+            continue;
+        }
+
+        N* c = nodes + n->childStartIndex;
+        bool isBlack = n->PLAYER_TURN == BLACK;
+        double best = nodeEval(c);
+        for (int j = 1; j < nc; j++) {
+            double e = nodeEval(c + j);
+            if (isBlack ? e < best : e > best) best = e;
+        }
+        for (int j = 0; j < nc; j++) {
+            double loss = isBlack ? nodeEval(c + j) - best : best - nodeEval(c + j);
+            reclaimIndex[n->childStartIndex + j] = loss > margin && (c + j)->numChildren > 0 ? 1 : 0;
+        }
+    }
+}
+
+// Used to sort the queued nodes by where their moves are.
+int compareMoveStarts(const void* a, const void* b) {
+    int x = (nodes + ((QE*)a)->index)->moveStartIndex;
+    int y = (nodes + ((QE*)b)->index)->moveStartIndex;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Copy the entries of all threads' queues and stashes into o, which must fit all of them. Return the number of entries.
+int getAllFutures(QE* o) {
+    int l = 0;
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        if (queueType == QUEUE_BUCKETS) {
+            for (int j = 0; j < numBuckets; j++) {
+                for (int k = 0; k < (t->bucketLength)[j]; k++) {
+                    o[l++] = (t->buckets)[j][k];
+                }
+            }
+        }
+        else {
+            for (int j = 0; j < t->futuresQueueSize; j++) {
+                o[l++] = (t->futuresHeap)[queueType - 1 + j];
+            }
+        }
+        for (int j = 0; j < t->stashLength; j++) {
+            o[l++] = (t->stash)[j];
+        }
+    }
+    return l;
+}
+
+// Used to sort queue entries by score.
+int compareScores(const void* a, const void* b) {
+    float x = ((QE*)a)->score;
+    float y = ((QE*)b)->score;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Take the best (lowest score) perThread queued nodes of every thread and deal them back out to the non-main threads
+// one at a time in score order, so that each thread examines its share of the best nodes of the whole frontier.
+// The rest of each queue stays where it is. Must be called while no thread is running.
+void redistributeFutures(int perThread) {
+    if (numThreads < 2) return;
+
+    int numTaken = 0;
+    for (int i = 0; i < numThreads; i++) {
+        int s = (threads + i)->futuresQueueSize;
+        numTaken += s < perThread ? s : perThread;
+    }
+    if (numTaken == 0) return;
+
+    QE* taken = (QE*)calloc(numTaken, sizeof(QE));
+    if (taken == NULL) crash();
+    int l = 0;
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        for (int j = 0; j < perThread && t->futuresQueueSize > 0; j++) {
+            taken[l++] = getFirstFuture(t);
+        }
+    }
+    qsort(taken, numTaken, sizeof(QE), compareScores);
+
+    for (int i = 0; i < numTaken; i++) {
+        addFutureQueue(threads + 1 + i % (numThreads - 1), taken[i].index, taken[i].score);
+    }
+    clear(taken);
+}
+
+// Return the score that queueChildren() would give node x if every node from the root down to it were expanded now.
+float pathScore(int x) {
+    double s = ROOT_SCORE;
+    while (x != 0) {
+        N* p = nodes + (nodes + x)->parentIndex;
+        N* c = nodes + p->childStartIndex;
+        bool isBlack = p->PLAYER_TURN == BLACK;
+        double best = nodeEval(c);
+        for (int i = 1; i < p->numChildren; i++) {
+            double e = nodeEval(c + i);
+            if (isBlack ? e < best : e > best) best = e;
+        }
+        s += (isBlack ? nodeEval(nodes + x) - best : best - nodeEval(nodes + x)) + scoreDepthPenalty;
+        x = (nodes + x)->parentIndex;
+    }
+    return (float)s;
+}
+
+// Keep only the nodes marked in reclaimIndex (see markReclaimedNodes()), moving them and the moves of the queued nodes
+// to the front of their arrays and renumbering the links, queues, thread paths, and transposition table entries.
+// Each thread's calculating board is moved back to the deepest kept node of its path. If the root is not kept,
+// the paths are emptied instead and the caller must set up the boards again.
+// Must be called while no thread holds the tree. Return the number of moves kept.
+int compactTree(int numN) {
+
+    // Number the kept nodes in order, removing the children of the nodes losing their subtrees.
+    // A node linked to a removed transposition would have no way to be expanded, so it is set back to how it was queued
+    // as its parent's child, keeping the linked node's eval as its own, and is queued again once the tree is compacted.
+    int* unlinked = NULL;
+    int numUnlinked = 0;
+    int unlinkedCap = 0;
+    int l = 0;
+    for (int i = 0; i < numN; i++) {
+        if (reclaimIndex[i] == UNDEFINED) continue;
+        if (reclaimIndex[i] == 1) {
+            (nodes + i)->numChildren = 0;
+            (nodes + i)->childStartIndex = UNDEFINED;
+        }
+        reclaimIndex[i] = l++;
+
+        N* n = nodes + i;
+        if (n->transpositionIndex != UNDEFINED && reclaimIndex[n->transpositionIndex] == UNDEFINED) {
+            setupChildNode(i, n->parentIndex, n->move, (EV)nodeEval(n));
+            if (numUnlinked >= unlinkedCap) {
+                unlinkedCap = (int)((double)unlinkedCap * futuresHeapCapMultiplier + (double)futuresHeapCapAdder);
+                unlinked = (int*)realloc(unlinked, unlinkedCap * sizeof(int));
+                if (unlinked == NULL) crash();
+            }
+            unlinked[numUnlinked++] = reclaimIndex[i];
+        }
+    }
+    bool keptRoot = reclaimIndex[0] != UNDEFINED;
+
+    // Move the kept nodes to the front. A node never moves to a higher index, so moving them in order is safe.
+    for (int i = 0; i < numN; i++) {
+        int x = reclaimIndex[i];
+        if (x == UNDEFINED) continue;
+
+        N* n = nodes + i;
+        if (n->parentIndex != UNDEFINED) n->parentIndex = reclaimIndex[n->parentIndex];
+        if (n->childStartIndex != UNDEFINED) n->childStartIndex = reclaimIndex[n->childStartIndex];
+        if (n->transpositionIndex != UNDEFINED) n->transpositionIndex = reclaimIndex[n->transpositionIndex];
+        if (x != i) {
+            memcpy((void*)(nodes + x), (void*)n, sizeof(N));
+            nodeKeys[x] = nodeKeys[i];
+        }
+    }
+    numNodes.store(l);
+    resetSlotBlocks();
+
+    // Rebuild the lists of linked nodes with the new indices.
+    for (int i = 0; i < l; i++) {
+        nodeLinks[i].first.store(UNDEFINED, memory_order_relaxed);
+    }
+    for (int i = 0; i < l; i++) {
+        int x = (nodes + i)->transpositionIndex;
+        if (x != UNDEFINED) addNodeLink(i, x);
+    }
+
+    // Bring every expanded node's eval up to date from its children, children first. A node linked to can come before the
+    // parents of the nodes linked to it, so each change is backtracked to the ancestors and through the links too.
+    for (int i = l - 1; i >= 0; i--) {
+        N* n = nodes + i;
+        EV oldEval, newEval;
+        if (n->numChildren > 0 && evalRecompute(n, &oldEval, &newEval)) evalBacktrackChange(n, oldEval, newEval);
+    }
+
+    // Renumber the queues and move each thread's calculating board back to the deepest node of its path that was kept.
+    int numQueued = 0;
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        filterFutureQueue(t, reclaimIndex);
+        numQueued += t->futuresQueueSize + t->stashLength;
+
+        int* path = t->pathNodes;
+        if (!keptRoot) {
+            t->pathDepth = 0;
+            path[0] = 0;
+            continue;
+        }
+        int d = 0;
+        while (d < t->pathDepth && reclaimIndex[path[d + 1]] != UNDEFINED) d++;
+        while (t->pathDepth > d) {
+            (t->pathDepth)--;
+            undoMove(t, t->moves + t->pathDepth);
+        }
+        for (int j = 0; j <= d; j++) {
+            path[j] = reclaimIndex[path[j]];
+        }
+    }
+
+    // Queue the unlinked nodes on the non-main threads, scored from the evals they and their ancestors have now.
+    for (int i = 0; i < numUnlinked; i++) {
+        T* t = threads + 1 + i % (numThreads - 1);
+        numQueued -= t->futuresQueueSize + t->stashLength;
+        queueFuture(t, unlinked[i], pathScore(unlinked[i]));
+        numQueued += t->futuresQueueSize + t->stashLength;
+    }
+    clear(unlinked);
+
+    // Only the queued and stashed nodes still need their moves. Move those to the front in order.
+    QE* queued = (QE*)calloc(numQueued > 0 ? numQueued : 1, sizeof(QE));
+    if (queued == NULL) crash();
+    getAllFutures(queued);
+    qsort(queued, numQueued, sizeof(QE), compareMoveStarts);
+
+    int m = 0;
+    for (int i = 0; i < numQueued; i++) {
+        N* n = nodes + queued[i].index;
+        memmove(globalMoves + m, globalMoves + n->moveStartIndex, n->numMoves * sizeof(MV));
+        n->moveStartIndex = m;
+        m += n->numMoves;
+    }
+    globalMoveLength.store(m);
+    clear(queued);
+
+    // Replace the transposition table entries, which hold the old node indices.
+    transpositionGeneration++;
+    // Nodes not examined yet still have their parent's key, and ended games were never stored (a repetition depends on its path).
+    for (int i = 0; i < l; i++) {
+        N* n = nodes + i;
+        if (n->transpositionIndex == UNDEFINED && n->examined && n->GAME_STATE == NORMAL) storeTranspositionTable(nodeKeys[i], i);
+    }
+
+    return m;
+}
+
+// Free node and move memory for the rest of the evaluation by removing the subtrees of nodes much worse than their siblings.
+// Called by a thread that ran out of memory while not holding the tree.
+// Return whether enough memory was freed to keep evaluating.
+bool reclaimNodes() {
+
+    // Only one thread reclaims at a time. Any other thread that ran out waits for it and then tries again.
+    {
+        unique_lock<mutex> lock(threadStateMutex);
+        if (treeReclaiming.load()) {
+            treeReclaimCondition.wait(lock, [] { return !treeReclaiming.load(); });
+            return 1;
+        }
+        treeReclaiming.store(1);
+    }
+    while (treeUsers.load() != 0) this_thread::yield();
+
+    int numN = numNodes.load();
+    if (numN > nodeCap.load()) numN = nodeCap.load();
+    int numM = globalMoveLength.load();
+    if (numM > globalMoveCap.load()) numM = globalMoveCap.load();
+
+    // Halve the margin until enough of both nodes and moves would be freed.
+    double margin = reclaimEvalMargin;
+    bool enough = 0;
+    for (int k = 0; k < 8; k++, margin /= 2.0) {
+        long long keptNodes = 0, keptMoves = 0;
+        markReclaimedNodes(margin, numN, &keptNodes, &keptMoves);
+        enough = keptNodes <= (long long)((1.0 - reclaimMinFreeFraction) * nodeCap.load())
+            && keptMoves <= (long long)((1.0 - reclaimMinFreeFraction) * globalMoveCap.load());
+        if (enough) break;
+    }
+
+    if (enough) {
+        int m = compactTree(numN);
+        calcNumReclaims.fetch_add(1);
+        calcNumNodesReclaimed.fetch_add(numN - numNodes.load());
+        calcNumMovesReclaimed.fetch_add(numM - m);
+    }
+
+    {
+        lock_guard<mutex> lock(threadStateMutex);
+        treeReclaiming.store(0);
+    }
+    treeReclaimCondition.notify_all();
+
+    return enough;
+}
+
+// Examine the next node in this thread's queue while holding the tree, reclaiming memory if there is not enough.
+// Return whether the evaluation cannot continue (the queue is empty or not enough memory could be reclaimed).
+bool expandNextPosition(T* t) {
+    enterTree();
+    if (t->futuresQueueSize == 0) {
+        leaveTree();
+        return 1;
+    }
+    bool full = examineNextPosition(t);
+    leaveTree();
+
+    if (full) return !reclaimNodes();
+    return 0;
+}
+
+// Reset the futures queue to the initial empty state from any length and capacity.
+void clearQueueHeavy() {
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+
+        t->futuresQueueSize = 0;
+
+        // Empty every bucket.
+        if (t->buckets != NULL) {
+            for (int i = 0; i < numBuckets; i++) {
+                (t->bucketCap)[i] = 0;
+                (t->bucketLength)[i] = 0;
+                clear((t->buckets)[i]);
+            }
+            t->lowestBucketIndex = INT_MAX;
+            t->bucketWidth = 0;
+        }
+
+        // Make the heap have no nodes.
+        clear(t->futuresHeapMemory);
+        t->futuresHeap = NULL;
+        t->futuresHeapCap = 0;
+
+        clear(t->stash);
+        t->stashLength = 0;
+        t->stashCap = 0;
+    }
+}
+
+// Reset the futures queue to the initial empty state from any length and capacity, without freeing any memory.
+void clearQueueLight() {
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
 
-            // Empty every bucket.
+        t->futuresQueueSize = 0;
+
+        // Empty every bucket. The heap needs nothing else.
+        if (t->buckets != NULL) {
             for (int i = 0; i < numBuckets; i++) {
-                bc[i] = 0;
-                bl[i] = 0;
-                clear(b[i]);
+                (t->bucketLength)[i] = 0;
             }
-        #else
+            t->lowestBucketIndex = INT_MAX;
+            t->bucketWidth = 0;
+        }
+
+        t->stashLength = 0;
+    }
+}
+
+// Set the keys of the count positions played in the game before the next evaluated position, oldest first (see gameKeys).
+// Return 0 if the threads are evaluating.
+bool setGameKeys(unsigned long long* keys, int count) {
+    if (evaluationStarted) return 0;
+    if (count < 0) count = 0;
+    gameKeys = (unsigned long long*)realloc(gameKeys, (count > 0 ? count : 1) * sizeof(unsigned long long));
+    if (gameKeys == NULL) crash();
+    for (int i = 0; i < count; i++) {
+        gameKeys[i] = keys[i];
+    }
+    gameKeysLength = count;
+    return 1;
+}
+
+// Change whether children are queued before their moves are found (see lazyExpansion).
+// A tree made with lazy expansion cannot be searched without it, so after a change the position must be set up again.
+// Return 0 if the threads are evaluating or the calculating boards are not kept at the last node examined.
+bool setLazyExpansion(bool lazy) {
+    if (evaluationStarted || !USE_INCREMENTAL_BOARD) return 0;
+    if (lazy != lazyExpansion) setupComplete = 0;
+    lazyExpansion = lazy;
+    return 1;
+}
+
+// Change the kind of queue every thread uses (see queueType), moving the queued nodes into the new queues.
+// Return 0 if the type is not a kind of queue or the threads are evaluating.
+bool setQueueType(int type) {
+    if (type != QUEUE_BUCKETS && type != 2 && type != 4 && type != 8) return 0;
+    if (evaluationStarted) return 0;
+    if (type == queueType) return 1;
+
+    int numQueued = 0;
+    for (int i = 0; i < numThreads; i++) {
+        numQueued += (threads + i)->futuresQueueSize;
+    }
+    QE* queued = (QE*)calloc(numQueued > 0 ? numQueued : 1, sizeof(QE));
+    if (queued == NULL) crash();
+
+    // Empty the old queues in order, then add each thread's nodes to its new queue.
+    int* counts = (int*)calloc(numThreads > 0 ? numThreads : 1, sizeof(int));
+    if (counts == NULL) crash();
+    int l = 0;
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        counts[i] = t->futuresQueueSize;
+        while (t->futuresQueueSize > 0) {
+            queued[l++] = getFirstFuture(t);
+        }
+    }
+    queueType = type;
+    l = 0;
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        if (type == QUEUE_BUCKETS) {
+            allocateBuckets(t);
+            t->lowestBucketIndex = INT_MAX;
+            t->bucketWidth = 0;
+        }
+        for (int j = 0; j < counts[i]; j++, l++) {
+            addFutureQueue(t, queued[l].index, queued[l].score);
+        }
+    }
+
+    clear(counts);
+    clear(queued);
+    return 1;
+}
+
+// Time the given kind of queue (see queueType) on its own: fill a queue with size nodes, then pop a node and queue one
+// child of it with a slightly higher score ops times, as the search does. Scores come from a fixed pseudorandom sequence.
+// Set fillTime and opsTime to the nanoseconds taken. Return 0 if the type is not a kind of queue or the threads are evaluating.
+bool runQueueBenchmark(int type, int size, int ops, long long* fillTime, long long* opsTime) {
+    if (type != QUEUE_BUCKETS && type != 2 && type != 4 && type != 8) return 0;
+    if (evaluationStarted || size < 1 || ops < 0) return 0;
+
+    int oldType = queueType;
+    queueType = type;
+    T* t = (T*)calloc(1, sizeof(T));
+    if (t == NULL) crash();
+    if (type == QUEUE_BUCKETS) allocateBuckets(t);
+
+    unsigned long long z = 0x2545f4914f6cdd1d;
+    long long start = clockNanoseconds();
+    for (int i = 0; i < size; i++) {
+        z = z * 6364136223846793005ull + 1442695040888963407ull;
+        addFutureQueue(t, i, (float)(z >> 40) * (10.0f / 16777216.0f));
+    }
+    long long filled = clockNanoseconds();
+    for (int i = 0; i < ops; i++) {
+        QE e = getFirstFuture(t);
+        z = z * 6364136223846793005ull + 1442695040888963407ull;
+        addFutureQueue(t, e.index, e.score + (float)(z >> 40) * (1.0f / 16777216.0f));
+    }
+    long long done = clockNanoseconds();
+    *fillTime = filled - start;
+    *opsTime = done - filled;
+
+    if (t->buckets != NULL) {
+        for (int i = 0; i < numBuckets; i++) {
+            clear((t->buckets)[i]);
+        }
+        clear(t->buckets);
+        clear(t->bucketCap);
+        clear(t->bucketLength);
+    }
+    clear(t->futuresHeapMemory);
+    clear(t);
+    queueType = oldType;
+    return 1;
+}
 
-            // Make the heap have no nodes (length 1).
-            t->futuresQueueSize = 0;
-            t->futuresHeapCap = 1;
-            t->futuresHeap = (int*)realloc(t->futuresHeap, 4);
-        #endif
+// Set the given stats to zero.
+void resetStats(CS* s) {
+    s->nodesAdded.store(0);
+    s->movesAdded.store(0);
+    s->nodesExamined.store(0);
+    s->stalematesFound.store(0);
+    s->whiteWinsFound.store(0);
+    s->blackWinsFound.store(0);
+    s->normalsFound.store(0);
+    s->repetitionsFound.store(0);
+    s->fiftyMoveDrawsFound.store(0);
+    s->endgameHits.store(0);
+    s->transpositionProbes.store(0);
+    s->transpositionHits.store(0);
+    s->transpositionMovesSaved.store(0);
+    s->queueSize.store(0);
+    s->stashSize.store(0);
+    s->nodeSlotsUnused.store(0);
+    s->moveSlotsUnused.store(0);
+    s->runTime.store(0);
+    s->runStartTime.store(0);
+
+    for (int i = 0; i < MAX_DEPTH; i++) {
+        s->nodesAddedDepth[i].store(0);
+        s->nodesQueuedDepth[i].store(0);
+        s->nodesExaminedDepth[i].store(0);
     }
 }
 
-// Reset the futures queue to the initial empty state from any length and capacity, without freeing any memory.
-void clearQueueLight() {
+// Reset the calc statistics of all threads. The threads must not be running.
+#if ENGINE_PROFILE
+// Clear the profiles of all threads and restart the profile clock.
+void resetProfile() {
     for (int i = 0; i < numThreads; i++) {
-        T* t = threads + i;
-
-        #if USE_SCORE_BUCKETS
+        PF* p = &((threads + i)->profile);
+        for (int j = 0; j < NUM_PROFILE_PHASES; j++) {
+            p->cycles[j] = 0;
+            p->calls[j] = 0;
+        }
+        for (int j = 0; j <= MAX_DEPTH; j++) {
+            p->backtrackLengths[j] = 0;
+        }
+        p->traceLength = 0;
+    }
+    profileStartCycles = readCycles();
+    profileStartTime = clockNanoseconds();
+}
 
-            t->futuresQueueSize = 0;
+// Return the nanoseconds per cycle counted since the profile was reset.
+double profileNanosecondsPerCycle() {
+    unsigned long long cycles = readCycles() - profileStartCycles;
+    return cycles > 0 ? (double)(clockNanoseconds() - profileStartTime) / (double)cycles : 0.0;
+}
 
-            // Empty every bucket.
-            for (int i = 0; i < numBuckets; i++) {
-                (t->bucketLength)[i] = 0;
-            }
-        #else
-            // Make the heap have no nodes (length 1).
-            t->futuresQueueSize = 0; // good because allocated
+// Write the traces of all threads to a file at path in the Chrome tracing format (chrome://tracing or Perfetto),
+// each phase as a complete event of the thread that ran it. Return whether the file was written.
+bool writeProfileTrace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return 0;
 
-        #endif
-    }
+    double nsPerCycle = profileNanosecondsPerCycle();
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = 1;
+    for (int i = 0; i < numThreads; i++) {
+        PF* p = &((threads + i)->profile);
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"%s %i\"}}",
+            first ? "" : ",\n", i, i == 0 ? "main" : "thread", i);
+        first = 0;
+        for (int j = 0; j < p->traceLength; j++) {
+            PE* e = p->trace + j;
+            double start = (double)(long long)(e->start - profileStartCycles) * nsPerCycle / 1000.0;
+            double duration = (double)e->cycles * nsPerCycle / 1000.0;
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f}",
+                profilePhaseNames[e->phase], i, start, duration);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
 }
+#endif
 
-// Reset the calc statistics for this thread.
 void resetCalcStats() {
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        resetStats(&(t->stats));
+        t->nodeSlotsAbandoned = 0;
+        t->moveSlotsAbandoned = 0;
+    }
+    resetStats(&calcStats);
+    calcExaminedPerSecond = 0;
+    calcMaxDepth = 0;
 
-    calcNumWhiteWinsFound.store(0);
-    calcNumBlackWinsFound.store(0);
-    calcNumStalematesFound.store(0);
-    calcNumNormalsFound.store(0);
+    calcNumReclaims.store(0);
+    calcNumNodesReclaimed.store(0);
+    calcNumMovesReclaimed.store(0);
+    calcStopLatency.store(0);
 
-    calcNumNodesAdded.store(0);
-    calcNumMovesAdded.store(0);
-    calcNumNodesExamined.store(0);
-    /*
-    int size = evaluationDepthLimit * 4;
+#if ENGINE_PROFILE
+    resetProfile();
+#endif
+}
 
-    calcNumNodesAddedDepth = (int*)realloc(calcNumNodesAddedDepth, size); // TODO: Decide whether to do these depth-specific stats (may help debugging and training)
-    calcNumMovesAddedDepth = (int*)realloc(calcNumMovesAddedDepth, size);
-    calcNumNodesExaminedDepth = (int*)realloc(calcNumNodesExaminedDepth, size);
+// Sum the stats of all threads into calcStats and compute the combined rates from them.
+// Running threads keep counting meanwhile, so the sums may be a few positions behind.
+void sumCalcStats() {
+    CS* s = &calcStats;
+    resetStats(s);
+    double rate = 0.0;
+    long long now = clockNanoseconds();
 
-    for (int i = 0; i < evaluationDepthLimit; i++) {
-        calcNumNodesAddedDepth[i] = 0;
-        calcNumMovesAddedDepth[i] = 0;
-        calcNumNodesExaminedDepth[i] = 0;
+    for (int i = 0; i < numThreads; i++) {
+        CS* c = &((threads + i)->stats);
+        int examined = c->nodesExamined.load(memory_order_relaxed);
+        s->nodesAdded.store(s->nodesAdded.load() + c->nodesAdded.load(memory_order_relaxed));
+        s->movesAdded.store(s->movesAdded.load() + c->movesAdded.load(memory_order_relaxed));
+        s->nodesExamined.store(s->nodesExamined.load() + examined);
+        s->stalematesFound.store(s->stalematesFound.load() + c->stalematesFound.load(memory_order_relaxed));
+        s->whiteWinsFound.store(s->whiteWinsFound.load() + c->whiteWinsFound.load(memory_order_relaxed));
+        s->blackWinsFound.store(s->blackWinsFound.load() + c->blackWinsFound.load(memory_order_relaxed));
+        s->normalsFound.store(s->normalsFound.load() + c->normalsFound.load(memory_order_relaxed));
+        s->repetitionsFound.store(s->repetitionsFound.load() + c->repetitionsFound.load(memory_order_relaxed));
+        s->fiftyMoveDrawsFound.store(s->fiftyMoveDrawsFound.load() + c->fiftyMoveDrawsFound.load(memory_order_relaxed));
+        s->endgameHits.store(s->endgameHits.load() + c->endgameHits.load(memory_order_relaxed));
+        s->transpositionProbes.store(s->transpositionProbes.load() + c->transpositionProbes.load(memory_order_relaxed));
+        s->transpositionHits.store(s->transpositionHits.load() + c->transpositionHits.load(memory_order_relaxed));
+        s->transpositionMovesSaved.store(s->transpositionMovesSaved.load() + c->transpositionMovesSaved.load(memory_order_relaxed));
+        s->queueSize.store(s->queueSize.load() + c->queueSize.load(memory_order_relaxed));
+        s->stashSize.store(s->stashSize.load() + c->stashSize.load(memory_order_relaxed));
+        s->nodeSlotsUnused.store(s->nodeSlotsUnused.load() + c->nodeSlotsUnused.load(memory_order_relaxed));
+        s->moveSlotsUnused.store(s->moveSlotsUnused.load() + c->moveSlotsUnused.load(memory_order_relaxed));
+
+        long long runTime = c->runTime.load(memory_order_relaxed);
+        long long runStartTime = c->runStartTime.load(memory_order_relaxed);
+        if (runStartTime > 0) runTime += now - runStartTime;
+        s->runTime.store(s->runTime.load() + runTime);
+        if (runTime > 0) rate += (double)examined * 1000000000.0 / (double)runTime;
+
+        for (int j = 0; j < MAX_DEPTH; j++) {
+            s->nodesAddedDepth[j].store(s->nodesAddedDepth[j].load() + c->nodesAddedDepth[j].load(memory_order_relaxed));
+            s->nodesQueuedDepth[j].store(s->nodesQueuedDepth[j].load() + c->nodesQueuedDepth[j].load(memory_order_relaxed));
+            s->nodesExaminedDepth[j].store(s->nodesExaminedDepth[j].load() + c->nodesExaminedDepth[j].load(memory_order_relaxed));
+        }
+    }
+
+    calcExaminedPerSecond = (int)rate;
+    calcMaxDepth = 0;
+    for (int j = 0; j < MAX_DEPTH; j++) {
+        if (s->nodesAddedDepth[j].load() > 0) calcMaxDepth = j;
     }
-    */
 }
 
 // Empty the tree and queue of nodes.
@@ -2435,15 +5508,17 @@ void resetCalcStats() {
 void clearDataHeavy() {
 
     // Clear the tree.
-    clear(nodes);
+    freeLargeArray(&nodesMemory);
+    nodes = NULL;
     nodeCap.store(0);
     numNodes.store(0);
 
     // Clear the global moves.
-    clear(globalMoveFrom);
-    clear(globalMoveTo);
+    freeLargeArray(&globalMovesMemory);
+    globalMoves = NULL;
     globalMoveCap.store(0);
     globalMoveLength.store(0);
+    resetSlotBlocks();
 
     // Clear the node queue.
     clearQueueHeavy();
@@ -2455,6 +5530,7 @@ void clearDataLight() {
     // Clear the tree and global moves.
     numNodes.store(0);
     globalMoveLength.store(0);
+    resetSlotBlocks();
 
     // Clear the node queue.
     clearQueueLight();
@@ -2811,7 +5887,7 @@ bool isSemilegalMove(char* b, D* d, char moveFrom, char moveTo) {
 }
 
 // Check if the given move on the given board follows the piece moving rules and does not move into check.
-// Return 1 if legal or 0 if illegal.
+// Return 1 if legal or 0 if illegal. The given position and data are not changed.
 bool isLegalMove(char* b, D* d, char moveFrom, char moveTo) {
 
     char playerTurn = d->PLAYER_TURN;
@@ -2858,54 +5934,50 @@ bool isLegalMove(char* b, D* d, char moveFrom, char moveTo) {
         return 0;
     }
 
-    // Simulate moving any pieces involved in this move by creating a new position which will be freed.
-    char* B = (char*)calloc(64, 1);
-    for (int i = 0; i < 64; i++) {
-        B[i] = b[i];
-    }
-
-    char newPlayerTurn = 1 - playerTurn;
-    d->SQUARE_FROM = moveFrom;
-    d->SQUARE_TO = moveTo;
-    d->PLAYER_TURN = newPlayerTurn;
+    // Simulate moving any pieces involved in this move on a scratch copy of the position and data on the stack,
+    // so the given position and data are left unchanged.
+    char B[64];
+    memcpy(B, b, 64);
 
-    // Create a new data variable so we don't change the old one when making the move to check legality.
     D d0 = *d;
+    d0.SQUARE_FROM = moveFrom;
+    d0.SQUARE_TO = moveTo;
+    d0.PLAYER_TURN = 1 - playerTurn;
 
     playMoveDriver(B, &d0);
 
     char kingSquare = playerTurn == BLACK ? d0.bKING_SQUARE : d0.wKING_SQUARE;
-    bool notInCheck = kingNotInCheck(B, kingSquare, playerTurn);
+    return kingNotInCheck(B, kingSquare, playerTurn);
+}
+
+// Check count moves from moveFroms to moveTos on the same position and data, writing whether each is legal to legal.
+// Return the number of legal moves.
+int areLegalMoves(char* b, D* d, char* moveFroms, char* moveTos, int count, bool* legal) {
+    int numLegal = 0;
+    for (int i = 0; i < count; i++) {
+        legal[i] = isLegalMove(b, d, moveFroms[i], moveTos[i]);
+        numLegal += legal[i];
+    }
+    return numLegal;
+}
 
-    clear(B);
-    return notInCheck;
+#if !ENGINE_HEADLESS
+// Store the key of game position i, which is compared instead of its board and data to find repetitions.
+void storeHistoryKey(int i) {
+    historyKeys[i] = computePositionKey(history[i], historyD + i);
 }
 
 // Return true if the given state has occurred at least twice previously in the game history.
 bool checkThreefoldRepetition() {
 
     char count = 0;
+    unsigned long long key = historyKeys[gameLength - 1];
 
-    // Check every second game state (all previous states with same player's turn as now) for equality.
-    for (int i = gameLength - 3; i >= 0; i -= 2) {
-
-        // Check all board squares for equality.
-        bool equal = 1;
-        for (int j = 0; j < 64; j++) {
-            if (history[gameLength - 1][j] != history[i][j]) {
-                equal = 0; break;
-            }
-        }
-        if (equal) {
-            // Check only castling and en passant states.
-            D* di = historyD + i;
-            D* dl = historyD + gameLength - 1;
-            if (dl->wKINGSIDE_CASTLE != di->wKINGSIDE_CASTLE) continue;
-            if (dl->wQUEENSIDE_CASTLE != di->wQUEENSIDE_CASTLE) continue;
-            if (dl->bKINGSIDE_CASTLE != di->bKINGSIDE_CASTLE) continue;
-            if (dl->bQUEENSIDE_CASTLE != di->bQUEENSIDE_CASTLE) continue;
-            if (dl->EN_PASSANT_FILE != di->EN_PASSANT_FILE) continue;
-
+    // Check the key of every second game state (all previous states with same player's turn as now) since the last
+    // capture or pawn move, so at most 50 keys are compared however long the game is.
+    int first = gameLength - 1 - (historyD + gameLength - 1)->FIFTY_MOVE_COUNTER;
+    for (int i = gameLength - 3; i >= 0 && i >= first; i -= 2) {
+        if (historyKeys[i] == key) {
             count++;
             if (count >= 2) return 1;
         }
@@ -2916,46 +5988,34 @@ bool checkThreefoldRepetition() {
 // Setup the console to check if a key has been pressed.
 void startEvaluationInterruptDetector() {
     // Clear the past key presses
-    while (_kbhit()) {}
+    while (keyPressed()) {
+        readKey();
+    }
 }
 
 // Return true if the user has typed anything since the start of the evaluation.
 bool checkEvaluationInterruptDetector() {
     // Check if at least one key has been pressed since last interrupt check
-    bool result = _kbhit();
+    bool result = keyPressed();
 
     // Clear the other key presses
-    while (_kbhit()) {}
+    while (keyPressed()) {
+        readKey();
+    }
 
     return result;
 }
+#endif
 
-// Fill the evalBoards with zeroes.
+// Fill the piece-square table with zeroes.
 void fillEvalBoards0s() {
-    if (evalBoards == NULL) {
-        evalBoards = (double**)calloc(NUM_PIECES, sizeof(double*));
-        for (int i = 0; i < NUM_PIECES; i++) {
-            evalBoards[i] = (double*)calloc(64, 8);
-        }
-    }
-    else {
-        for (int i = 0; i < NUM_PIECES; i++) {
-            for (int j = 0; j < 64; j++) {
-                evalBoards[i][j] = 0.0;
-            }
-        }
+    for (int i = 0; i < NUM_PIECES * 64; i++) {
+        pieceSquareTable[i] = 0;
     }
 }
 
-// Fill the evalBoards with default values.
+// Fill the piece-square table with default values.
 void setupEvalBoards() {
-    if (evalBoards == NULL) {
-        evalBoards = (double**)calloc(NUM_PIECES, sizeof(double*));
-        for (int i = 0; i < NUM_PIECES; i++) {
-            evalBoards[i] = (double*)calloc(64, 8);
-        }
-    }
-
     for (int i = 0; i < NUM_PIECES; i++) {
         for (int j = 0; j < 64; j++) {
             int rowScore = i < 6 ? j / 8 : 7 - (j / 8);
@@ -2963,7 +6023,7 @@ void setupEvalBoards() {
 
             double placementScore = (double)(rowScore + colScore - 3) * pieceEdgeContribution[i];
 
-            evalBoards[i][j] = piecePointValues[i] + placementScore;
+            pieceSquareTable[i * 64 + j] = (short)lround((piecePointValues[i] + placementScore) * EVAL_SCALE);
         }
     }
 }
@@ -2979,34 +6039,26 @@ void randomizeEvalBoards() {
 }
 
 // Evaluate a position for time seconds given the global evaluation settings.
+// The clock is only checked every deadlineCheckInterval positions, which is far cheaper than examining them.
 // Return whether the evaluation was complete (rather than exceeding the time limit).
 bool evaluatePositionTimed(T* t, double time) {
 
-    struct timespec start;
-    timespec_get(&start, TIME_UTC);
-    long long s = start.tv_sec;
-    long long ns = start.tv_nsec;
+    long long deadline = clockNanoseconds() + (long long)(time * 1000000000.0);
 
     for (int i = 0;; i++) {
 
         // Checking if the thread has been asked to stop.
-        if (!(t->run.load())) {
+        if (!(t->run.load(memory_order_relaxed))) {
             return 0;
         }
 
-        // Checking if there are no more futures to evaluate.
-        if (t->futuresQueueSize == 0) return 1;
-
         // Checking if exceeding the time limit for this evaluation period.
-        struct timespec now;
-        timespec_get(&now, TIME_UTC);
-
-        long long diff = ((long long)now.tv_sec - s) * 1000000000ll + ((long long)now.tv_nsec - ns);
-        if ((double)diff >= time * 1000000000.0) {
-            return 0;
+        if (i >= deadlineCheckInterval) {
+            i = 0;
+            if (clockNanoseconds() >= deadline) return 0;
         }
 
-        if (examineNextPosition(t)) return 1;
+        if (expandNextPosition(t)) return 1;
     }
 
     return 0;
@@ -3023,37 +6075,37 @@ bool evaluatePositionReps(T* t, int reps) {
             return 0;
         }
 
-        // Checking if there are no more futures to evaluate.
-        if (t->futuresQueueSize == 0) return 1;
-
         // Checking if exceeding the position limit for this evaluation period.
         if (i >= reps) {
             return 0;
         }
 
-        if(examineNextPosition(t)) return 1;
+        if (expandNextPosition(t)) return 1;
     }
 
     return 0;
 }
 
-// Evaluate a position until the given thread is stopped.
+// Evaluate a position until the given thread is stopped or the evaluation deadline is reached.
+// The clock is only checked every deadlineCheckInterval positions, which is far cheaper than examining them.
 // Return whether the evaluation was complete (rather than being stopped).
 bool evaluatePositionInfinite(T* t) {
 
     for (int i = 0;; i++) {
 
         // Checking if the thread has been stopped.
-        if (!(t->run.load())) {
+        if (!(t->run.load(memory_order_relaxed))) {
             return 0;
         }
 
-        // Checking if there are no more futures to evaluate.
-        if (t->futuresQueueSize == 0) {
-            return 1;
+        // Checking if the deadline or the node limit is reached.
+        if (i >= deadlineCheckInterval) {
+            i = 0;
+            if (clockNanoseconds() >= evaluationDeadline.load(memory_order_relaxed)) return 0;
+            if (t->stats.nodesExamined.load(memory_order_relaxed) >= evaluationThreadNodeLimit) return 0;
         }
 
-        if (examineNextPosition(t)) return 1;
+        if (expandNextPosition(t)) return 1;
     }
 
     return 0;
@@ -3067,6 +6119,11 @@ bool setupEvaluation(char* b, D* d, bool multithread) {
     setupEvalBoards();
 
     clearDataLight();
+    rootProbeMove = NO_MOVE;
+    rootProbeSource = 0;
+
+    // Invalidate the transposition table entries of the previous evaluation.
+    transpositionGeneration++;
 
     // Clear all the threads.
     for (int i = 0; i < numThreads; i++) {
@@ -3076,10 +6133,14 @@ bool setupEvaluation(char* b, D* d, bool multithread) {
         for (int j = 0; j < 64; j++) {
             (t->cb)[j] = b[j];
         }
+        setupBitboards(t);
+        t->pathNodes[0] = 0;
+        t->pathDepth = 0;
     }
 
     // Construct the root node (nodes[0]) from the given data.
-    calcNumNodesAdded.fetch_add(1);
+    countStat(threads->stats.nodesAdded, 1);
+    countStat(threads->stats.nodesAddedDepth[0], 1);
     numNodes.fetch_add(1);
     nodes->wKINGSIDE_CASTLE = d->wKINGSIDE_CASTLE;
     nodes->wQUEENSIDE_CASTLE = d->wQUEENSIDE_CASTLE;
@@ -3089,8 +6150,7 @@ bool setupEvaluation(char* b, D* d, bool multithread) {
     nodes->FIFTY_MOVE_COUNTER = d->FIFTY_MOVE_COUNTER;
     nodes->wKING_SQUARE = d->wKING_SQUARE;
     nodes->bKING_SQUARE = d->bKING_SQUARE;
-    nodes->SQUARE_FROM = d->SQUARE_FROM;
-    nodes->SQUARE_TO = d->SQUARE_TO;
+    nodes->move = packMove(d->SQUARE_FROM, d->SQUARE_TO);
     nodes->PLAYER_TURN = d->PLAYER_TURN;
     nodes->GAME_STATE = d->GAME_STATE;
 
@@ -3099,11 +6159,29 @@ bool setupEvaluation(char* b, D* d, bool multithread) {
     nodes->childStartIndex = UNDEFINED;
     nodes->numMoves = UNDEFINED;
     nodes->moveStartIndex = UNDEFINED;
-    nodes->e.store(computeEval(b));
-    nodes->score = ROOT_SCORE;
+    nodes->depth = 0;
+    nodes->transpositionIndex = UNDEFINED;
+    nodeLinks[0].first.store(UNDEFINED);
+    nodeKeys[0] = computePositionKey(b, d);
+    nodes->e.store((EV)(threads->boardEval + kingPlacementEval(d->wKING_SQUARE, d->bKING_SQUARE, threads->boardPhase)) / EVAL_SCALE);
 
     // Get all moves from the root into the main thread's childPool and then into the node and global arrays.
-    examineAllSemilegalMoves(threads, 0);
+    examineAllSemilegalMoves(threads, 0, 1);
+    queueFuture(threads, 0, ROOT_SCORE);
+
+    // A root move from the tablebases or the opening book needs no search. Expand the root so the move has a node,
+    // then empty the queues so the threads stop as soon as they start.
+    if (nodes->numMoves > 0 && probeRoot(threads, nodes, b, d, globalMoves + nodes->moveStartIndex, nodes->numMoves)) {
+        threads->run.store(1);
+        evaluatePositionReps(threads, 1);
+        threads->run.store(0);
+#if USE_INCREMENTAL_BOARD
+        moveBoardToNode(threads, 0);
+#endif
+        clearQueueLight();
+        setupComplete = 1;
+        return 1;
+    }
 
     if (multithread) {
         // Run the main thread for a relatively short time.
@@ -3111,36 +6189,156 @@ bool setupEvaluation(char* b, D* d, bool multithread) {
         evaluatePositionReps(threads, numSeedReps);
         threads->run.store(0);
 
+        // Return the main thread's board to the root, which the root move strings are read from.
+#if USE_INCREMENTAL_BOARD
+        moveBoardToNode(threads, 0);
+#endif
+
         // Distribute the queued nodes in the main thread's queue equally among threads.
-        T* t = threads; // Main thread
-        int i = 1; // Start at first non-main thread.
-        while (t->futuresQueueSize != 0) {
-            int x = getFirstFuture(t);
-            addFutureQueue(threads + i, x);
-            i = (i % (numThreads - 1)) + 1; // Cycle threads from 1 to numThreads - 1.
+        redistributeFutures(INT_MAX);
+    }
+
+    setupComplete = 1;
+    return 1;
+}
+
+// Prepare to evaluate a position that may already be in the tree of the last evaluation (after the moves played since).
+// If it is, the tree is re-rooted at that node, keeping its subtree and queued nodes, instead of starting over.
+// Otherwise this is the same as setupEvaluation().
+bool setupEvaluationKeepingTree(char* b, D* d) {
+
+    if (!initComplete) return 0;
+    if (!setupComplete || numNodes.load() == 0) return setupEvaluation(b, d, 1);
+
+    // Find the node holding this position, which is usually one or two moves from the root.
+    unsigned long long key = computeZobristKey(b, d->PLAYER_TURN,
+        zobristStateKey(d->wKINGSIDE_CASTLE, d->wQUEENSIDE_CASTLE, d->bKINGSIDE_CASTLE, d->bQUEENSIDE_CASTLE, d->EN_PASSANT_FILE));
+    int r = probeTranspositionTable(key);
+    for (int i = 0; r == UNDEFINED && i < nodes->numChildren; i++) {
+        N* c = nodes + nodes->childStartIndex + i;
+        if (nodeKeys[nodes->childStartIndex + i] == key) r = nodes->childStartIndex + i;
+        for (int j = 0; r == UNDEFINED && j < c->numChildren; j++) {
+            if (nodeKeys[c->childStartIndex + j] == key) r = c->childStartIndex + j;
+        }
+    }
+    if (r != UNDEFINED && (nodes + r)->transpositionIndex != UNDEFINED) r = (nodes + r)->transpositionIndex;
+    if (r == UNDEFINED || r == 0 || (nodes + r)->numChildren == 0) return setupEvaluation(b, d, 1);
+
+    // Construct the new root board on all threads.
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        for (int j = 0; j < 64; j++) {
+            (t->cb)[j] = b[j];
         }
+        setupBitboards(t);
+    }
+
+    // A root probe hit needs none of the tree, so start over to play it (see setupEvaluation()).
+    N* newRoot = nodes + r;
+    MV* rootMoves = (MV*)calloc(newRoot->numChildren, sizeof(MV));
+    if (rootMoves == NULL) crash();
+    for (int i = 0; i < newRoot->numChildren; i++) {
+        rootMoves[i] = (nodes + newRoot->childStartIndex + i)->move;
+    }
+    bool probed = probeRoot(threads, newRoot, b, d, rootMoves, newRoot->numChildren);
+    clear(rootMoves);
+    if (probed) return setupEvaluation(b, d, 1);
+
+    setupComplete = 0;
+    resetCalcStats();
+
+    // Keep only the subtree of the new root.
+    int numN = numNodes.load();
+    if (numN > nodeCap.load()) numN = nodeCap.load();
+    int rootDepth = (nodes + r)->depth;
+    for (int i = 0; i < numN; i++) {
+        reclaimIndex[i] = UNDEFINED;
+    }
+    reclaimIndex[r] = 0;
+    for (int i = r; i < numN; i++) {
+        if (reclaimIndex[i] == UNDEFINED) continue;
+        N* n = nodes + i;
+        n->depth -= rootDepth;
+        for (int j = 0; j < n->numChildren; j++) {
+            reclaimIndex[n->childStartIndex + j] = 0;
+        }
+    }
+    compactTree(numN);
+
+    // The new root now holds the given position, with its own move and history data.
+    nodes->parentIndex = UNDEFINED;
+    nodes->FIFTY_MOVE_COUNTER = d->FIFTY_MOVE_COUNTER;
+    nodes->move = packMove(d->SQUARE_FROM, d->SQUARE_TO);
+    nodes->GAME_STATE = d->GAME_STATE;
+
+    // Distribute the queued nodes equally among the non-main threads again.
+    // The nodes are one move or more closer to the root now, so stashed nodes may be within the depth limit again.
+    int numQueued = 0;
+    for (int i = 0; i < numThreads; i++) {
+        numQueued += (threads + i)->futuresQueueSize + (threads + i)->stashLength;
     }
+    QE* queued = (QE*)calloc(numQueued > 0 ? numQueued : 1, sizeof(QE));
+    if (queued == NULL) crash();
+    getAllFutures(queued);
+    clearQueueLight();
+    for (int i = 0; i < numQueued; i++) {
+        queueFuture(threads + 1 + i % (numThreads - 1), queued[i].index, queued[i].score);
+    }
+    clear(queued);
 
     setupComplete = 1;
     return 1;
 }
 
+// Run the calling thread only on the given processor (wrapping around the number of processors).
+// Threads pin themselves before touching memory so their first pages are placed from the right processor.
+void pinCurrentThread(int processor) {
+    int numProcessors = (int)thread::hardware_concurrency();
+    if (numProcessors <= 0) return;
+    processor %= numProcessors;
+#if defined(_WIN32)
+    if (processor < 64) SetThreadAffinityMask(GetCurrentThread(), 1ull << processor);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(processor, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+#endif
+}
+
 // Function called with a thread until we close the thread (can persist over multiple position evaluations).
 void runThread(int id) {
-    
-    // Keep evaluating or waiting until init() is called and the threads are killed.
+    T* t = threads + id;
+    if (pinThreads) pinCurrentThread(id - 1);
+    unique_lock<mutex> lock(threadStateMutex);
+    numThreadsAlive.fetch_add(1);
+
+    // Keep evaluating or sleeping until init() is called and the threads are killed.
     while (1) {
-        if (!(threads[id].live.load())) break;
-        if (threads[id].run.load()) {
-            evaluatePositionInfinite(threads + id);
-        }
-        else {
-            if (threads[id].running.load()) {
-                threads[id].running.store(0);
-                numThreadsRunning.fetch_add(-1);
-            }
-        }
-    }
+        threadWakeCondition.wait(lock, [t] { return t->running.load() || !(t->live.load()); });
+        if (!(t->live.load())) break;
+
+        lock.unlock();
+        long long start = clockNanoseconds();
+        t->stats.runStartTime.store(start, memory_order_relaxed);
+        evaluatePositionInfinite(t);
+        t->stopTime = clockNanoseconds();
+        t->stats.runTime.store(t->stats.runTime.load(memory_order_relaxed) + t->stopTime - start, memory_order_relaxed);
+        t->stats.runStartTime.store(0, memory_order_relaxed);
+        lock.lock();
+
+        // Stop running until asked again, even if the evaluation ended by running out of positions.
+        t->running.store(0);
+        numThreadsRunning.fetch_add(-1);
+        threadStopCondition.notify_all();
+    }
+
+    if (t->running.load()) {
+        t->running.store(0);
+        numThreadsRunning.fetch_add(-1);
+    }
+    numThreadsAlive.fetch_add(-1);
+    threadStopCondition.notify_all();
 }
 
 // Copy and sort the choices of moves from the root node. Root must be created (nodes != 0) before calling this.
@@ -3172,33 +6370,134 @@ void getSortedChoices() {
 
         sortedMoves[j + 1] = n;
     }
+
+    // A move found by probing the root comes first whatever its eval.
+    for (int i = 1; i < numChoices && rootProbeMove != NO_MOVE; i++) {
+        if (sortedMoves[i]->move != rootProbeMove) continue;
+        N* n = sortedMoves[i];
+        for (int j = i; j > 0; j--) {
+            sortedMoves[j] = sortedMoves[j - 1];
+        }
+        sortedMoves[0] = n;
+        break;
+    }
 }
 
-// Master global evaluation function called after init() and setupEvaluation().
-bool evaluateStart() {
+// Ask the threads to stop and sleep until they all have.
+void pauseAllThreads() {
+    for (int i = 1; i < numThreads; i++) {
+        threads[i].run.store(0);
+    }
 
-    if (!setupComplete) return 0;
+    unique_lock<mutex> lock(threadStateMutex);
+    threadStopCondition.wait(lock, [] { return numThreadsRunning.load() == 0; });
+}
 
-    // Start running the threads.
-    numThreadsRunning.store(numThreads - 1);
+// Make a thread stop calculating temporarily.
+// Record how long after the request (or the deadline, if that was earlier) the last thread stopped in calcStopLatency.
+void stopAllThreads() {
+    long long now = clockNanoseconds();
+    long long deadline = evaluationDeadline.load();
+    stopRequestTime = deadline < now ? deadline : now;
+
+    pauseAllThreads();
+
+    long long lastStop = stopRequestTime;
     for (int i = 1; i < numThreads; i++) {
-        threads[i].run.store(1);
-        threads[i].running.store(1);
+        if (threads[i].stopTime > lastStop) lastStop = threads[i].stopTime;
+    }
+    calcStopLatency.store((int)((lastStop - stopRequestTime) / 1000));
+
+#if ENGINE_DEBUG_VERIFY
+    verifyTreeEvals();
+#endif
+}
+
+// Run the threads, which stop themselves at the given clock time (see clockNanoseconds()).
+void runAllThreadsUntil(long long deadline) {
+
+    evaluationDeadline.store(deadline);
+
+    // Start running the threads that are not already running and wake them.
+    {
+        lock_guard<mutex> lock(threadStateMutex);
+        for (int i = 1; i < numThreads; i++) {
+            threads[i].run.store(1);
+            if (!(threads[i].running.load())) {
+                threads[i].running.store(1);
+                numThreadsRunning.fetch_add(1);
+            }
+        }
     }
+    threadWakeCondition.notify_all();
+}
+
+// Start the threads, which stop themselves at the given clock time (see clockNanoseconds()).
+bool evaluateStartUntil(long long deadline) {
+
+    if (!setupComplete) return 0;
+
+    evaluationStarted = 1;
+    runAllThreadsUntil(deadline);
 
     return 1;
 }
 
-// Master global evaluation function called after init() and setupEvaluation().
-bool evaluateStop() {
+// Evaluations started with evaluateStart() have no loop waiting for them, so a coordinator thread pauses the threads
+// every redistributionInterval seconds to even out their queues, like evaluateTime() does, until the evaluation stops.
+thread redistributionThread;
+mutex redistributionMutex;
+condition_variable redistributionCondition; // Notified when redistributing stops, with redistributionMutex.
+bool redistributionRunning = 0;
+
+// Redistribute the best size queued nodes of each thread every interval nanoseconds until redistributing stops.
+// Nothing is done while every thread has stopped on its own, as there is nothing left to redistribute.
+void runRedistributionThread(long long interval, int size) {
+    unique_lock<mutex> lock(redistributionMutex);
+    while (1) {
+        redistributionCondition.wait_for(lock, chrono::nanoseconds(interval), [] { return !redistributionRunning; });
+        if (!redistributionRunning) break;
+        if (numThreadsRunning.load() == 0) continue;
+        pauseAllThreads();
+        redistributeFutures(size);
+        runAllThreadsUntil(evaluationDeadline.load());
+    }
+}
 
-    // Stop running the threads.
-    for (int i = 1; i < numThreads; i++) {
-        threads[i].run.store(0);
+// Stop redistributing, waiting until any redistribution in progress is done. Return whether it was redistributing.
+bool stopRedistributionThread() {
+    {
+        lock_guard<mutex> lock(redistributionMutex);
+        redistributionRunning = 0;
     }
+    redistributionCondition.notify_all();
+    if (!redistributionThread.joinable()) return 0;
+    redistributionThread.join();
+    return 1;
+}
+
+// Start redistributing if there is an interval set.
+void startRedistributionThread() {
+    stopRedistributionThread();
+    if (redistributionInterval <= 0) return;
+    redistributionRunning = 1;
+    redistributionThread = thread(runRedistributionThread, (long long)(redistributionInterval * 1000000000.0), redistributionSize);
+}
+
+// Master global evaluation function called after init() and setupEvaluation().
+// The threads run until evaluateStop(), with their queues redistributed every redistributionInterval seconds.
+bool evaluateStart() {
+    if (!evaluateStartUntil(LLONG_MAX)) return 0;
+    startRedistributionThread();
+    return 1;
+}
+
+// Master global evaluation function called after init() and setupEvaluation().
+bool evaluateStop() {
 
-    // Wait for all of them to stop here so we don't call a different function at this time.
-    while (numThreadsRunning.load() != 0) {}
+    stopRedistributionThread();
+    stopAllThreads();
+    evaluationStarted = 0;
 
     getSortedChoices(); // This will get called at the end of every evaluation.
 
@@ -3207,23 +6506,27 @@ bool evaluateStop() {
 
 // Master global evaluation function called after init() and setupEvaluation().
 bool evaluateTime(double t) {
-    evaluateStart();
-    if (!setupComplete) return 0;
+    stopRedistributionThread();
+    long long deadline = clockNanoseconds() + (long long)(t * 1000000000.0);
+    if (!evaluateStartUntil(deadline)) return 0;
 
-    struct timespec start;
-    timespec_get(&start, TIME_UTC);
-    long long s = start.tv_sec;
-    long long ns = start.tv_nsec;
-
-    // Wait until time.
-    struct timespec now;
+    // Sleep until the time is reached or all threads have stopped on their own (at the deadline or out of positions),
+    // pausing the threads every redistributionInterval seconds to even out their queues.
+    long long interval = (long long)(redistributionInterval * 1000000000.0);
     while (1) {
-        timespec_get(&now, TIME_UTC);
+        long long now = clockNanoseconds();
+        long long wake = interval > 0 && deadline - now > interval ? now + interval : deadline;
 
-        long long diff = ((long long)now.tv_sec - s) * 1000000000ll + ((long long)now.tv_nsec - ns);
-        if ((double)diff >= t * 1000000000.0) {
-            break;
+        bool stopped;
+        {
+            unique_lock<mutex> lock(threadStateMutex);
+            stopped = threadStopCondition.wait_for(lock, chrono::nanoseconds(wake - now), [] { return numThreadsRunning.load() == 0; });
         }
+        if (stopped || wake == deadline) break;
+
+        pauseAllThreads();
+        redistributeFutures(redistributionSize);
+        evaluateStartUntil(deadline);
     }
 
     evaluateStop();
@@ -3231,18 +6534,53 @@ bool evaluateTime(double t) {
     return 1;
 }
 
+// Change evaluationDepthLimit, queueing the stashed nodes that are within the new limit on the non-main threads.
+// Nodes that are already queued stay queued if the limit is lowered. During an evaluation, the threads are paused while
+// this is done and then run again, including any that had stopped after running out of nodes within the old limit.
+bool setEvaluationDepthLimit(int limit) {
+    if (limit < 0) return 0;
+
+    bool running = evaluationStarted;
+    bool redistributing = stopRedistributionThread();
+    if (running) pauseAllThreads();
+
+    evaluationDepthLimit = limit;
+    int k = 0;
+    for (int i = 0; i < numThreads; i++) {
+        T* t = threads + i;
+        QE* st = t->stash;
+        int l = 0;
+        for (int j = 0; j < t->stashLength; j++) {
+            if ((nodes + st[j].index)->depth <= limit) {
+                addFutureQueue(threads + 1 + k++ % (numThreads - 1), st[j].index, st[j].score);
+            }
+            else {
+                st[l++] = st[j];
+            }
+        }
+        t->stashLength = l;
+    }
+
+    if (running) evaluateStartUntil(evaluationDeadline.load());
+    if (redistributing) startRedistributionThread();
+    return 1;
+}
+
 // End the thread function for each thread.
 void killAllThreads() {
+    stopRedistributionThread();
 
-    // Ask the threads to stop.
-    for (int i = 1; i < numThreads; i++) {
-        threads[i].live.store(0);
-        threads[i].run.store(0);
+    // Ask the threads to stop and wake them so they can end.
+    {
+        lock_guard<mutex> lock(threadStateMutex);
+        for (int i = 1; i < numThreads; i++) {
+            threads[i].live.store(0);
+            threads[i].run.store(0);
+        }
     }
+    threadWakeCondition.notify_all();
 
-    // Wait until all threads have stopped.
-    while (numThreadsAlive.load() > 0) {}
-
+    // Wait until all threads have ended.
     for (int i = 1; i < numThreads; i++) {
         if (threads[i].thr.joinable()) {
             threads[i].thr.join();
@@ -3250,21 +6588,43 @@ void killAllThreads() {
     }
 }
 
-// Make a thread stop calculating temporarily.
-void stopAllThreads() {
-    // Ask the threads to stop.
-    for (int i = 1; i < numThreads; i++) {
-        threads[i].run.store(0);
+// Touch every page of the large arrays so the system commits them now rather than when the search first writes to them.
+// Each calculating thread's processor touches an equal stripe of each array (pinned like the threads if pinThreads), so on a
+// machine with several memory nodes the pages are interleaved across the nodes. This is not a per-thread placement: nodes
+// and moves are handed out in shared blocks off the global counters, so a thread's nodes do not sit in its own stripe.
+// The setup thread that calls init() and seeds the tree is the app's thread and is never pinned.
+void prefaultLargeArrays() {
+    LA* arrays[] = { &nodesMemory, &nodeKeysMemory, &nodeLinksMemory, &reclaimIndexMemory, &globalMovesMemory };
+    int numArrays = sizeof(arrays) / sizeof(arrays[0]);
+    int numParts = numThreads > 1 ? numThreads - 1 : 1;
+
+    thread* touchers = new thread[numParts];
+    for (int i = 0; i < numParts; i++) {
+        touchers[i] = thread([arrays, numArrays, i, numParts] {
+            if (pinThreads) pinCurrentThread(i);
+            for (int j = 0; j < numArrays; j++) {
+                char* m = (char*)(arrays[j]->memory);
+                size_t size = arrays[j]->size;
+                size_t start = size / numParts * i;
+                size_t end = i == numParts - 1 ? size : size / numParts * (i + 1);
+                for (size_t k = start; k < end; k += SMALL_PAGE_SIZE) {
+                    m[k] = 0;
+                }
+            }
+        });
     }
-
-    // Wait until all threads have stopped.
-    while (numThreadsRunning.load() > 0) {}
+    for (int i = 0; i < numParts; i++) {
+        touchers[i].join();
+    }
+    delete[] touchers;
 }
 
 // Initialize the engine by configuring settings and allocating position memory.
 // This must be called at the start of this application and when other apps run this app.
 // Can also be called during and between position examinations to change the memory allowed and number of threads.
-// totalNumNodesAllowed should be moderately large (suggested: 10 million) as we use sizeof(N) + sizeof(int) = 48 + 4 = 52 bytes per move.
+// totalNumNodesAllowed should be moderately large (suggested: 10 million) as we use sizeof(N) = 32 (40 without USE_FLOAT_EVALS) bytes
+// per node, plus 8 for its key, 8 for its list of linked nodes (sizeof(NL)), 4 for reclaiming memory, 4 in the transposition
+// table, and sizeof(QE) = 8 in the queues.
 // totalNumMovesAllowed should be very large (suggested: 400 million) as we use 2 bytes per move.
 bool init(int totalNumNodesAllowed, int totalNumMovesAllowed, int threadCount, int seedRepsCount) {
 
@@ -3291,62 +6651,282 @@ bool init(int totalNumNodesAllowed, int totalNumMovesAllowed, int threadCount, i
     for (int i = 0; i < numThreads; i++) {
         T* t = threads + i;
 
-        // Allocate memory in the queue while making it empty.
-        #if USE_SCORE_BUCKETS
-            // Ensure the first bucket insertion sets the new lowest bucket index.
-            t->lowestBucketIndex = INT_MAX;
-
-            // Allocate memory in the bucket list while making it empty.
-            if (t->buckets == NULL) {
-                t->buckets = (int**)calloc(numBuckets, sizeof(int*));
-                t->bucketCap = (int*)calloc(numBuckets, 4);
-                t->bucketLength = (int*)calloc(numBuckets, 4);
-            }
+        // Allocate memory in the queue while making it empty. The other kind of queue is allocated if it is switched to.
+        if (queueType == QUEUE_BUCKETS) {
+            allocateBuckets(t);
             int bucketSize = queueSizePerThread / numBuckets;
-            int** b = t->buckets;
+            QE** b = t->buckets;
             int* bc = t->bucketCap;
             for (int j = 0; j < numBuckets; j++) {
-                b[j] = (int*)realloc(b[j], bucketSize * 4); // Assume buckets are equally used and all nodes can be in the queue at once.
+                b[j] = (QE*)realloc(b[j], bucketSize * sizeof(QE)); // Assume buckets are equally used and all nodes can be in the queue at once.
                 bc[j] = bucketSize;
             }
-        #else
-            // Allocate memory in the heap while making it empty.
-            t->futuresHeap = (int*)realloc(t->futuresHeap, queueSizePerThread * 4);
-            t->futuresHeapCap = queueSizePerThread;
-        #endif
+        }
+        else {
+            resizeFuturesHeap(t, queueSizePerThread);
+        }
 
         // No need to set anything in those nodes.
 
         // Allocate the thread's child pool.
-        t->childFroms = (char*)realloc(t->childFroms, LEGAL_MOVES_UPPER_BOUND);
-        t->childTos = (char*)realloc(t->childTos, LEGAL_MOVES_UPPER_BOUND);
-        t->childEvals = (double*)realloc(t->childEvals, LEGAL_MOVES_UPPER_BOUND * 8);
+        t->childMoves = (MV*)realloc(t->childMoves, LEGAL_MOVES_UPPER_BOUND * sizeof(MV));
+        t->childEvals = (int*)realloc(t->childEvals, LEGAL_MOVES_UPPER_BOUND * sizeof(int));
         t->childPoolCap = LEGAL_MOVES_UPPER_BOUND;
         t->childPoolLength = 0;
 
         // Allocate moves.
         t->moves = (M*)realloc(t->moves, sizeof(M) * MAX_DEPTH);
+        t->pathNodes = (int*)realloc(t->pathNodes, MAX_DEPTH * 4);
+        t->pathReplay = (int*)realloc(t->pathReplay, MAX_DEPTH * 4);
+        t->pathDepth = 0;
+
+#if ENGINE_PROFILE
+        t->profile.trace = (PE*)realloc(t->profile.trace, PROFILE_TRACE_CAP * sizeof(PE));
+        if (t->profile.trace == NULL) crash();
+#endif
     }
 
-    // Allocate global nodes.
-    nodes = (N*)realloc(nodes, totalNumNodesAllowed * sizeof(N));
+    // Allocate global nodes, their keys and lists of linked nodes, and the renumbering used when reclaiming them.
+    nodes = (N*)allocateLargeArray(&nodesMemory, (size_t)totalNumNodesAllowed * sizeof(N));
+    nodeKeys = (unsigned long long*)allocateLargeArray(&nodeKeysMemory, (size_t)totalNumNodesAllowed * 8);
+    nodeLinks = (NL*)allocateLargeArray(&nodeLinksMemory, (size_t)totalNumNodesAllowed * sizeof(NL));
+    reclaimIndex = (int*)allocateLargeArray(&reclaimIndexMemory, (size_t)totalNumNodesAllowed * 4);
     numNodes.store(0);
     nodeCap.store(totalNumNodesAllowed);
 
     // Allocate global moves.
-    globalMoveFrom = (char*)realloc(globalMoveFrom, totalNumMovesAllowed);
-    globalMoveTo = (char*)realloc(globalMoveTo, totalNumMovesAllowed);
+    globalMoves = (MV*)allocateLargeArray(&globalMovesMemory, (size_t)totalNumMovesAllowed * sizeof(MV));
     globalMoveLength.store(0);
     globalMoveCap.store(totalNumMovesAllowed);
+    if (prefaultMemory) prefaultLargeArrays();
+
+    // Allocate the transposition table with the largest power of two size that is at most half the number of nodes.
+    int transpositionTableSize = 1;
+    while (transpositionTableSize <= totalNumNodesAllowed / 4) transpositionTableSize *= 2;
+    transpositionTable = (TE*)realloc(transpositionTable, transpositionTableSize * sizeof(TE));
+    if (transpositionTable == NULL) crash();
+    transpositionTableMask = transpositionTableSize - 1;
+    for (int i = 0; i < transpositionTableSize; i++) {
+        transpositionTable[i].check.store(0);
+        transpositionTable[i].data.store(0);
+    }
+
+    // Start all threads.
+    for (int i = 1; i < numThreads; i++) {
+        threads[i].live.store(1);
+        threads[i].thr = thread(runThread, i);
+    }
+
+    initComplete = 1;
+    return 1;
+}
+
+// Perft threads count the leaf positions of the legal move tree with their own boards, separately from the node tree.
+T* perftThreads;
+int numPerftThreads = 0;
+N* perftPositions; // MAX_DEPTH + 1 positions per perft thread, one for each ply of the current line.
+
+// The legal root moves, which the perft threads take one at a time.
+MV perftRootMoves[LEGAL_MOVES_UPPER_BOUND];
+long long perftRootCounts[LEGAL_MOVES_UPPER_BOUND];
+int perftNumRootMoves = 0;
+atomic<int> perftNextRootMove;
+
+// Copy the legal moves of position n found by the selected move generator into moves.
+// Return the number of moves.
+int findPerftMoves(T* t, N* n, MV* moves) {
+    t->childPoolLength = 0;
+#if USE_BITBOARD_MOVEGEN
+    examineAllMovesBitboard(t, n);
+#else
+    examineAllMovesMailbox(t, n);
+    removeIllegalMoves(t, n);
+#endif
+
+    int l = t->childPoolLength;
+    for (int i = 0; i < l; i++) {
+        moves[i] = (t->childMoves)[i];
+    }
+    return l;
+}
+
+// Play a move of position n on the thread's board, setting up position c as the position after the move.
+// The move is stored in m for undoing. Return whether the move is legal (does not leave the mover's king attacked),
+// which is only false if a move generator is wrong.
+bool playPerftMove(T* t, N* n, N* c, MV move, M* m) {
+    char* b = t->cb;
+
+    c->wKINGSIDE_CASTLE = n->wKINGSIDE_CASTLE;
+    c->wQUEENSIDE_CASTLE = n->wQUEENSIDE_CASTLE;
+    c->bKINGSIDE_CASTLE = n->bKINGSIDE_CASTLE;
+    c->bQUEENSIDE_CASTLE = n->bQUEENSIDE_CASTLE;
+    c->EN_PASSANT_FILE = n->EN_PASSANT_FILE;
+    c->FIFTY_MOVE_COUNTER = n->FIFTY_MOVE_COUNTER;
+    c->wKING_SQUARE = n->wKING_SQUARE;
+    c->bKING_SQUARE = n->bKING_SQUARE;
+    c->move = move;
+    c->PLAYER_TURN = 1 - n->PLAYER_TURN;
+    c->GAME_STATE = NORMAL;
+    c->depth = n->depth + 1;
+
+    // Perft does not use the key of the position.
+    unsigned long long key = 0;
+    loadNodeMove(m, c);
+    m->mover = b[m->f];
+    m->captured = b[m->t];
+    m->enPassantSquare = playMoveUpdating(b, c, &key);
+    syncBitboards(t, m);
+
+    bool isBlack = n->PLAYER_TURN == BLACK;
+    bool legal = kingNotInCheck(b, isBlack ? c->bKING_SQUARE : c->wKING_SQUARE, isBlack);
+
+#if ENGINE_DEBUG_VERIFY
+    // Check the generator and board legality check against the driver's legality check of the same move.
+    char B[64];
+    for (int i = 0; i < 64; i++) {
+        B[i] = b[i];
+    }
+    undoMove(t, m);
+    D d = {
+        (char)n->wKINGSIDE_CASTLE, (char)n->wQUEENSIDE_CASTLE, (char)n->bKINGSIDE_CASTLE, (char)n->bQUEENSIDE_CASTLE, n->EN_PASSANT_FILE,
+        n->FIFTY_MOVE_COUNTER, (char)n->wKING_SQUARE, (char)n->bKING_SQUARE, moveCodeFrom(n->move), moveCode(n->move), n->PLAYER_TURN, (char)n->GAME_STATE
+    };
+    char moveFrom = moveCodeFrom(move), moveTo = moveCode(move);
+    if (isLegalMove(b, &d, moveFrom, moveTo) != legal) {
+        printf("Perft ply %i: move %i -> %i is %s but isLegalMove() disagrees.\n", n->depth, moveFrom, moveTo, legal ? "legal" : "illegal");
+    }
+    if (!legal) {
+        printf("Perft ply %i: the move generator made the illegal move %i -> %i.\n", n->depth, moveFrom, moveTo);
+    }
+    for (int i = 0; i < 64; i++) {
+        b[i] = B[i];
+    }
+    syncBitboards(t, m);
+#endif
+
+    return legal;
+}
+
+// Return the number of leaf positions depth moves after position n on the thread's board.
+// The position after each move is set up in the position after n in memory.
+long long perft(T* t, N* n, int depth) {
+    MV moves[LEGAL_MOVES_UPPER_BOUND];
+    int l = findPerftMoves(t, n, moves);
+
+#if !ENGINE_DEBUG_VERIFY
+    // The moves are all legal, so the last ply only counts them. The checked build plays them to check them.
+    if (depth == 1) return l;
+#endif
+
+    N* c = n + 1;
+    M* m = t->moves + n->depth;
+    long long count = 0;
+    for (int i = 0; i < l; i++) {
+        if (playPerftMove(t, n, c, moves[i], m)) {
+            count += depth > 1 ? perft(t, c, depth - 1) : 1;
+        }
+        undoMove(t, m);
+    }
+    return count;
+}
+
+// Function called with a perft thread to count the leaves below the root moves it takes until none are left.
+void runPerftThread(int id, int depth) {
+    T* t = perftThreads + id;
+    N* n = perftPositions + id * (MAX_DEPTH + 1);
+
+    while (1) {
+        int i = perftNextRootMove.fetch_add(1);
+        if (i >= perftNumRootMoves) break;
+
+        M* m = t->moves;
+        playPerftMove(t, n, n + 1, perftRootMoves[i], m);
+        perftRootCounts[i] = depth > 1 ? perft(t, n + 1, depth - 1) : 1;
+        undoMove(t, m);
+    }
+}
+
+// Count the leaf positions of the legal move tree of the given position to the given depth (perft).
+// The legal root moves are shared between threadCount threads, including the calling thread.
+// The root moves and their leaf counts are left in perftRootMoves and perftRootCounts.
+// Return the number of leaves or -1 if the parameters are invalid.
+long long runPerft(char* b, D* d, int depth, int threadCount) {
+    if (depth < 0 || depth >= MAX_DEPTH || threadCount < 1 || threadCount > 100) return -1;
+
+    // Allocate the perft threads the first time they are needed.
+    if (perftThreads == NULL) {
+        perftThreads = (T*)calloc(100, sizeof(T));
+        if (perftThreads == NULL) crash();
+    }
+    if (threadCount > numPerftThreads) {
+        perftPositions = (N*)realloc(perftPositions, threadCount * (MAX_DEPTH + 1) * sizeof(N));
+        if (perftPositions == NULL) crash();
+
+        for (int i = numPerftThreads; i < threadCount; i++) {
+            T* t = perftThreads + i;
+            t->childMoves = (MV*)calloc(LEGAL_MOVES_UPPER_BOUND, sizeof(MV));
+            t->childEvals = (int*)calloc(LEGAL_MOVES_UPPER_BOUND, sizeof(int));
+            t->childPoolCap = LEGAL_MOVES_UPPER_BOUND;
+            t->moves = (M*)calloc(MAX_DEPTH, sizeof(M));
+            if (t->childMoves == NULL || t->childEvals == NULL || t->moves == NULL) crash();
+        }
+        numPerftThreads = threadCount;
+    }
+
+    // Set up the root position and board of every thread.
+    for (int i = 0; i < threadCount; i++) {
+        T* t = perftThreads + i;
+        for (int j = 0; j < 64; j++) {
+            (t->cb)[j] = b[j];
+        }
+        setupBitboards(t);
+
+        N* n = perftPositions + i * (MAX_DEPTH + 1);
+        n->wKINGSIDE_CASTLE = d->wKINGSIDE_CASTLE;
+        n->wQUEENSIDE_CASTLE = d->wQUEENSIDE_CASTLE;
+        n->bKINGSIDE_CASTLE = d->bKINGSIDE_CASTLE;
+        n->bQUEENSIDE_CASTLE = d->bQUEENSIDE_CASTLE;
+        n->EN_PASSANT_FILE = d->EN_PASSANT_FILE;
+        n->FIFTY_MOVE_COUNTER = d->FIFTY_MOVE_COUNTER;
+        n->wKING_SQUARE = d->wKING_SQUARE;
+        n->bKING_SQUARE = d->bKING_SQUARE;
+        n->move = packMove(d->SQUARE_FROM, d->SQUARE_TO);
+        n->PLAYER_TURN = d->PLAYER_TURN;
+        n->GAME_STATE = d->GAME_STATE;
+        n->depth = 0;
+    }
 
-    // Start all threads.
-    for (int i = 1; i < numThreads; i++) {
-        threads[i].live.store(1);
-        threads[i].thr = thread(runThread, i);
+    perftNumRootMoves = 0;
+    if (depth == 0) return 1;
+
+    // Find the legal root moves on the first thread.
+    T* t = perftThreads;
+    N* n = perftPositions;
+    MV moves[LEGAL_MOVES_UPPER_BOUND];
+    int l = findPerftMoves(t, n, moves);
+    for (int i = 0; i < l; i++) {
+        if (playPerftMove(t, n, n + 1, moves[i], t->moves)) {
+            perftRootMoves[perftNumRootMoves] = moves[i];
+            perftNumRootMoves++;
+        }
+        undoMove(t, t->moves);
     }
 
-    initComplete = 1;
-    return 1;
+    // Count the leaves below the root moves on all threads.
+    perftNextRootMove.store(0);
+    for (int i = 1; i < threadCount; i++) {
+        perftThreads[i].thr = thread(runPerftThread, i, depth);
+    }
+    runPerftThread(0, depth);
+    for (int i = 1; i < threadCount; i++) {
+        perftThreads[i].thr.join();
+    }
+
+    long long count = 0;
+    for (int i = 0; i < perftNumRootMoves; i++) {
+        count += perftRootCounts[i];
+    }
+    return count;
 }
 
 // Read a string from console.
@@ -3359,6 +6939,12 @@ void getLine() {
 
         char* r = fgets(inLine, MAX_LINE_SIZE, stdin);
 
+        // The end of the input (such as a closed pipe) reads as a blank line, which leaves the UI and the input checker.
+        if (r == NULL && feof(stdin)) {
+            inLine[0] = '\n';
+            return;
+        }
+
         if (r == NULL) {
             printf("Enter a valid string of characters with length 0-%i: ", MAX_LINE_SIZE);
         }
@@ -3376,6 +6962,7 @@ bool isNumeric(char c) {
     return c >= '0' && c <= '9';
 }
 
+#if !ENGINE_HEADLESS
 // Read and return a char from console.
 // Return \n if given a blank line.
 char getChar() {
@@ -3513,8 +7100,9 @@ void updateKeys() {
         keyCurr[i] = 0;
     }
 
-    while (_kbhit()) {
-        int ch = _getch();
+    while (keyPressed()) {
+        int ch = readKey();
+        if (ch < 0) break;
         printf("%c", ch);
         keyCurr[ch] = 1;
     }
@@ -3576,6 +7164,7 @@ char getPieceMoving(char* b, D* d, char piece, char t, char row, char col, bool
 
     return -127;
 }
+#endif
 
 // Get the square for a square index in human-readable format.
 char* getSquareHuman(char x) {
@@ -3619,8 +7208,8 @@ char* moveToString(int i) {
 
     N* n = sortedMoves[i];
     char* b = threads->cb;
-    char f = n->SQUARE_FROM;
-    char t = n->SQUARE_TO;
+    char f = moveCodeFrom(n->move);
+    char t = moveCode(n->move); // in the driver's encoding
     char p = b[f];
     
     char* o;
@@ -3722,6 +7311,8 @@ char* moveToString(int i) {
     o[l - 1] = '\0';
     return o;
 }
+
+#if !ENGINE_HEADLESS
 // Get the encoded promotion square given the promotion column and the type being promoted to.
 char getPromotionSquareCode(char col, char type) {
     if (type >= 7 && type <= 11) {
@@ -4024,7 +7615,7 @@ int chooseMove(int difficulty) {
     }
 
     // Get the 0-indexed choice.
-    return (int)(random() % (unsigned long long)numActualChoices);
+    return (int)(nextRandom() % (unsigned long long)numActualChoices);
 }
 
 // SQUARE_FROM, SQUARE_TO, and PLAYER_TURN must be set.
@@ -4034,6 +7625,7 @@ bool playAndCheckEndOfGame() {
 
     D* ld = historyD + gameLength - 1;
     playMoveDriver(history[gameLength - 1], ld);
+    storeHistoryKey(gameLength - 1);
 
     char newPlayerTurn = ld->PLAYER_TURN;
 
@@ -4117,6 +7709,7 @@ bool checkDraws() {
 
     return 0;
 }
+#endif
 
 // Set the xth square in the FEN code order to piece on the board. Return the board square.
 char setFENBoard(char* b, int x, char piece) {
@@ -4125,33 +7718,34 @@ char setFENBoard(char* b, int x, char piece) {
     return square;
 }
 
-// Get input and parse the FEN code stored in inLine and return 1 if valid.
+// Parse the FEN code in the line s and return 1 if valid, printing why it is invalid if printErrors is 1.
 // Must handle empty line case (returns 0) outside this function.
 // Parameters must be the allocated board and data, which get cleared and replaced with the FEN data.
-bool parseFEN(char* b, D* d) {
-    getLine();
+// The castling, en passant, and halfmove clock fields are optional; missing castling rights are assumed
+// from the king and rook positions.
+bool parseFEN(char* s, char* b, D* d, bool printErrors) {
 
-    if (inLine[0] == '\n' || inLine[0] == '\0') {
+    if (s[0] == '\n' || s[0] == '\0') {
         return 0;
     }
 
     int l = -1;
     for (int i = 1; i < MAX_LINE_SIZE; i++) {
-        if (inLine[i] == '\n' || inLine[i] == '\0') {
+        if (s[i] == '\n' || s[i] == '\0') {
             l = i;
             break;
         }
     }
     if (l == -1) {
-        printf("FEN code must be a valid string with length less than %i.\n", MAX_LINE_SIZE);
+        if (printErrors) printf("FEN code must be a valid string with length less than %i.\n", MAX_LINE_SIZE);
         return 0;
     }
     else if (l < 15) {
-        printf("FEN code must be at least 15 characters long.\n");
+        if (printErrors) printf("FEN code must be at least 15 characters long.\n");
         return 0;
     }
     else if (l > 99) {
-        printf("FEN code must be at most 99 characters long.\n");
+        if (printErrors) printf("FEN code must be at most 99 characters long.\n");
         return 0;
     }
 
@@ -4173,11 +7767,11 @@ bool parseFEN(char* b, D* d) {
     int pos = 0;
     for (;; pos++) {
         if (x >= 64) break;
-        switch (inLine[pos]) {
+        switch (s[pos]) {
 
         case '\n':
         case '\0':
-            printf("FEN code ended early at board square %i.\n", x);
+            if (printErrors) printf("FEN code ended early at board square %i.\n", x);
             return 0;
 
         case 'P':
@@ -4222,19 +7816,19 @@ bool parseFEN(char* b, D* d) {
 
         default:
             // Numbers indicate that many empty consecutive board spaces.
-            if (inLine[pos] >= '0' && inLine[pos] <= '8') {
-                int c = inLine[pos] - '0';
+            if (s[pos] >= '0' && s[pos] <= '8') {
+                int c = s[pos] - '0';
                 x += c;
             }
         }
     }
 
     if (numWhiteKings != 1) {
-        printf("Number of white kings (K) in FEN code must be 1 and is %i.\n", numWhiteKings);
+        if (printErrors) printf("Number of white kings (K) in FEN code must be 1 and is %i.\n", numWhiteKings);
         return 0;
     }
     if (numBlackKings != 1) {
-        printf("Number of black kings (k) in FEN code must be 1 and is %i.\n", numBlackKings);
+        if (printErrors) printf("Number of black kings (k) in FEN code must be 1 and is %i.\n", numBlackKings);
         return 0;
     }
 
@@ -4242,10 +7836,10 @@ bool parseFEN(char* b, D* d) {
     while (1) {
         bool flag = 0;
 
-        switch (inLine[pos]) {
+        switch (s[pos]) {
             case '\n':
             case '\0':
-                printf("FEN code ended early at player turn indicator.\n");
+                if (printErrors) printf("FEN code ended early at player turn indicator.\n");
                 return 0;
             case 'w':
             case 'W':
@@ -4264,27 +7858,173 @@ bool parseFEN(char* b, D* d) {
     }
 
 
-    // Assume we can castle if kings and rooks are in the right positions.
-    if (b[4] == wKING) {
-        if (b[0] == wROOK) d->wQUEENSIDE_CASTLE = 1;
-        if (b[7] == wROOK) d->wKINGSIDE_CASTLE = 1;
+    // Read the castling field, or assume we can castle if kings and rooks are in the right positions.
+    while (s[pos] == ' ') pos++;
+    bool wk = 1, wq = 1, bk = 1, bq = 1;
+    if (s[pos] == '-' || s[pos] == 'K' || s[pos] == 'Q' || s[pos] == 'k' || s[pos] == 'q') {
+        wk = 0; wq = 0; bk = 0; bq = 0;
+        for (; s[pos] != ' ' && s[pos] != '\n' && s[pos] != '\0'; pos++) {
+            if (s[pos] == 'K') wk = 1;
+            if (s[pos] == 'Q') wq = 1;
+            if (s[pos] == 'k') bk = 1;
+            if (s[pos] == 'q') bq = 1;
+        }
+    }
+    d->wKINGSIDE_CASTLE = wk && b[4] == wKING && b[7] == wROOK;
+    d->wQUEENSIDE_CASTLE = wq && b[4] == wKING && b[0] == wROOK;
+    d->bKINGSIDE_CASTLE = bk && b[60] == bKING && b[63] == bROOK;
+    d->bQUEENSIDE_CASTLE = bq && b[60] == bKING && b[56] == bROOK;
+
+    // Read the en passant field, which gives the square behind the pawn that just moved two squares.
+    while (s[pos] == ' ') pos++;
+    if (s[pos] == '-') {
+        pos++;
+    }
+    else if (s[pos] >= 'a' && s[pos] <= 'h' && (s[pos + 1] == '3' || s[pos + 1] == '6')) {
+        d->EN_PASSANT_FILE = s[pos] - 'a';
+        pos += 2;
     }
-    if (b[60] == bKING) {
-        if (b[56] == bROOK) d->bQUEENSIDE_CASTLE = 1;
-        if (b[63] == bROOK) d->bKINGSIDE_CASTLE = 1;
+
+    // Read the halfmove clock field.
+    while (s[pos] == ' ') pos++;
+    if (s[pos] >= '0' && s[pos] <= '9') {
+        int c = 0;
+        for (; s[pos] >= '0' && s[pos] <= '9'; pos++) {
+            c = c * 10 + s[pos] - '0';
+        }
+        d->FIFTY_MOVE_COUNTER = c > 100 ? 100 : c;
     }
 
     return 1;
 }
 
+// The fixed positions of the benchmark (see runBenchmark()): the start, openings and middlegames with tactics
+// (including two mates), and endgames.
+const char* benchmarkPositions[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1",
+    "r1bqkb1r/pppp1ppp/2n2n2/4p2Q/2B1P3/8/PPPP1PPP/RNB1K1NR w KQkq - 4 4",
+    "6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 1",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "8/8/8/4k3/8/8/4P3/4K3 w - - 0 1"
+};
+#define NUM_BENCHMARK_POSITIONS (int)(sizeof(benchmarkPositions) / sizeof(benchmarkPositions[0]))
+
+int benchmarkThreadCounts[] = { 1, 2, 4, 8, 16 }; // calculating threads, besides the main thread
+#define NUM_BENCHMARK_THREAD_COUNTS (int)(sizeof(benchmarkThreadCounts) / sizeof(benchmarkThreadCounts[0]))
+
+#define BENCHMARK_NODES 4000000 // node memory of every benchmark run, fixed so the runs reclaim memory the same way
+#define BENCHMARK_MOVES 40000000 // move memory of every benchmark run
+#define BENCHMARK_SEED_REPS 500
+#define BENCHMARK_DEPTH_LIMIT 30
+#define BENCHMARK_DEFAULT_NODE_LIMIT 20000 // nodes examined per position when none is given
+
+// The results of the benchmark positions with one number of calculating threads.
+typedef struct {
+    int threads;
+    long long nodesExamined;
+    long long nodesAdded;
+    long long time; // nanoseconds of setting up and evaluating all positions
+    int peakNodes; // most nodes in use at the end of any position (see nodesInUse())
+    unsigned long long signature; // hash of every position's best move and eval (see runBenchmark())
+} BR;
+
+// Evaluate every benchmark position with each number of calculating threads in benchmarkThreadCounts up to maxThreads,
+// until nodeLimit nodes are examined (split equally among the threads), with the current queue and expansion settings.
+// Write the results of each thread count into results and return how many there are.
+// Since the run does not depend on the clock (redistribution is paused and the book is not probed), it is the same
+// every time with one calculating thread, so that run's signature tells whether a change altered the search.
+// With more threads, it depends on how the threads happened to interleave.
+// The engine is initialized again with its previous memory and threads afterwards.
+int runBenchmark(int nodeLimit, int maxThreads, BR* results) {
+    int oldNodes = nodeCap.load(), oldMoves = globalMoveCap.load(), oldThreads = numThreads, oldSeedReps = numSeedReps;
+    bool wasInitialized = initComplete;
+    int oldDepthLimit = evaluationDepthLimit;
+    double oldRedistributionInterval = redistributionInterval;
+    MF oldBook = bookFile;
+    bookFile.data = NULL;
+
+    evaluationDepthLimit = BENCHMARK_DEPTH_LIMIT;
+    redistributionInterval = 0;
+
+    int numResults = 0;
+    for (int k = 0; k < NUM_BENCHMARK_THREAD_COUNTS && benchmarkThreadCounts[k] <= maxThreads; k++) {
+        int threadCount = benchmarkThreadCounts[k];
+        if (!init(BENCHMARK_NODES, BENCHMARK_MOVES, threadCount + 1, BENCHMARK_SEED_REPS)) break;
+        evaluationThreadNodeLimit = nodeLimit / threadCount > 0 ? nodeLimit / threadCount : 1;
+
+        BR* r = results + numResults;
+        r->threads = threadCount;
+        r->nodesExamined = 0;
+        r->nodesAdded = 0;
+        r->time = 0;
+        r->peakNodes = 0;
+        r->signature = 0xcbf29ce484222325;
+
+        for (int i = 0; i < NUM_BENCHMARK_POSITIONS; i++) {
+            char fen[128];
+            char b[64];
+            D d;
+            strncpy(fen, benchmarkPositions[i], sizeof(fen) - 1);
+            fen[sizeof(fen) - 1] = '\0';
+            if (!parseFEN(fen, b, &d, 0)) continue;
+
+            long long start = clockNanoseconds();
+            if (!setupEvaluation(b, &d, 1) || !evaluateTime(BATCH_NO_TIME_LIMIT)) continue;
+            r->time += clockNanoseconds() - start;
+
+            sumCalcStats();
+            r->nodesExamined += calcStats.nodesExamined.load();
+            r->nodesAdded += calcStats.nodesAdded.load();
+            int n = nodesInUse();
+            if (n > r->peakNodes) r->peakNodes = n;
+
+            // Mix the best move and its eval (to a thousandth) into the signature (FNV-1a over the two numbers).
+            bool hasChoice = nodes->numChildren > 0;
+            unsigned long long values[2] = {
+                hasChoice ? (unsigned long long)sortedMoves[0]->move : (unsigned long long)NO_MOVE,
+                hasChoice ? (unsigned long long)(long long)(sortedMoves[0]->e.load() * 1000.0) : 0
+            };
+            for (int j = 0; j < 2; j++) {
+                r->signature = (r->signature ^ values[j]) * 0x100000001b3;
+            }
+        }
+        numResults++;
+    }
+
+    evaluationThreadNodeLimit = INT_MAX;
+    evaluationDepthLimit = oldDepthLimit;
+    redistributionInterval = oldRedistributionInterval;
+    bookFile = oldBook;
+    if (wasInitialized) init(oldNodes, oldMoves, oldThreads, oldSeedReps);
+    else {
+        killAllThreads();
+        initComplete = 0;
+    }
+    return numResults;
+}
+
+// Return the scaling efficiency of benchmark result r against the one-thread result r1 in thousandths: its nodes examined
+// per second divided by the threads times those of one thread.
+long long benchmarkEfficiency(BR* r, BR* r1) {
+    if (r->time <= 0 || r1->time <= 0 || r1->nodesExamined <= 0) return 0;
+    double nps = (double)r->nodesExamined / (double)r->time;
+    double nps1 = (double)r1->nodesExamined / (double)r1->time;
+    return (long long)(1000.0 * nps / (nps1 * r->threads) + 0.5);
+}
+
+#if !ENGINE_HEADLESS
 // Get a valid FEN code from the user and return 0 if the user enters a blank line.
 bool getFEN(char* b, D* d) {
-    while (!parseFEN(b, d)) {
+    while (1) {
+        getLine();
+        if (parseFEN(inLine, b, d, 1)) return 1;
         if (inLine[0] == '\n' || inLine[0] == '\0') return 0;
         printf("Type a valid FEN code: ");
     }
-
-    return 1;
 }
 
 // Plays a game between the player and engine.
@@ -4297,6 +8037,7 @@ void play1Player() {
     if (!getFEN(history[0], historyD)) {
         setupBoard();
     }
+    storeHistoryKey(0);
 
     printf("Enter engine difficulty (%i-%i): ", DIFFICULTY_MIN, DIFFICULTY_MAX);
     int difficulty = getNumber(DIFFICULTY_MIN, DIFFICULTY_MAX, 0);
@@ -4314,7 +8055,7 @@ void play1Player() {
         playerRole = 1;
         break;
     default:
-        playerRole = random() % 2;
+        playerRole = nextRandom() % 2;
         break;
     }
 
@@ -4328,6 +8069,7 @@ void play1Player() {
         gameLength++;
         history = (char**)realloc(history, gameLength * sizeof(char*));
         historyD = (D*)realloc(historyD, gameLength * sizeof(D));
+        historyKeys = (unsigned long long*)realloc(historyKeys, gameLength * sizeof(unsigned long long));
 
         history[gameLength - 1] = (char*)calloc(64, 1);
 
@@ -4347,9 +8089,10 @@ void play1Player() {
         }
         else {
             // Engine plays.
-            double t = evaluationTimeLimitMin + ((double)random() / (double)ULLONG_MAX) * (evaluationTimeLimitMax - evaluationTimeLimitMin);
+            double t = evaluationTimeLimitMin + ((double)nextRandom() / (double)ULLONG_MAX) * (evaluationTimeLimitMax - evaluationTimeLimitMin);
 
-            setupEvaluation(history[gameLength - 1], ld, 1);
+            setGameKeys(historyKeys, gameLength - 1);
+            setupEvaluationKeepingTree(history[gameLength - 1], ld);
             evaluateTime(t);
 
             int choice = chooseMove(difficulty);
@@ -4359,8 +8102,8 @@ void play1Player() {
             }
 
             N* n = nodes + nodes->childStartIndex + choice;
-            ld->SQUARE_FROM = n->SQUARE_FROM;
-            ld->SQUARE_TO = n->SQUARE_TO;
+            ld->SQUARE_FROM = moveFromSquare(n->move);
+            ld->SQUARE_TO = moveCode(n->move);
             ld->PLAYER_TURN = 1 - (historyD + gameLength - 2)->PLAYER_TURN;
         }
 
@@ -4382,6 +8125,7 @@ void play2Player() {
     if (!getFEN(history[0], historyD)) {
         setupBoard();
     }
+    storeHistoryKey(0);
 
     while (1) {
 
@@ -4392,6 +8136,7 @@ void play2Player() {
         gameLength++;
         history = (char**)realloc(history, gameLength * sizeof(char*));
         historyD = (D*)realloc(historyD, gameLength * sizeof(D));
+        historyKeys = (unsigned long long*)realloc(historyKeys, gameLength * sizeof(unsigned long long));
 
         history[gameLength - 1] = (char*)calloc(64, 1);
 
@@ -4426,6 +8171,8 @@ void analyzePosition() {
 
     printf("Analyzing for %f seconds...\n\n", evaluationTimeLimitAnalysis);
 
+    // The position is analyzed on its own, without the positions of a game before it.
+    setGameKeys(NULL, 0);
     setupEvaluation(analysisBoard, &analysisD, 1);
     evaluateTime(evaluationTimeLimitAnalysis);
 
@@ -4436,9 +8183,31 @@ void analyzePosition() {
 
     printf(" with %i nodes (%i moves).\n", numNodes.load(), globalMoveLength.load());
 
-    printf("# nodes added / moves added / nodes examined: %i/%i/%i\n", calcNumNodesAdded.load(), calcNumMovesAdded.load(), calcNumNodesExamined.load());
+    sumCalcStats();
+    CS* s = &calcStats;
+    printf("# nodes added / moves added / nodes examined: %i/%i/%i\n", s->nodesAdded.load(), s->movesAdded.load(), s->nodesExamined.load());
+
+    printf("# stalemates / white wins / black wins / normals found: %i/%i/%i/%i\n", s->stalematesFound.load(), s->whiteWinsFound.load(), s->blackWinsFound.load(), s->normalsFound.load());
+
+    printf("# repetitions / fifty-move draws found: %i/%i\n", s->repetitionsFound.load(), s->fiftyMoveDrawsFound.load());
+    printf("# known endgame positions found: %i\n", s->endgameHits.load());
+
+    int probes = s->transpositionProbes.load();
+    printf("# transposition probes / hits (hit rate) / moves saved: %i/%i (%.2f%%)/%i\n", probes, s->transpositionHits.load(),
+        probes > 0 ? 100.0 * (double)s->transpositionHits.load() / (double)probes : 0.0, s->transpositionMovesSaved.load());
 
-    printf("# stalemates / white wins / black wins / normals found: %i/%i/%i/%i\n", calcNumStalematesFound.load(), calcNumWhiteWinsFound.load(), calcNumBlackWinsFound.load(), calcNumNormalsFound.load());
+    printf("# queued / stashed / examined per second: %i/%i/%i\n", s->queueSize.load(), s->stashSize.load(), calcExaminedPerSecond);
+
+    printf("# unused reserved node slots / move slots: %i/%i\n", s->nodeSlotsUnused.load(), s->moveSlotsUnused.load());
+
+    printf("# depth: nodes added / queued / examined\n");
+    for (int i = 0; i <= calcMaxDepth; i++) {
+        printf("#   %i: %i/%i/%i\n", i, s->nodesAddedDepth[i].load(), s->nodesQueuedDepth[i].load(), s->nodesExaminedDepth[i].load());
+    }
+
+    printf("# reclaims / nodes reclaimed / moves reclaimed: %i/%lli/%lli\n", calcNumReclaims.load(), calcNumNodesReclaimed.load(), calcNumMovesReclaimed.load());
+
+    printf("Stop latency: %i us\n", calcStopLatency.load());
 
     for (int i = 0; i < numChoices; i++) {
         printf(moveToString(i));
@@ -4451,7 +8220,7 @@ void analyzePosition() {
         int nc = sortedMoves[i]->numChildren;
         for (int j = 0; j < nc; j++) {
             N* child = nodes + sortedMoves[i]->childStartIndex + j;
-            printf("   %i to %i: %f\n", child->SQUARE_FROM, child->SQUARE_TO, child->e.load());
+            printf("   %i to %i: %f\n", moveFromSquare(child->move), moveCode(child->move), child->e.load());
         }
     }
     printf("\n");
@@ -4604,6 +8373,7 @@ bool menu() {
 
     return 1;
 }
+#endif
 
 void resetConsoleBuffer() {
     if (inLine == NULL) inLine = (char*)calloc(MAX_LINE_SIZE, 1);
@@ -4615,15 +8385,39 @@ void resetConsoleBuffer() {
     }
 }
 
+#if !ENGINE_HEADLESS
 // Run the user interface application.
 void runUI() {
 
     // Loop the menu screen if the user returns to the menu at any time.
     while (menu()) {}
 }
+#endif
+
+// Return how much of the command is left to read: the bytes left in the frame in binary, or the chars left on the line
+// up to its last argument in text.
+int inputLeft() {
+    if (binaryProtocol) return inLineLength - inLinePos;
+    int l = 0;
+    for (int i = 0; inLine[inLinePos + i] != '\n' && inLine[inLinePos + i] != '\0'; i++) {
+        if (inLine[inLinePos + i] != ' ' && inLine[inLinePos + i] != '\r') l = i + 1;
+    }
+    return l;
+}
 
 int readInt() {
 
+    if (binaryProtocol) {
+        if (inputLeft() < (int)sizeof(int)) {
+            inLinePos = inLineLength;
+            return 0;
+        }
+        int x;
+        memcpy(&x, inLine + inLinePos, sizeof(int));
+        inLinePos += sizeof(int);
+        return x;
+    }
+
     int x = 0;
 
     bool neg = 0;
@@ -4639,17 +8433,114 @@ int readInt() {
         inLinePos++;
     }
 
-    inLinePos++;
+    // Skip the separator, but stay at the end of the line so reading past it only reads zeros.
+    if (inLine[inLinePos] != '\n' && inLine[inLinePos] != '\0') inLinePos++;
 
     if (neg) x *= -1;
     return x;
 }
 
+// Read a string into s, which holds size chars: the rest of the line in text, or up to a null char in binary.
+// Return whether the string was read, which it is not if a binary frame ends before the null char.
+bool readString(char* s, int size) {
+    int l = 0;
+    if (binaryProtocol) {
+        int length = strnlen(inLine + inLinePos, inputLeft() > 0 ? inputLeft() : 0);
+        if (length >= inputLeft()) {
+            inLinePos = inLineLength;
+            s[0] = '\0';
+            return 0;
+        }
+        for (int i = 0; i < length; i++) {
+            if (l < size - 1) s[l++] = inLine[inLinePos + i];
+        }
+        inLinePos += length + 1;
+    }
+    else {
+        for (; inLine[inLinePos] != '\n' && inLine[inLinePos] != '\r' && inLine[inLinePos] != '\0'; inLinePos++) {
+            if (l < size - 1) s[l++] = inLine[inLinePos];
+        }
+    }
+    s[l] = '\0';
+    return 1;
+}
+
+// Return whether a position given as board squares and data values is one the engine can calculate on: every square is
+// empty or a piece, there is one king of each color on its king square, and the data values are in range.
+bool validPosition(char* b, D* d) {
+    int numWhiteKings = 0;
+    int numBlackKings = 0;
+    for (int i = 0; i < 64; i++) {
+        if (b[i] < EMPTY || b[i] > bKING) return 0;
+        if (b[i] == wKING) numWhiteKings++;
+        if (b[i] == bKING) numBlackKings++;
+    }
+    if (numWhiteKings != 1 || numBlackKings != 1) return 0;
+    if (d->wKING_SQUARE < 0 || d->wKING_SQUARE > 63 || b[d->wKING_SQUARE] != wKING) return 0;
+    if (d->bKING_SQUARE < 0 || d->bKING_SQUARE > 63 || b[d->bKING_SQUARE] != bKING) return 0;
+
+    char castles[4] = { d->wKINGSIDE_CASTLE, d->wQUEENSIDE_CASTLE, d->bKINGSIDE_CASTLE, d->bQUEENSIDE_CASTLE };
+    for (int i = 0; i < 4; i++) {
+        if (castles[i] != 0 && castles[i] != 1) return 0;
+    }
+    if (d->EN_PASSANT_FILE < -1 || d->EN_PASSANT_FILE > 7) return 0;
+    if (d->FIFTY_MOVE_COUNTER < 0) return 0;
+    if (d->PLAYER_TURN != WHITE && d->PLAYER_TURN != BLACK) return 0;
+    return d->GAME_STATE >= NORMAL && d->GAME_STATE <= DRAW;
+}
+
 // Read a position code and allocate and set the analysisBoard to the position.
-void readPosition(char* p, char* b, D* d) {
+// The position is either the 64 board squares followed by the 12 data values, or a FEN code.
+// In text, a FEN code is told apart by the '/' in its first field and takes up to six fields.
+// Return whether the position is valid, which it is not if the command ends before it does.
+bool readPosition(char* p, char* b, D* d) {
 
     setupAnalysisBoard();
 
+    if (inputLeft() <= 0) return 0;
+
+    if (binaryProtocol) {
+        char kind = inLine[inLinePos];
+        inLinePos++;
+        if (kind == BINARY_POSITION_FEN) {
+            char* fen = inLine + inLinePos;
+            int l = strnlen(fen, inputLeft());
+            if (l == inputLeft()) {
+                inLinePos = inLineLength;
+                return 0;
+            }
+            inLinePos += l + 1;
+            return parseFEN(fen, b, d, 0);
+        }
+        if (inputLeft() < 64 + (int)sizeof(D)) {
+            inLinePos = inLineLength;
+            return 0;
+        }
+        memcpy(b, inLine + inLinePos, 64);
+        memcpy(d, inLine + inLinePos + 64, sizeof(D));
+        inLinePos += 64 + sizeof(D);
+        return validPosition(b, d);
+    }
+
+    bool isFEN = 0;
+    for (int i = inLinePos; inLine[i] != ' ' && inLine[i] != '\n' && inLine[i] != '\0'; i++) {
+        if (inLine[i] == '/') isFEN = 1;
+    }
+    if (isFEN) {
+        // Copy the fields of the FEN code so the arguments after it are not parsed as part of it.
+        char fen[128];
+        int l = 0;
+        for (int field = 0; field < 6 && inLine[inLinePos] != '\n' && inLine[inLinePos] != '\0'; field++) {
+            for (; inLine[inLinePos] != ' ' && inLine[inLinePos] != '\n' && inLine[inLinePos] != '\0'; inLinePos++) {
+                if (l < 127) fen[l++] = inLine[inLinePos];
+            }
+            if (inLine[inLinePos] == ' ') inLinePos++;
+            if (l < 127) fen[l++] = ' ';
+        }
+        fen[l] = '\0';
+        return parseFEN(fen, b, d, 0);
+    }
+
     // Fill the analysisBoard with chars from input.
     for (int i = 0; i < 64; i++) {
         b[i] = readInt();
@@ -4665,10 +8556,29 @@ void readPosition(char* p, char* b, D* d) {
     d->SQUARE_FROM = readInt();
     d->SQUARE_TO = readInt();
     d->PLAYER_TURN = readInt();
+    if (inputLeft() <= 0) return 0; // fewer than the 76 values
     d->GAME_STATE = readInt();
+    return validPosition(b, d);
+}
+
+// Make outLine hold at least size more bytes of results, so long results (gd with every root move, ds of deep trees) are not
+// limited to MAX_LINE_SIZE. Each write reserves its own room, with 2 more bytes for the end of the line in printOutLine().
+void reserveOutLine(int size) {
+    if (outLineSize - outLinePos >= size) return;
+    while (outLineSize - outLinePos < size) {
+        outLineSize *= 2;
+    }
+    outLine = (char*)realloc(outLine, outLineSize);
+    if (outLine == NULL) crash();
 }
 
 void writeBool(bool x) {
+    reserveOutLine(2 + 2);
+    if (binaryProtocol) {
+        outLine[outLinePos] = x;
+        outLinePos++;
+        return;
+    }
     if (x) {
         outLine[outLinePos] = '1';
         outLinePos++;
@@ -4681,6 +8591,12 @@ void writeBool(bool x) {
 }
 
 void writeInt(long long x) {
+    reserveOutLine(21 + 2); // sign, 19 digits, and a space
+    if (binaryProtocol) {
+        memcpy(outLine + outLinePos, &x, sizeof(long long));
+        outLinePos += sizeof(long long);
+        return;
+    }
     if (x < 0) {
         outLine[outLinePos] = '-';
         outLinePos++;
@@ -4708,53 +8624,324 @@ void writeInt(long long x) {
 }
 
 void writeString(char* x) {
+    reserveOutLine(strlen(x) + 1 + 2);
     for (int i = 0; x[i] != '\0'; i++) {
         outLine[outLinePos] = x[i];
         outLinePos++;
     }
-    outLine[outLinePos] = ' ';
+    outLine[outLinePos] = binaryProtocol ? '\0' : ' ';
     outLinePos++;
 }
 
+// Progress lines pushed to stdout during evaluations started with e0, so drivers do not need to poll with gd.
+int pushInterval = 0; // milliseconds between progress lines, 0 for none
+#define PUSH_PV_LENGTH_MAX 16 // most moves of the principal variation in a progress line
+thread pushThread;
+mutex pushMutex;
+condition_variable pushCondition; // Notified when pushing stops, with pushMutex.
+bool pushRunning = 0;
+
+// Print a progress line: pu, the nodes examined, the nodes examined per second since the last line, the nodes and moves
+// used, the root eval, and the length and moves (from and to) of the principal variation.
+// The tree is held like a calculating thread holds it so that it is not reclaimed while the line is read from it,
+// and the calculating threads keep running.
+void pushProgress(long long* lastExamined, long long* lastTime) {
+    long long examined = 0;
+    for (int i = 0; i < numThreads; i++) {
+        examined += threads[i].stats.nodesExamined.load(memory_order_relaxed);
+    }
+    long long now = clockNanoseconds();
+    long long rate = now > *lastTime ? (examined - *lastExamined) * 1000000000ll / (now - *lastTime) : 0;
+    *lastExamined = examined;
+    *lastTime = now;
+
+    // Follow the best child from the root, through the nodes that transpositions are linked to.
+    char pvFroms[PUSH_PV_LENGTH_MAX];
+    char pvTos[PUSH_PV_LENGTH_MAX];
+    int pvLength = 0;
+    enterTree();
+    double e = (nodes->e).load();
+    N* n = nodes;
+    while (pvLength < PUSH_PV_LENGTH_MAX) {
+        if (n->transpositionIndex != UNDEFINED) n = nodes + n->transpositionIndex;
+        int nc = n->numChildren;
+        if (nc <= 0) break;
+        bool isBlack = n->PLAYER_TURN == BLACK;
+        N* c = nodes + n->childStartIndex;
+        N* best = c;
+        EV bestEval = childEvalForParent(c);
+        for (int i = 1; i < nc; i++) {
+            EV x = childEvalForParent(c + i);
+            if (evalBetter(x, bestEval, isBlack)) {
+                bestEval = x;
+                best = c + i;
+            }
+        }
+        pvFroms[pvLength] = moveFromSquare(best->move);
+        pvTos[pvLength] = moveCode(best->move);
+        pvLength++;
+        n = best;
+    }
+    leaveTree();
+
+    char line[128 + PUSH_PV_LENGTH_MAX * 8];
+    int l = snprintf(line, sizeof(line), "pu %lli %lli %i %i %lli %i", examined, rate, numNodes.load(), globalMoveLength.load(),
+        (long long)(e * 1000.0), pvLength);
+    for (int i = 0; i < pvLength; i++) {
+        l += snprintf(line + l, sizeof(line) - l, " %i %i", pvFroms[i], pvTos[i]);
+    }
+    line[l] = '\n';
+    line[l + 1] = '\0';
+    fputs(line, stdout);
+    fflush(stdout);
+}
+
+// Push progress lines every pushInterval milliseconds until pushing stops.
+void runPushThread() {
+    long long lastExamined = 0;
+    for (int i = 0; i < numThreads; i++) {
+        lastExamined += threads[i].stats.nodesExamined.load(memory_order_relaxed);
+    }
+    long long lastTime = clockNanoseconds();
+
+    unique_lock<mutex> lock(pushMutex);
+    while (1) {
+        pushCondition.wait_for(lock, chrono::milliseconds(pushInterval), [] { return !pushRunning; });
+        if (!pushRunning) break;
+        lock.unlock();
+        pushProgress(&lastExamined, &lastTime);
+        lock.lock();
+    }
+}
+
+// Stop pushing progress lines, waiting until the last one is printed.
+void stopPushThread() {
+    {
+        lock_guard<mutex> lock(pushMutex);
+        pushRunning = 0;
+    }
+    pushCondition.notify_all();
+    if (pushThread.joinable()) pushThread.join();
+}
+
+// Start pushing progress lines if there is an interval set. Lines are only pushed in the text protocol.
+void startPushThread() {
+    stopPushThread();
+    if (pushInterval <= 0 || binaryProtocol) return;
+    pushRunning = 1;
+    pushThread = thread(runPushThread);
+}
+
 void _init(int totalNumNodesAllowed, int totalNumMovesAllowed, int threadCount, int seedRepsCount) {
+    stopPushThread();
     writeBool(init(totalNumNodesAllowed, totalNumMovesAllowed, threadCount, seedRepsCount));
 }
 
 // Run the setup for analysis operation after init has been called.
 void _setupEvaluation(int d1, char* position) {
 
+    stopPushThread();
+
     // Set settings based on the details.
     evaluationDepthLimit = d1;
 
-    readPosition(position, analysisBoard, &analysisD);
+    if (!readPosition(position, analysisBoard, &analysisD)) {
+        writeBool(0);
+        return;
+    }
     writeBool(setupEvaluation(analysisBoard, &analysisD, 1));
 }
 
+// Run the setup for analysis operation after init has been called, keeping the last evaluation's tree below the position.
+void _setupEvaluationKeepingTree(int d1, char* position) {
+
+    stopPushThread();
+
+    // Set settings based on the details.
+    evaluationDepthLimit = d1;
+
+    if (!readPosition(position, analysisBoard, &analysisD)) {
+        writeBool(0);
+        return;
+    }
+    writeBool(setupEvaluationKeepingTree(analysisBoard, &analysisD));
+}
+
+// Set how often (0 for never) and how many of each thread's best queued nodes are redistributed during evaluations.
+// An e0 evaluation already running keeps the settings it started with.
+void _setRedistribution(int intervalMS, int size) {
+    if (intervalMS < 0 || size < 1) {
+        writeBool(0);
+        return;
+    }
+    redistributionInterval = (double)intervalMS / 1000.0;
+    redistributionSize = size;
+    writeBool(1);
+}
+
+// Change the depth limit, also during an evaluation started with e0.
+void _setEvaluationDepthLimit(int limit) {
+    writeBool(setEvaluationDepthLimit(limit));
+}
+
 // Run the analyze operation after runSetupAnalysis has been called.
 void _evaluateTime(int timeLimitMS) {
+    stopPushThread();
     writeBool(evaluateTime((double)timeLimitMS / 1000.0));
 }
 
 // Run the analyze operation after runSetupAnalysis has been called.
+// Progress lines are pushed every pushInterval milliseconds until e1 (see pushProgress()).
 void _evaluateStart() {
-    writeBool(evaluateStart());
+    bool started = evaluateStart();
+    if (started) startPushThread();
+    writeBool(started);
 }
 
 // Run the analyze operation after runSetupAnalysis has been called.
 void _evaluateStop() {
+    stopPushThread();
     writeBool(evaluateStop());
 }
 
+// Set the milliseconds between progress lines pushed during e0 evaluations (0 for none), also during one.
+void _setPushInterval(int intervalMS) {
+    if (intervalMS < 0 || binaryProtocol) {
+        writeBool(0);
+        return;
+    }
+    bool pushing = pushThread.joinable();
+    stopPushThread();
+    pushInterval = intervalMS;
+    if (pushing || evaluationStarted) startPushThread();
+    writeBool(1);
+}
+
+// Print the results written to outLine so far as one line.
+void printOutLine() {
+    reserveOutLine(2);
+    outLine[outLinePos] = '\n';
+    outLinePos++;
+    outLine[outLinePos] = '\0';
+    outLinePos++;
+    printf(outLine);
+    fflush(stdout);
+}
+
+// Run the benchmark (see runBenchmark()) with nodeLimit nodes per position (0 for BENCHMARK_DEFAULT_NODE_LIMIT) and up to
+// maxThreads calculating threads. For each thread count, write the threads, the nodes examined and added, the milliseconds,
+// the nodes examined and added per second, the nodes examined per thousand added, the scaling efficiency in thousandths,
+// the peak nodes in the tree, and the signature in hex. Then write the peak memory of the process in bytes.
+void _benchmark(int nodeLimit, int maxThreads) {
+    stopPushThread();
+    BR results[NUM_BENCHMARK_THREAD_COUNTS];
+    int n = runBenchmark(nodeLimit > 0 ? nodeLimit : BENCHMARK_DEFAULT_NODE_LIMIT, maxThreads, results);
+
+    writeInt(n);
+    for (int i = 0; i < n; i++) {
+        BR* r = results + i;
+        long long ms = r->time / 1000000;
+        char signature[17];
+        sprintf(signature, "%016llx", r->signature);
+        writeInt(r->threads);
+        writeInt(r->nodesExamined);
+        writeInt(r->nodesAdded);
+        writeInt(ms);
+        writeInt(r->time > 0 ? (long long)((double)r->nodesExamined * 1e9 / (double)r->time) : 0);
+        writeInt(r->time > 0 ? (long long)((double)r->nodesAdded * 1e9 / (double)r->time) : 0);
+        writeInt(r->nodesAdded > 0 ? r->nodesExamined * 1000 / r->nodesAdded : 0);
+        writeInt(benchmarkEfficiency(r, results));
+        writeInt(r->peakNodes);
+        writeString(signature);
+    }
+    writeInt(peakMemoryBytes());
+}
+
+// Run the benchmark from the command line ("bench [nodes per position] [max threads]") and print its results as a table.
+void printBenchmark(int nodeLimit, int maxThreads) {
+    BR results[NUM_BENCHMARK_THREAD_COUNTS];
+    if (nodeLimit <= 0) nodeLimit = BENCHMARK_DEFAULT_NODE_LIMIT;
+    printf("Benchmark: %i positions, %i nodes examined each, %s expansion, depth limit %i\n",
+        NUM_BENCHMARK_POSITIONS, nodeLimit, lazyExpansion ? "lazy" : "full", BENCHMARK_DEPTH_LIMIT);
+    int n = runBenchmark(nodeLimit, maxThreads, results);
+
+    printf("threads   examined/s      added/s  examined/added  efficiency  peak nodes  signature\n");
+    for (int i = 0; i < n; i++) {
+        BR* r = results + i;
+        double seconds = (double)r->time / 1e9;
+        printf("%7i %12.0f %12.0f %15.3f %10.1f%% %11i  %016llx\n", r->threads,
+            seconds > 0 ? r->nodesExamined / seconds : 0.0, seconds > 0 ? r->nodesAdded / seconds : 0.0,
+            r->nodesAdded > 0 ? (double)r->nodesExamined / r->nodesAdded : 0.0, benchmarkEfficiency(r, results) / 10.0,
+            r->peakNodes, r->signature);
+    }
+    printf("peak memory: %lld MB\n", peakMemoryBytes() / (1024 * 1024));
+}
+
+// Evaluate count positions read one after another, each for timeMS milliseconds and until nodeLimit nodes are examined
+// (0 for no limit), without a round trip between them. If keepTree is 1, each position is set up like with sk,
+// so consecutive positions of a game keep the tree below them.
+// For each position, write whether it was evaluated, the number of moves, the best move and its eval,
+// the nodes examined, and the milliseconds taken. In text, each position's results are printed as soon as it is done.
+// The batch stops early if the command ends before count positions are read.
+void _evaluateBatch(int d1, int timeMS, int nodeLimit, bool keepTree, int count) {
+
+    stopPushThread();
+    evaluationDepthLimit = d1;
+    if (nodeLimit > 0 && numThreads > 1) {
+        evaluationThreadNodeLimit = nodeLimit / (numThreads - 1) > 0 ? nodeLimit / (numThreads - 1) : 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (inputLeft() <= 0) break;
+        if (!binaryProtocol && i > 0) {
+            printOutLine();
+            outLinePos = 0;
+        }
+
+        long long start = clockNanoseconds();
+        bool ok = readPosition(inLine + inLinePos, analysisBoard, &analysisD) && (timeMS > 0 || nodeLimit > 0);
+        if (ok) ok = keepTree ? setupEvaluationKeepingTree(analysisBoard, &analysisD) : setupEvaluation(analysisBoard, &analysisD, 1);
+        if (ok) ok = evaluateTime(timeMS > 0 ? (double)timeMS / 1000.0 : BATCH_NO_TIME_LIMIT);
+
+        int numChoices = ok ? nodes->numChildren : 0;
+        writeBool(ok);
+        writeInt(numChoices);
+        writeInt(numChoices > 0 ? moveFromSquare(sortedMoves[0]->move) : UNDEFINED);
+        writeInt(numChoices > 0 ? moveCode(sortedMoves[0]->move) : UNDEFINED);
+        writeInt(numChoices > 0 ? (long long)(sortedMoves[0]->e.load() * 1000.0) : 0);
+        sumCalcStats();
+        writeInt(ok ? calcStats.nodesExamined.load() : 0);
+        writeInt((clockNanoseconds() - start) / 1000000);
+    }
+
+    evaluationThreadNodeLimit = INT_MAX;
+}
+
 // Test a position for legality.
 // Print a 1 or 0 depending on whether the given move is legal on the given position.
 void _testLegality(char f, char t, char* position) {
 
     char testBoard[64] = { 0 };
     D testD;
-    readPosition(position, testBoard, &testD);
+    bool valid = readPosition(position, testBoard, &testD);
 
     // Return if the move is legal.
-    writeBool(isLegalMove(testBoard, &testD, f, t));
+    writeBool(valid && isLegalMove(testBoard, &testD, f, t));
+}
+
+// Test many moves on one position for legality.
+// Print a 1 or 0 for each of the count moves from moveFroms to moveTos depending on whether it is legal on the given position.
+void _testLegalityBatch(int count, char* moveFroms, char* moveTos, char* position) {
+
+    char testBoard[64] = { 0 };
+    D testD;
+    bool valid = readPosition(position, testBoard, &testD);
+
+    bool legal[MAX_LEGALITY_BATCH] = { 0 };
+    if (valid) areLegalMoves(testBoard, &testD, moveFroms, moveTos, count, legal);
+    for (int i = 0; i < count; i++) {
+        writeBool(legal[i]);
+    }
 }
 
 // Test a position for check.
@@ -4763,11 +8950,145 @@ void _testCheck(bool isBlack, char* position) {
 
     char testBoard[64] = { 0 };
     D testD;
-    readPosition(position, testBoard, &testD);
+    bool valid = readPosition(position, testBoard, &testD);
 
     // Return if the king is in check.
-    char square = isBlack ? analysisD.bKING_SQUARE : analysisD.wKING_SQUARE;
-    writeBool(!kingNotInCheck(testBoard, square, isBlack));
+    char square = isBlack ? testD.bKING_SQUARE : testD.wKING_SQUARE;
+    writeBool(valid && !kingNotInCheck(testBoard, square, isBlack));
+}
+
+// Count the leaf positions to the given depth on a position (perft).
+// The position may be followed by the number of threads to use (default 1) and whether to divide (default 0).
+// Print the leaf count, the milliseconds taken, and the leaves per second.
+// If dividing, then also print the number of legal root moves followed by the from, to, and leaf count of each.
+void _perft(int depth, char* position) {
+
+    char testBoard[64] = { 0 };
+    D testD;
+    bool valid = readPosition(position, testBoard, &testD);
+    int threadCount = readInt();
+    bool divide = readInt() != 0;
+    if (threadCount == 0) threadCount = 1;
+    if (!valid) {
+        writeInt(0);
+        writeInt(0);
+        writeInt(0);
+        if (divide) writeInt(0);
+        return;
+    }
+
+    long long start = clockNanoseconds();
+    long long count = runPerft(testBoard, &testD, depth, threadCount);
+    long long diff = clockNanoseconds() - start;
+
+    writeInt(count);
+    writeInt(diff / 1000000);
+    writeInt(diff > 0 ? (long long)((double)count * 1000000000.0 / (double)diff) : 0);
+
+    if (divide) {
+        writeInt(perftNumRootMoves);
+        for (int i = 0; i < perftNumRootMoves; i++) {
+            writeInt(moveFromSquare(perftRootMoves[i]));
+            writeInt(moveCode(perftRootMoves[i]));
+            writeInt(perftRootCounts[i]);
+        }
+    }
+}
+
+// Set the kind of queue (see queueType): 2, 4, or 8 children per heap entry, or 0 for the bucket list.
+void _setQueueType(int type) {
+    writeBool(setQueueType(type));
+}
+
+// Set the game positions before the next set up position (see gameKeys): the given position, then count moves played from it
+// in the move encoding, each followed by its moveto, where the last move reaches the position to set up next.
+// The positions are kept for every setup until they are set again. Write 0 and keep the last positions set if the command
+// ends before its moves do or one of them is illegal.
+void _setGameHistory(char* position) {
+    if (!readPosition(position, analysisBoard, &analysisD)) {
+        writeBool(0);
+        return;
+    }
+    int count = readInt();
+    // Every move takes 2 ints in binary, or at least "0 0 " in text.
+    int maxCount = binaryProtocol ? inputLeft() / (2 * (int)sizeof(int)) : (inputLeft() + 1) / 4;
+    if (count < 0 || count > maxCount) {
+        writeBool(0);
+        return;
+    }
+
+    // After an illegal move, the rest of the moves are still read so a binary frame goes on at the next command.
+    unsigned long long* keys = (unsigned long long*)calloc(count + 1, sizeof(unsigned long long));
+    if (keys == NULL) crash();
+    bool legal = 1;
+    for (int i = 0; i < count; i++) {
+        int f = readInt();
+        int t = readInt();
+        if (!legal) continue;
+        if (f < 0 || f >= 64 || t < 0 || t > CHAR_MAX || !isLegalMove(analysisBoard, &analysisD, f, t)) {
+            legal = 0;
+            continue;
+        }
+        keys[i] = computePositionKey(analysisBoard, &analysisD);
+        analysisD.SQUARE_FROM = f;
+        analysisD.SQUARE_TO = t;
+        playMoveDriver(analysisBoard, &analysisD);
+        analysisD.PLAYER_TURN = 1 - analysisD.PLAYER_TURN;
+    }
+    writeBool(legal && setGameKeys(keys, count));
+    clear(keys);
+}
+
+// Open the opening book file at path for every later root (see probeBook()), or close the book if it cannot be opened.
+void _openBook(char* path) {
+    writeBool(mapFile(&bookFile, path));
+}
+
+// Add a book entry for the move of the given weight on the given position, to be written by the next wb command.
+void _addBookEntry(int weight, char f, char t, char* position) {
+    char bookBoard[64] = { 0 };
+    D bookD;
+    if (!readPosition(position, bookBoard, &bookD) || !isLegalMove(bookBoard, &bookD, f, t)) {
+        writeBool(0);
+        return;
+    }
+    addBookEntry(bookBoard, &bookD, packMove(f, t), weight);
+    writeBool(1);
+}
+
+// Write the book entries added since the last book was written to a book file at path.
+void _writeBook(char* path) {
+    writeBool(writeBook(path));
+}
+
+// Load the Syzygy tablebases at path (see loadTablebases()) and print the most pieces of any loaded table.
+void _loadTablebases(char* path) {
+    writeInt(loadTablebases(path));
+}
+
+// Set whether children are queued before their moves are found (see lazyExpansion), which needs the position set up again.
+void _setLazyExpansion(bool lazy) {
+    writeBool(setLazyExpansion(lazy));
+}
+
+// Set how the next init() places memory and threads (see largePages, prefaultMemory, and pinThreads).
+void _setMemoryPlacement(bool useLargePages, bool prefault, bool pin) {
+    largePages = useLargePages;
+    prefaultMemory = prefault;
+    pinThreads = pin;
+    writeBool(1);
+}
+
+// Time a queue of the given kind on its own (see runQueueBenchmark()).
+// Print whether it ran, the milliseconds to fill the queue with size nodes, and how many nodes per second were queued
+// while filling it and popped and queued again after.
+void _queueBenchmark(int type, int size, int ops) {
+    long long fillTime = 0, opsTime = 0;
+    bool ran = runQueueBenchmark(type, size, ops, &fillTime, &opsTime);
+    writeBool(ran);
+    writeInt(fillTime / 1000000);
+    writeInt(fillTime > 0 ? (long long)((double)size * 1000000000.0 / (double)fillTime) : 0);
+    writeInt(opsTime > 0 ? (long long)((double)ops * 1000000000.0 / (double)opsTime) : 0);
 }
 
 void _getOutputData() {
@@ -4779,81 +9100,344 @@ void _getOutputData() {
         getSortedChoices();
         int numChoices = nodes->numChildren;
         for (int i = 0; i < numChoices; i++) {
-            writeInt(sortedMoves[i]->SQUARE_FROM);
-            writeInt(sortedMoves[i]->SQUARE_TO);
+            writeInt(moveFromSquare(sortedMoves[i]->move));
+            writeInt(moveCode(sortedMoves[i]->move));
             writeInt(sortedMoves[i]->e.load() * 1000.0);
             writeString(moveToString(i));
         }
     }
-    writeInt(calcNumNodesAdded.load());
-    writeInt(calcNumMovesAdded.load());
-    writeInt(calcNumNodesExamined.load());
+    sumCalcStats();
+    CS* s = &calcStats;
+    writeInt(s->nodesAdded.load());
+    writeInt(s->movesAdded.load());
+    writeInt(s->nodesExamined.load());
+    writeInt(s->transpositionProbes.load());
+    writeInt(s->transpositionHits.load());
+    writeInt(s->transpositionMovesSaved.load());
+    writeInt(calcNumReclaims.load());
+    writeInt(calcNumNodesReclaimed.load());
+    writeInt(calcNumMovesReclaimed.load());
+    writeInt(calcStopLatency.load());
+    writeInt(s->queueSize.load());
+    writeInt(s->stashSize.load());
+    writeInt(calcExaminedPerSecond);
+    writeInt(s->nodeSlotsUnused.load());
+    writeInt(s->moveSlotsUnused.load());
+    writeInt(s->repetitionsFound.load());
+    writeInt(s->fiftyMoveDrawsFound.load());
+    writeInt(rootProbeSource);
+    writeInt(s->endgameHits.load());
+}
+
+// Write the number of depths that positions were found at, then the nodes added, queued, and examined at each depth.
+void _getDepthStats() {
+    sumCalcStats();
+    CS* s = &calcStats;
+    int numDepths = nodes == 0 ? 0 : calcMaxDepth + 1;
+    writeInt(numDepths);
+    for (int i = 0; i < numDepths; i++) {
+        writeInt(s->nodesAddedDepth[i].load());
+        writeInt(s->nodesQueuedDepth[i].load());
+        writeInt(s->nodesExaminedDepth[i].load());
+    }
+}
+
+// Write whether the profile (see ENGINE_PROFILE) can be read, which needs a profiling build and the threads stopped.
+// Then write, summed over the threads since the last setup, the cycles and the number of times of each phase in
+// profilePhases, the picoseconds per cycle, the number of backtrack lengths, and the backtracks of each length.
+void _getProfile() {
+#if ENGINE_PROFILE
+    if (evaluationStarted || threads == NULL) {
+        writeBool(0);
+        return;
+    }
+    writeBool(1);
+    for (int j = 0; j < NUM_PROFILE_PHASES; j++) {
+        long long cycles = 0, calls = 0;
+        for (int i = 0; i < numThreads; i++) {
+            cycles += (long long)(threads + i)->profile.cycles[j];
+            calls += (threads + i)->profile.calls[j];
+        }
+        writeInt(cycles);
+        writeInt(calls);
+    }
+    writeInt((long long)(profileNanosecondsPerCycle() * 1000.0));
+
+    long long lengths[MAX_DEPTH + 1] = { 0 };
+    int numLengths = 0;
+    for (int j = 0; j <= MAX_DEPTH; j++) {
+        for (int i = 0; i < numThreads; i++) {
+            lengths[j] += (threads + i)->profile.backtrackLengths[j];
+        }
+        if (lengths[j] > 0) numLengths = j + 1;
+    }
+    writeInt(numLengths);
+    for (int j = 0; j < numLengths; j++) {
+        writeInt(lengths[j]);
+    }
+#else
+    writeBool(0);
+#endif
+}
+
+// Write the profile traces to a Chrome tracing file at path (see writeProfileTrace()) and print whether it was written.
+void _writeProfileTrace(char* path) {
+#if ENGINE_PROFILE
+    writeBool(!evaluationStarted && threads != NULL && writeProfileTrace(path));
+#else
+    writeBool(0);
+#endif
 }
 
 inline bool firstTwo(char a, char b) {
     return inLine[0] == a && inLine[1] == b;
 }
 
+#define COMMAND_NEXT 0 // keep reading commands
+#define COMMAND_EXIT 1 // ex: end the program
+#define COMMAND_UI 2 // go: leave the input checker for the user interface
+#define COMMAND_BINARY 3 // bm: switch to the binary protocol
+#define COMMAND_UNKNOWN 4
+
+// Run the command whose two letters start inLine, reading its arguments from inLinePos and writing its results from outLinePos.
+// Return what to do next.
+int runCommand() {
+    if (firstTwo('g', 'o')) {
+        return COMMAND_UI;
+    } else if (firstTwo('e', 'x')) {
+        return COMMAND_EXIT;
+    } else if (firstTwo('b', 'm')) {
+        writeBool(1);
+        return COMMAND_BINARY;
+    } else if (firstTwo('t', 'l')) {
+        char f = readInt();
+        char t = readInt();
+        _testLegality(f, t, inLine + inLinePos);
+    } else if (firstTwo('t', 'b')) {
+        char moveFroms[MAX_LEGALITY_BATCH];
+        char moveTos[MAX_LEGALITY_BATCH];
+        int count = readInt();
+        if (count < 0) count = 0;
+        if (count > MAX_LEGALITY_BATCH) count = MAX_LEGALITY_BATCH;
+        for (int i = 0; i < count; i++) {
+            moveFroms[i] = readInt();
+            moveTos[i] = readInt();
+        }
+        _testLegalityBatch(count, moveFroms, moveTos, inLine + inLinePos);
+    } else if (firstTwo('t', 'c')) {
+        bool isBlack = readInt() != 0;
+        _testCheck(isBlack, inLine + inLinePos);
+    } else if (firstTwo('p', 'f')) {
+        int depth = readInt();
+        _perft(depth, inLine + inLinePos);
+    } else if (firstTwo('i', 'n')) {
+        int totalNumNodesAllowed = readInt();
+        int totalNumMovesAllowed = readInt();
+        int threadCount = readInt();
+        int seedRepsCount = readInt();
+        _init(totalNumNodesAllowed, totalNumMovesAllowed, threadCount, seedRepsCount);
+    } else if (firstTwo('s', 'e')) {
+        int d1 = readInt();
+        _setupEvaluation(d1, inLine + inLinePos);
+    } else if (firstTwo('s', 'k')) {
+        int d1 = readInt();
+        _setupEvaluationKeepingTree(d1, inLine + inLinePos);
+    } else if (firstTwo('r', 'd')) {
+        int intervalMS = readInt();
+        int size = readInt();
+        _setRedistribution(intervalMS, size);
+    } else if (firstTwo('d', 'l')) {
+        int limit = readInt();
+        _setEvaluationDepthLimit(limit);
+    } else if (firstTwo('e', '0')) {
+        _evaluateStart();
+    } else if (firstTwo('e', '1')) {
+        _evaluateStop();
+    } else if (firstTwo('e', 't')) {
+        int timeLimitMS = readInt();
+        _evaluateTime(timeLimitMS);
+    } else if (firstTwo('b', 'a')) {
+        int d1 = readInt();
+        int timeLimitMS = readInt();
+        int nodeLimit = readInt();
+        bool keepTree = readInt() != 0;
+        int count = readInt();
+        _evaluateBatch(d1, timeLimitMS, nodeLimit, keepTree, count);
+    } else if (firstTwo('q', 't')) {
+        int type = readInt();
+        _setQueueType(type);
+    } else if (firstTwo('q', 'b')) {
+        int type = readInt();
+        int size = readInt();
+        int ops = readInt();
+        _queueBenchmark(type, size, ops);
+    } else if (firstTwo('g', 'h')) {
+        _setGameHistory(inLine + inLinePos);
+    } else if (firstTwo('l', 'x')) {
+        bool lazy = readInt() != 0;
+        _setLazyExpansion(lazy);
+    } else if (firstTwo('m', 'p')) {
+        bool useLargePages = readInt() != 0;
+        bool prefault = readInt() != 0;
+        bool pin = readInt() != 0;
+        _setMemoryPlacement(useLargePages, prefault, pin);
+    } else if (firstTwo('p', 'i')) {
+        int intervalMS = readInt();
+        _setPushInterval(intervalMS);
+    } else if (firstTwo('o', 'b')) {
+        char path[MAX_LINE_SIZE];
+        if (readString(path, MAX_LINE_SIZE)) _openBook(path);
+        else writeBool(0);
+    } else if (firstTwo('a', 'b')) {
+        int weight = readInt();
+        char f = readInt();
+        char t = readInt();
+        _addBookEntry(weight, f, t, inLine + inLinePos);
+    } else if (firstTwo('w', 'b')) {
+        char path[MAX_LINE_SIZE];
+        if (readString(path, MAX_LINE_SIZE)) _writeBook(path);
+        else writeBool(0);
+    } else if (firstTwo('s', 'z')) {
+        char path[MAX_LINE_SIZE];
+        if (readString(path, MAX_LINE_SIZE)) _loadTablebases(path);
+        else writeInt(0);
+    } else if (firstTwo('b', 'n')) {
+        int nodeLimit = readInt();
+        int maxThreads = readInt();
+        _benchmark(nodeLimit, maxThreads);
+    } else if (firstTwo('p', 'r')) {
+        _getProfile();
+    } else if (firstTwo('p', 't')) {
+        char path[MAX_LINE_SIZE];
+        if (readString(path, MAX_LINE_SIZE)) _writeProfileTrace(path);
+        else writeBool(0);
+    } else if (firstTwo('g', 'd')) {
+        _getOutputData();
+    } else if (firstTwo('d', 's')) {
+        _getDepthStats();
+    } else {
+        return COMMAND_UNKNOWN;
+    }
+    // in 100000 1000000 10 500
+    // se 50 -1 -1 -1 -1 5 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 11 -1 -1 -1 -1 0 0 0 0 -1 0 4 60 -1 -1 0 0
+    return COMMAND_NEXT;
+}
+
+// Switch stdin and stdout to binary so frames are not changed by newline translation.
+void setBinaryStdio() {
+#if defined(_WIN32)
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+}
+
+// Run commands from binary frames on stdin until ex or the end of input (see DRIVER PROTOCOL).
+void runBinaryProtocol() {
+    stopPushThread();
+    fflush(stdout);
+    setBinaryStdio();
+    binaryProtocol = 1;
+
+    char* frame = (char*)calloc(BINARY_FRAME_SIZE, 1);
+    if (frame == NULL) crash();
+    char* textLine = inLine;
+
+    bool done = 0;
+    while (!done) {
+        int length = 0;
+        if (fread(&length, sizeof(int), 1, stdin) != 1) break;
+        if (length < 0 || length > BINARY_FRAME_SIZE) break;
+        if (fread(frame, 1, length, stdin) != (size_t)length) break;
+
+        // Reserve the frame length, then write each command's result length before its result.
+        outLinePos = sizeof(int);
+        int pos = 0;
+        while (pos + 2 <= length) {
+            reserveOutLine(sizeof(int));
+            int resultPos = outLinePos;
+            outLinePos += sizeof(int);
+
+            inLine = frame + pos;
+            inLineLength = length - pos;
+            inLinePos = 2;
+            int next = runCommand();
+            pos += inLinePos;
+
+            int resultLength = outLinePos - resultPos - sizeof(int);
+            memcpy(outLine + resultPos, &resultLength, sizeof(int));
+
+            // The rest of the frame cannot be found after a command of unknown length.
+            if (next == COMMAND_UNKNOWN) break;
+            if (next == COMMAND_EXIT) {
+                done = 1;
+                break;
+            }
+        }
+
+        int frameLength = outLinePos - sizeof(int);
+        memcpy(outLine, &frameLength, sizeof(int));
+        fwrite(outLine, 1, outLinePos, stdout);
+        fflush(stdout);
+    }
+
+    inLine = textLine;
+    binaryProtocol = 0;
+    outLinePos = 0;
+    clear(frame);
+}
+
 int main(int argc, char* argv[]) {
     setupAnalysisBoard();
     setupEvalBoards();
+    setupZobristKeys();
+    setupAttackTables();
     resetConsoleBuffer();
+#if ENGINE_DEBUG_VERIFY
+    verifyBookKey();
+#endif
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        printBenchmark(argc > 2 ? atoi(argv[2]) : 0, argc > 3 ? atoi(argv[3]) : benchmarkThreadCounts[NUM_BENCHMARK_THREAD_COUNTS - 1]);
+        killAllThreads();
+        return 0;
+    }
 
-    if (argc == 1) {
+    // The headless build always runs the input checker, and has no user interface for go to leave it for.
+    if (argc == 1 || ENGINE_HEADLESS) {
         // Run the input checker.
         while (1) {
             getLine();
             inLinePos = 3;
             outLinePos = 0;
 
-            if (firstTwo('g', 'o')) {
-                break; // Escape the input checker.
-            } else if (firstTwo('e', 'x')) {
+            int next = runCommand();
+            if (next == COMMAND_UI && !ENGINE_HEADLESS) break; // Escape the input checker.
+            if (inLine[0] == '\n' && feof(stdin)) next = COMMAND_EXIT;
+            if (next == COMMAND_EXIT) {
+                stopPushThread();
+                killAllThreads(); // The sleeping threads must end before the condition variables are destroyed.
                 return 0;
-            } else if (firstTwo('t', 'l')) {
-                char f = readInt();
-                char t = readInt();
-                _testLegality(f, t, inLine + inLinePos);
-            } else if (firstTwo('t', 'c')) {
-                bool isBlack = readInt() != 0;
-                _testCheck(isBlack, inLine + inLinePos);
-            } else if (firstTwo('i', 'n')) {
-                int totalNumNodesAllowed = readInt();
-                int totalNumMovesAllowed = readInt();
-                int threadCount = readInt();
-                int seedRepsCount = readInt();
-                _init(totalNumNodesAllowed, totalNumMovesAllowed, threadCount, seedRepsCount);
-            } else if (firstTwo('s', 'e')) {
-                int d1 = readInt();
-                _setupEvaluation(d1, inLine + inLinePos);
-            } else if (firstTwo('e', '0')) {
-                _evaluateStart();
-            } else if (firstTwo('e', '1')) {
-                _evaluateStop();
-            } else if (firstTwo('e', 't')) {
-                int timeLimitMS = readInt();
-                _evaluateTime(timeLimitMS);
-            } else if (firstTwo('g', 'd')) {
-                _getOutputData();
-            }
-            // in 100000 1000000 10 500
-            // se 50 -1 -1 -1 -1 5 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 -1 11 -1 -1 -1 -1 0 0 0 0 -1 0 4 60 -1 -1 0 0 
-            
-            // Finish and print the outLine.
-            outLine[outLinePos] = '\n';
-            outLinePos++;
-            outLine[outLinePos] = '\0';
-            outLinePos++;
-            printf(outLine);
-            fflush(stdout);
+            }
+
+            printOutLine();
+
+            if (next == COMMAND_BINARY) {
+                runBinaryProtocol();
+                stopPushThread();
+                killAllThreads();
+                return 0;
+            }
         }
     }
 
-    SetConsoleOutputCP(CP_UTF8); // unicode display
+#if !ENGINE_HEADLESS
+    setupConsole(); // unicode display
 
     init(10000000, 400000000, 10, 500);
 
     runUI();
-    
+#endif
+
+    killAllThreads();
     return 0;
 }